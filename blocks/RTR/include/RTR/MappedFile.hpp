@@ -0,0 +1,31 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#pragma once
+
+#include "RTR/tiny_obj_loader.h"
+#include "cinder/Filesystem.h"
+
+namespace rtr {
+
+/// \brief Read-only memory mapping of a whole file. Pages are loaded lazily
+/// by the OS when they are first touched. Wraps the mapping of the OBJ parser
+/// for boost paths, which are wide on Windows.
+class MappedFile
+{
+  public:
+    /// \brief Maps the file. Returns false if it cannot be opened or mapped.
+    bool open(const boost::filesystem::path& file)
+    {
+        return mapped.open(file.c_str());
+    }
+    void close() { mapped.close(); }
+
+    const char* data() const { return mapped.data(); }
+    size_t size() const { return mapped.size(); }
+
+  private:
+    tinyobj::mapped_file mapped;
+};
+}
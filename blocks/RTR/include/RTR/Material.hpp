@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include "RTR/Texture.hpp"
 #include "cinder/gl/gl.h"
 
 namespace rtr {
@@ -82,6 +83,10 @@ class Material
     void texture(const std::string& name,
                  const ci::gl::TextureBaseRef& texture);
 
+    /// \brief Sets a texture that may still be loading. A placeholder is bound
+    /// until it is resident.
+    void texture(const std::string& name, const TextureRef& texture);
+
     void printActiveUniforms()
     {
         for (const auto& au : activeUniforms)
@@ -96,7 +101,7 @@ class Material
 
   private:
     using Map = std::map<std::string, MaterialRef>;
-    using TexturesMap = std::map<std::string, ci::gl::TextureBaseRef>;
+    using TexturesMap = std::map<std::string, TextureRef>;
 
     friend class Shape;
     friend class WatchThis;
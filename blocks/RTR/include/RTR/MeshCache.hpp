@@ -0,0 +1,172 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#pragma once
+
+#include "RTR/MappedFile.hpp"
+#include "RTR/MeshOptimizer.hpp"
+#include "RTR/tiny_obj_loader.h"
+#include "cinder/AxisAlignedBox.h"
+#include "cinder/GeomIo.h"
+#include "cinder/Sphere.h"
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+
+namespace rtr {
+
+/// \brief The cache directory of the user, which receives the .rtrmesh and
+/// .rtrtex cache files unless loaders are given another one:
+/// %LOCALAPPDATA%\RTR\Cache on Windows, $XDG_CACHE_HOME/rtr or
+/// ~/.cache/rtr elsewhere. Asset directories are never written to.
+boost::filesystem::path defaultCacheDirectory();
+
+/// \brief Returns the cache file for a source file, with the given suffix
+/// appended to its name, in the directory, or in defaultCacheDirectory() if
+/// the directory is empty.
+boost::filesystem::path cacheFilePath(
+  const boost::filesystem::path& source, const std::string& suffix,
+  const boost::filesystem::path& directory = boost::filesystem::path());
+
+/// \brief Returns the cache file for a source file and loader options.
+boost::filesystem::path meshCachePath(
+  const boost::filesystem::path& source, bool normalize,
+  const boost::filesystem::path& directory = boost::filesystem::path());
+
+/// \brief Writes a cache file with write(), creating its directory. The
+/// contents go to a temporary file unique to the process and the call, which
+/// is renamed to file once it is complete, so that readers never see a
+/// partially written file and concurrent writers do not interfere. Returns
+/// false on failure.
+bool writeCacheFile(const boost::filesystem::path& file,
+                    const std::function<void(std::ostream&)>& write);
+
+/// \brief Fast 64 bit hash of a block of memory. Not cryptographic.
+uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 0);
+
+/// \brief Hashes the contents of a file with hashBytes(). Returns false if
+/// the file cannot be read.
+bool hashFile(const boost::filesystem::path& file, uint64_t& hash);
+
+/// \brief An attribute of an interleaved vertex. Offset in floats.
+struct MeshAttribute
+{
+    ci::geom::Attrib attrib;
+    uint8_t dims;
+    uint32_t offset;
+};
+
+/// \brief Indices [first, first + count) are drawn with a material. Material
+/// -1 stands for faces without a material.
+struct MeshRange
+{
+    int32_t material;
+    uint32_t first;
+    uint32_t count;
+};
+
+/// \brief A simplified version of a shape. Its indices follow those of the
+/// full shape in the same index buffer, with one range per range of the full
+/// shape, in the same order.
+struct MeshLod
+{
+    /// Upper bound of the distance to the full shape, in model units.
+    float error;
+    std::vector<MeshRange> ranges;
+};
+
+/// \brief Indices [first, first + count) of the full shape are a cluster of
+/// triangles within one range that is culled on its own.
+struct MeshCluster
+{
+    uint32_t first;
+    uint32_t count;
+    ClusterBounds bounds;
+};
+
+/// \brief A shape whose full ranges are [firstRange, firstRange + numRanges)
+/// of the streams it shares with other shapes.
+struct MeshPart
+{
+    uint32_t firstRange;
+    uint32_t numRanges;
+    ci::Sphere bounds;
+    /// Coarser levels of detail, finest first. Their indices are included in
+    /// the streams.
+    std::vector<MeshLod> lods;
+};
+
+/// \brief The final interleaved vertices and indices of shapes with the same
+/// attributes, as they are uploaded to the GPU. The shapes share the vertices
+/// and draw ranges of the indices. Does not own its data.
+struct MeshStreams
+{
+    std::vector<MeshRange> ranges;
+    std::vector<MeshPart> parts;
+    uint32_t numVertices;
+    uint32_t stride; ///< Floats per vertex.
+    std::vector<MeshAttribute> attributes;
+    const float* vertices;
+    uint32_t numIndices;
+    const uint32_t* indices;
+    /// Clusters of the full shapes in the order of their indices.
+    uint32_t numClusters;
+    const MeshCluster* clusters;
+};
+
+/// \brief Loader options that change the cached streams, or-ed together. A
+/// cache file built with other options is rebuilt.
+enum MeshCacheFlags : uint32_t
+{
+    MESH_NORMALIZED = 1,
+    MESH_OPTIMIZED = 2,
+    MESH_WELDED = 4,
+    MESH_LODS = 8,
+    MESH_CLUSTERED = 16
+};
+
+/// \brief A file the cached model was built from, besides the OBJ file
+/// itself.
+struct MeshCacheDependency
+{
+    boost::filesystem::path file;
+    uint64_t hash;
+};
+
+/// \brief A memory-mapped .rtrmesh file. The streams point directly into the
+/// mapping and stay valid as long as the object lives.
+class MeshCacheFile
+{
+  public:
+    /// \brief Maps the cache file. Returns false if it does not exist, is
+    /// invalid, or was not built from a source with the given content hash
+    /// and options, or if one of its dependencies changed since.
+    bool open(const boost::filesystem::path& file, uint64_t sourceHash,
+              uint32_t flags);
+
+    const std::vector<tinyobj::material_t>& materials() const
+    {
+        return materials_;
+    }
+    const std::vector<MeshStreams>& shapes() const { return shapes_; }
+    /// The bounds of the vertex positions of the source file.
+    const ci::AxisAlignedBox& bounds() const { return bounds_; }
+
+  private:
+    bool read(uint64_t sourceHash, uint32_t flags);
+
+    MappedFile file;
+    std::vector<tinyobj::material_t> materials_;
+    std::vector<MeshStreams> shapes_;
+    ci::AxisAlignedBox bounds_;
+};
+
+/// \brief Writes a .rtrmesh file. Returns false on failure.
+bool writeMeshCache(const boost::filesystem::path& file, uint64_t sourceHash,
+                    uint32_t flags, const ci::AxisAlignedBox& bounds,
+                    const std::vector<MeshCacheDependency>& dependencies,
+                    const std::vector<tinyobj::material_t>& materials,
+                    const std::vector<MeshStreams>& shapes);
+}
@@ -0,0 +1,136 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace rtr {
+
+/// \brief Entries of the simulated post-transform vertex cache.
+const unsigned int vertexCacheSize = 16;
+
+/// \brief Transformed vertex counts of an index buffer drawn through a FIFO
+/// post-transform cache.
+struct VertexCacheStats
+{
+    size_t triangles = 0;
+    size_t vertices = 0; ///< Distinct vertices referenced.
+    size_t misses = 0;
+
+    /// \brief Average cache miss ratio, transformed vertices per triangle.
+    /// 3 at worst, around 0.6 for well ordered meshes.
+    float acmr() const { return triangles ? float(misses) / triangles : 0; }
+
+    /// \brief Average transformed vertex ratio, transforms per vertex. 1 at
+    /// best.
+    float atvr() const { return vertices ? float(misses) / vertices : 0; }
+
+    VertexCacheStats& operator+=(const VertexCacheStats& other);
+};
+
+/// \brief Simulates drawing the triangles through a FIFO vertex cache.
+VertexCacheStats analyzeVertexCache(const uint32_t* indices, size_t numIndices,
+                                    size_t numVertices,
+                                    unsigned int cacheSize = vertexCacheSize);
+
+/// \brief Merges interleaved vertices whose components are all bit-identical,
+/// or differ by at most epsilon. Candidates are looked up in a spatial hash on
+/// the positions, which must be the first three floats of a vertex, so this
+/// runs in expected linear time. Keeps the first vertex of each group,
+/// remaps the indices and returns the new number of vertices.
+uint32_t weldVertices(std::vector<float>& vertices, size_t stride,
+                      uint32_t* indices, size_t numIndices,
+                      float epsilon = 0.0f);
+
+/// \brief Removes triangles that reference a vertex twice or have no area.
+/// Positions are given by pointer and stride in floats. Returns the new
+/// number of indices.
+size_t removeDegenerateTriangles(uint32_t* indices, size_t numIndices,
+                                 const float* positions, size_t stride);
+
+/// \brief Reorders the triangles for locality in the post-transform cache,
+/// using Tipsify (Sander et al., "Fast Triangle Reordering for Vertex Locality
+/// and Reduced Overdraw", 2007). Runs in linear time. If clusters is given,
+/// it receives the first triangle of each run that starts with a cold cache.
+void optimizeVertexCache(uint32_t* indices, size_t numIndices,
+                         size_t numVertices,
+                         unsigned int cacheSize = vertexCacheSize,
+                         std::vector<uint32_t>* clusters = nullptr);
+
+/// \brief Splits the clusters from optimizeVertexCache() further where that
+/// costs little cache efficiency, then sorts them so that clusters that face
+/// away from the center of the mesh come first. This lets early depth tests
+/// reject more of the clusters drawn later. The ACMR grows by at most about
+/// the threshold factor.
+void optimizeOverdraw(uint32_t* indices, size_t numIndices,
+                      const float* positions, size_t stride, size_t numVertices,
+                      const std::vector<uint32_t>& clusters,
+                      unsigned int cacheSize = vertexCacheSize,
+                      float threshold = 1.05f);
+
+/// \brief Limits of the clusters built by buildClusters(), as for meshlets.
+const unsigned int clusterVertices = 64;
+const unsigned int clusterTriangles = 124;
+
+/// \brief Splits the triangles into consecutive runs of at most maxVertices
+/// distinct vertices and maxTriangles triangles. Keeps the order of the
+/// triangles, which after optimizeVertexCache() keeps the runs compact.
+/// Returns the first index of each run.
+std::vector<uint32_t>
+buildClusters(const uint32_t* indices, size_t numIndices, size_t numVertices,
+              unsigned int maxVertices = clusterVertices,
+              unsigned int maxTriangles = clusterTriangles);
+
+/// \brief Bounding sphere and normal cone of a cluster of triangles.
+struct ClusterBounds
+{
+    float center[3];
+    float radius;
+    /// The normals of the triangles are within the cone around the axis
+    /// whose half angle has this sine. 1 if they are not within 90 degrees.
+    /// The triangles all face away from an eye at e if
+    /// dot(center - e, coneAxis) > coneCutoff * length(center - e) + radius.
+    float coneAxis[3];
+    float coneCutoff;
+};
+
+ClusterBounds clusterBounds(const uint32_t* indices, size_t numIndices,
+                            const float* positions, size_t stride);
+
+/// \brief Simplifies the triangles by collapsing edges onto one of their
+/// vertices, cheapest first by quadric error metrics (Garland and Heckbert,
+/// "Surface Simplification Using Quadric Error Metrics", 1997). Collapses that
+/// would flip a triangle are rejected. Vertices on the border of the
+/// triangles and vertices that share their position with another vertex, such
+/// as texture seams, do not move. Returns at most targetIndices indices into
+/// the same vertices, unless the border prevents it. error receives an upper
+/// bound of the distance between the result and the original surface.
+std::vector<uint32_t> simplifyMesh(const uint32_t* indices, size_t numIndices,
+                                   const float* positions, size_t stride,
+                                   size_t numVertices, size_t targetIndices,
+                                   float* error = nullptr);
+
+/// \brief Computes the tangents and bitangents of the vertices like
+/// ci::geom::calculateTangents(): the sums of the texture space directions of
+/// the triangles around each vertex, orthogonalized to its normal and
+/// normalized. Positions and normals are three floats, texture coordinates
+/// two. All of them are read from and the results written to interleaved
+/// vertices, stride is in floats. Compute them after welding, so that each
+/// vertex sums up the directions of all the triangles around it. Triangles
+/// without texture space area and vertices without triangles contribute or
+/// get zero vectors. Large meshes are processed on all cores.
+void computeTangents(const uint32_t* indices, size_t numIndices,
+                     size_t numVertices, const float* positions,
+                     const float* normals, const float* texCoords,
+                     float* tangents, float* bitangents, size_t stride);
+
+/// \brief Reorders the interleaved vertices in the order the indices first
+/// reference them and remaps the indices. Unreferenced vertices are dropped.
+/// Returns the new number of vertices.
+uint32_t optimizeVertexFetch(std::vector<float>& vertices, size_t stride,
+                             uint32_t* indices, size_t numIndices);
+}
@@ -9,10 +9,64 @@
 
 namespace rtr {
 
+/// \brief Settings of a single loadObjFile() call. Those that change the
+/// built meshes select the .rtrmesh cache file, so that models loaded with
+/// different options never share one.
+struct ObjLoadOptions
+{
+    /// Normalize by rewriting the vertices instead of by the model's
+    /// transform. Models far from the origin need it if programs read their
+    /// positions as half floats.
+    bool bakeNormalization = false;
+    /// Read and write the binary .rtrmesh cache of the model.
+    bool cache = true;
+    /// Receives the .rtrmesh and .rtrtex cache files. If empty, they go to
+    /// defaultCacheDirectory().
+    boost::filesystem::path cacheDirectory;
+    /// Drop degenerate triangles and reorder the triangles and vertices of
+    /// each shape for the vertex cache and for overdraw.
+    bool optimize = true;
+    /// Merge vertices that have the same attribute values but were given as
+    /// different index triples.
+    bool weld = true;
+    /// Largest difference per attribute component of welded vertices. 0
+    /// welds only bit-identical vertices, which is lossless.
+    float weldEpsilon = 0.0f;
+    /// Build a chain of coarser levels of detail for each shape.
+    bool lods = true;
+    /// Split the triangles of each shape into small clusters that are culled
+    /// on their own.
+    bool clusters = true;
+    /// Give each shape a TriangleBvh for picking.
+    bool triangleBvhs = true;
+    /// Load textures as block compressed mip chains, see
+    /// TextureLoader::load().
+    bool compressTextures = true;
+};
+
 /**
  * \brief Loads a Wavefront OBJ file from the file system and returns a
- * rtr::Model object.
+ * rtr::Model object. If normalize is set, the model's transform centers it at
+ * the origin and scales its longest side to 2. The vertices keep their
+ * coordinates, unless options.bakeNormalization is set. Shapes with the same
+ * attributes share vertex buffers of up to maxShortIndexVertices vertices and
+ * draw ranges of their indices. With options.triangleBvhs, each shape gets a
+ * TriangleBvh for picking, which is built in the background after loading,
+ * see buildTriangleBvhs().
+ *
+ * Textures load in the background and are drawn as placeholders until they
+ * are uploaded. Call textureLoader.update() once per frame, or
+ * textureLoader.finish() after loading to block until they are resident.
+ * Materials also upload pending textures when they are bound.
  */
 ModelRef loadObjFile(const boost::filesystem::path& file, bool normalize = true,
+                     const ObjLoadOptions& options = ObjLoadOptions(),
                      const ci::gl::GlslProgRef& shader = ci::gl::GlslProgRef());
+
+/// \brief Loads with the default options.
+inline ModelRef loadObjFile(const boost::filesystem::path& file,
+                            bool normalize, const ci::gl::GlslProgRef& shader)
+{
+    return loadObjFile(file, normalize, ObjLoadOptions(), shader);
+}
 }
@@ -4,6 +4,13 @@
 
 #pragma once
 
+#include "RTR/MeshCache.hpp"
+#include "RTR/MeshOptimizer.hpp"
 #include "RTR/ObjLoader.hpp"
+#include "RTR/RenderQueue.hpp"
 #include "RTR/SceneGraph.hpp"
+#include "RTR/Texture.hpp"
+#include "RTR/TextureCompression.hpp"
+#include "RTR/TriangleBvh.hpp"
+#include "RTR/VertexFormat.hpp"
 #include "RTR/WatchThis.hpp"
@@ -0,0 +1,112 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#pragma once
+
+#include "cinder/gl/gl.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace rtr {
+
+class Material;
+
+/// \brief What the last submit of a render queue drew, and the state
+/// changes it took.
+struct RenderStats
+{
+    size_t items = 0;         ///< Draw calls.
+    size_t materialBinds = 0; ///< Calls of Material::bind().
+    size_t vaoBinds = 0;      ///< Vertex arrays bound.
+    size_t matrices = 0;      ///< Model matrices set.
+};
+
+///
+/// \brief Collects draw calls and issues them sorted by the state they need,
+/// so that consecutive draws with the same material, vertex array or model
+/// matrix do not set it again. Each item has a 64-bit key. From the most
+/// significant bits down, the key holds the pass, the program, the material,
+/// the batch and the depth of the item in view space. Items are radix sorted
+/// by the key, so the state changes only at key boundaries and draws within
+/// a state go front to back. Passes, programs, materials and batches are
+/// numbered in the order they are first emitted after a reset().
+///
+class RenderQueue
+{
+  public:
+    /// \brief Empties the queue and takes the view and projection matrices
+    /// and the viewport that items are sorted and culled with. Call before
+    /// adding items.
+    void reset();
+
+    /// \brief Adds a model matrix for items to refer to and returns its
+    /// index.
+    uint32_t addMatrix(const glm::mat4& model);
+    const glm::mat4& matrix(uint32_t index) const { return matrices[index]; }
+
+    /// \brief The number of a pass name in the keys of this queue.
+    uint32_t pass(const std::string& name);
+
+    /// \brief Adds a draw of count indices of the batch from first on, all
+    /// of them for a count of -1, with the material and a model matrix.
+    /// Depth is in view space. The material and the batch have to stay
+    /// alive until the queue is submitted.
+    void emit(uint32_t pass, Material* material, ci::gl::Batch* batch,
+              uint32_t matrix, float depth, GLint first = 0,
+              GLsizei count = -1);
+
+    /// \brief Sorts and draws the items and empties the queue. Restores the
+    /// model matrix.
+    void submit();
+
+    const glm::mat4& viewMatrix() const { return view; }
+    const glm::mat4& projectionMatrix() const { return projection; }
+    float viewportHeight() const { return height; }
+
+    size_t size() const { return items.size(); }
+    bool empty() const { return items.empty(); }
+
+    /// \brief What the last submit drew.
+    const RenderStats& stats() const { return stats_; }
+
+  private:
+    struct Item
+    {
+        Material* material;
+        ci::gl::Batch* batch;
+        uint32_t matrix;
+        GLint first;
+        GLsizei count;
+    };
+
+    struct SortEntry
+    {
+        uint64_t key;
+        uint32_t item;
+    };
+
+    uint32_t number(std::unordered_map<const void*, uint32_t>& numbers,
+                    const void* object);
+    void sort();
+
+    glm::mat4 view;
+    glm::mat4 projection;
+    float height = 0.0f;
+
+    std::vector<Item> items;
+    std::vector<SortEntry> keys;
+    std::vector<SortEntry> scratch;
+    std::vector<glm::mat4> matrices;
+
+    std::vector<std::string> passes;
+    std::unordered_map<const void*, uint32_t> programs;
+    std::unordered_map<const void*, uint32_t> materials;
+    std::unordered_map<const void*, uint32_t> batches;
+
+    RenderStats stats_;
+};
+}
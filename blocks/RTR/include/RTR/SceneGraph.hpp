@@ -5,13 +5,22 @@
 #pragma once
 
 #include "RTR/Material.hpp"
+#include "RTR/RenderQueue.hpp"
+#include "RTR/TriangleBvh.hpp"
+#include "RTR/VertexFormat.hpp"
+#include "cinder/Ray.h"
+#include "cinder/Sphere.h"
 #include "cinder/gl/gl.h"
 
+#include <functional>
+#include <future>
 #include <memory>
+#include <unordered_map>
 
 namespace rtr {
 
 class WatchThis;
+class TriangleBvhBuild;
 
 class Drawable;
 using DrawableRef = std::shared_ptr<Drawable>;
@@ -52,6 +61,99 @@ class Drawable
 class Shape;
 using ShapeRef = std::shared_ptr<Shape>;
 
+/// \brief A contiguous range of indices of a mesh that is drawn with its own
+/// material.
+struct MaterialRange
+{
+    MaterialRef material;
+    uint32_t first;
+    uint32_t count;
+};
+
+/// \brief A contiguous range of indices of a mesh.
+struct IndexRange
+{
+    uint32_t first;
+    uint32_t count;
+};
+
+/// \brief A version of a shape's geometry, drawn from index ranges of the
+/// shape's meshes. Holds one range per material range of the shape, or a
+/// single range for shapes drawn as a whole.
+struct LevelOfDetail
+{
+    /// Upper bound of the distance to the full geometry, in model units.
+    float error;
+    std::vector<IndexRange> ranges;
+};
+
+/// \brief A small cluster of triangles of a shape's full geometry, culled
+/// on its own against the view frustum and when it faces away from the eye.
+struct TriangleCluster
+{
+    ci::Sphere bounds;
+    /// The normals of the triangles are within the cone around the axis
+    /// whose half angle has this sine, 1 if there is no such cone.
+    ci::vec3 coneAxis;
+    float coneCutoff;
+    IndexRange indices;
+};
+
+/// \brief The planes of a view frustum, facing inward, extracted from a
+/// model-view-projection matrix (Gribb and Hartmann). They are in the space
+/// the matrix maps from.
+struct ViewFrustum
+{
+    explicit ViewFrustum(const glm::mat4& modelViewProjection);
+
+    enum class Containment
+    {
+        OUTSIDE,
+        INTERSECTING,
+        INSIDE
+    };
+
+    /// \brief Where the box is, conservatively. Boxes near a corner of the
+    /// frustum may be reported as intersecting although they are outside.
+    Containment test(const glm::vec3& min, const glm::vec3& max) const;
+    bool intersects(const ci::Sphere& sphere) const;
+
+    glm::vec4 planes[6];
+};
+
+/// \brief Enables or disables culling nodes whose bounds are outside the
+/// view frustum. Enabled by default.
+void enableFrustumCulling(bool enable);
+bool frustumCullingEnabled();
+
+/// \brief Enables or disables drawing nodes through a RenderQueue, which
+/// sorts the draws of all shapes below a node by state. Disabled, each shape
+/// is drawn on its own in traversal order. Enabled by default. Shapes and
+/// models drawn on their own never go through a queue.
+void enableRenderQueue(bool enable);
+bool renderQueueEnabled();
+
+/// \brief Enables or disables culling the clusters of shapes. Enabled by
+/// default.
+void enableClusterCulling(bool enable);
+bool clusterCullingEnabled();
+
+/// \brief Sets how far, in pixels, a level of detail may deviate from the
+/// full geometry on screen. Shapes draw the coarsest level within this error.
+/// 1 by default.
+void setLodErrorPixels(float pixels);
+float lodErrorPixels();
+
+/// \brief Shapes whose bounds cover less than this diameter on screen, in
+/// pixels, are not drawn. 1 by default, 0 draws everything.
+void setCullPixels(float pixels);
+float cullPixels();
+
+/// \brief Meshes of a shape are built with just the attributes the program of
+/// a pass consumes, in the encodings it declares. See vertexFormat(). If a
+/// program is replaced by one that consumes other attributes, the meshes are
+/// rebuilt on the next draw. Shapes created from ready-made meshes cannot be
+/// rebuilt.
 class Shape : public Drawable
 {
   public:
@@ -62,6 +164,12 @@ class Shape : public Drawable
     Shape(const std::vector<std::reference_wrapper<const ci::geom::Source>>&
             sources,
           const MaterialRef& material);
+    Shape(const ci::gl::VboMeshRef& vboMesh,
+          const std::vector<MaterialRange>& ranges);
+    Shape(const std::vector<MeshBuilderRef>& builders,
+          const MaterialRef& material);
+    Shape(const MeshBuilderRef& builder,
+          const std::vector<MaterialRange>& ranges);
 
     static ShapeRef create(const std::vector<ci::gl::VboMeshRef>& vboMeshes,
                            const MaterialRef& material);
@@ -69,17 +177,72 @@ class Shape : public Drawable
       const std::vector<std::reference_wrapper<const ci::geom::Source>>&
         sources,
       const MaterialRef& material);
+    static ShapeRef create(const ci::gl::VboMeshRef& vboMesh,
+                           const std::vector<MaterialRange>& ranges);
+    static ShapeRef create(const std::vector<MeshBuilderRef>& builders,
+                           const MaterialRef& material);
+    static ShapeRef create(const MeshBuilderRef& builder,
+                           const std::vector<MaterialRange>& ranges);
 
+    /// \brief Draws right away with the current matrices, without a
+    /// RenderQueue. Consecutive draws with the same material bind it once.
     void draw() override;
     void draw(const std::string& pass) override;
 
+    /// \brief Adds the draws of the pass to the queue instead of drawing
+    /// them, with the model matrix at the index in the queue. Levels of
+    /// detail and clusters are selected with the matrices of the queue.
+    void enqueue(RenderQueue& queue, const std::string& pass,
+                 uint32_t matrix);
+
     void setMaterialForPass(const std::string& pass,
                             const MaterialRef& material);
     void setPassMaterials(const MaterialMap& passMaterials);
 
+    /// \brief Draws the index ranges of the first mesh with their own
+    /// materials during the default 'surface' pass. Ranges that share a
+    /// program share a batch.
+    void setMaterialRanges(const std::vector<MaterialRange>& ranges);
+
     void replaceMaterial(const MaterialRef& material);
     void replaceProgram(const ci::gl::GlslProgRef& program);
 
+    /// \brief Sets the bounding sphere of the shape in model space. Shapes
+    /// with bounds are culled when they are smaller than cullPixels() on
+    /// screen, and nodes when their bounds are outside the view. A radius of
+    /// 0 disables culling. Shapes built from sources or mesh builders start
+    /// with the bounds of their positions, shapes from ready-made meshes
+    /// without bounds.
+    void setBounds(const ci::Sphere& bounds);
+    const ci::Sphere& bounds() const { return bounds_; }
+
+    /// \brief Sets the levels of detail, finest first. The first level is the
+    /// full geometry with an error of 0. Needs bounds. Each draw picks the
+    /// coarsest level whose error covers at most lodErrorPixels() on screen,
+    /// with some hysteresis so that shapes at the threshold do not flicker
+    /// between levels.
+    void setLevelsOfDetail(const std::vector<LevelOfDetail>& levels);
+
+    /// \brief Sets the clusters of the full geometry. When the first level
+    /// of detail is drawn, clusters outside the view frustum or facing away
+    /// from the eye are left out of the index ranges.
+    void setClusters(const std::vector<TriangleCluster>& clusters);
+
+    /// \brief Sets the hierarchy over the triangles of the shape in model
+    /// space that Node::pick() tests rays against. Shapes without one are
+    /// not picked.
+    void setTriangleBvh(const TriangleBvhRef& bvh);
+
+    /// \brief Sets a function that builds the hierarchy, either in the
+    /// background with buildTriangleBvhs() or on the first call of
+    /// triangleBvh(). It has to keep the triangles it builds from alive.
+    void setTriangleBvhSource(const std::function<TriangleBvhRef()>& source);
+
+    /// \brief The hierarchy over the triangles. Waits for it if it is being
+    /// built in the background, and builds it if it has a source that was not
+    /// built yet.
+    const TriangleBvhRef& triangleBvh();
+
     MaterialRef material();
     MaterialRef material(const std::string& pass);
 
@@ -87,32 +250,84 @@ class Shape : public Drawable
     void watchMe();
 
     std::vector<ci::gl::VboMeshRef> vboMeshes;
+    std::vector<MeshBuilderRef> builders;
+    std::map<VertexFormat, std::vector<ci::gl::VboMeshRef>> formatMeshes;
+
+    struct Range
+    {
+        MaterialRef material;
+        ci::gl::BatchRef batch;
+        GLint first;
+        GLsizei count;
+    };
 
     struct Pass
     {
         MaterialRef material;
+        /// The level of detail drawn last.
+        size_t lod = 0;
         std::vector<ci::gl::BatchRef> batches;
+        /// The programs the meshes of the batches were built for.
+        std::vector<ci::gl::GlslProgRef> programs;
+        /// If not empty, the ranges are drawn instead of the batches.
+        std::vector<Range> ranges;
     };
 
     using PassSet = std::map<std::string, Pass>;
 
+    const std::vector<ci::gl::VboMeshRef>& meshes(
+      const ci::gl::GlslProgRef& program);
+    void updateMeshes(Pass& pass);
+    void pruneMeshes();
+    bool selectLod(size_t& lod, const glm::mat4& modelView,
+                   const glm::mat4& projection, float viewportHeight);
+    template <typename Draw>
+    void draws(Pass& pass, const glm::mat4& modelView,
+               const glm::mat4& projection, float viewportHeight, Draw draw);
+
     PassSet passes;
+    ci::Sphere bounds_ = ci::Sphere(ci::vec3(0.0f), 0.0f);
+    std::vector<LevelOfDetail> levels;
+    std::vector<TriangleCluster> clusters;
+    TriangleBvhRef triangleBvh_;
+    std::function<TriangleBvhRef()> triangleBvhSource;
+    /// Set while the hierarchy is built in the background.
+    std::shared_future<TriangleBvhRef> triangleBvhFuture;
+    std::shared_ptr<TriangleBvhBuild> triangleBvhBuild;
+
+    friend void buildTriangleBvhs(const std::vector<ShapeRef>& shapes);
 };
 
+/// \brief Starts building the hierarchies of the shapes that have a source
+/// on background threads, one shape per thread at a time, and returns right
+/// away. Picks wait only for the shapes they hit that are still building.
+/// Destroying the shapes cancels the builds that have not started yet.
+void buildTriangleBvhs(const std::vector<ShapeRef>& shapes);
+
 class Model;
 using ModelRef = std::shared_ptr<Model>;
 
 class Model : public Drawable
 {
   public:
-    Model(const std::vector<ShapeRef>& shapes);
+    Model(const std::vector<ShapeRef>& shapes,
+          const glm::mat4& transform = glm::mat4());
 
-    static ModelRef create(const std::vector<ShapeRef>& shapes);
+    static ModelRef create(const std::vector<ShapeRef>& shapes,
+                           const glm::mat4& transform = glm::mat4());
 
     void draw() override;
     void draw(const std::string& pass) override;
 
+    /// \brief Replace the shapes or the transform. Nodes cache the bounds of
+    /// their models, which these update. Assigning the fields directly is
+    /// only safe before the model is added to a node.
+    void setShapes(const std::vector<ShapeRef>& shapes);
+    void setTransform(const glm::mat4& transform);
+
     std::vector<ShapeRef> shapes;
+    /// Applied to the shapes, for example to normalize a loaded model.
+    glm::mat4 transform;
 };
 
 class Node;
@@ -124,6 +339,142 @@ struct Transformed
     NodeRef node;
 };
 
+/// \brief What the last draw of a node culled.
+struct CullStats
+{
+    size_t instances = 0; ///< Instances in the hierarchy.
+    size_t tested = 0;    ///< Bounds tested against the frustum.
+    size_t culled = 0;    ///< Instances skipped as outside.
+    size_t drawn = 0;     ///< Instances whose models were drawn.
+};
+
+/// \brief The closest triangle a ray hits below a node.
+struct PickResult
+{
+    NodeRef node;
+    /// The instance of the node in the hierarchy of the node picked from.
+    size_t instance = 0;
+    ModelRef model;
+    ShapeRef shape;
+    /// The triangle of the indices of the shape's meshes, that is, the
+    /// index of its first index divided by 3.
+    uint32_t triangle = 0;
+    /// Weights of the second and the third vertex of the triangle.
+    glm::vec2 barycentrics;
+    /// Along the ray, in units of its direction.
+    float distance = 0.0f;
+    /// Where the ray hits, in the space of the ray.
+    glm::vec3 position;
+};
+
+///
+/// \brief The world transforms of every instance of the nodes below a root,
+/// flattened into arrays in depth-first order, so that each instance comes
+/// after its parent. A node that is a child of several parents has an
+/// instance under each of them. World transforms are cached and only
+/// recomputed below instances whose nodes' transforms changed, in one linear
+/// sweep. Updating costs nothing if no node changed. The instances of each
+/// node are indexed, so its world transforms are looked up without a
+/// traversal. Each instance also has bounds in world space around its models
+/// and everything below it, which are updated on demand.
+///
+class TransformHierarchy
+{
+  public:
+    /// \brief Instances of one node, in depth-first order.
+    class Instances
+    {
+      public:
+        Instances(const uint32_t* first, const uint32_t* last)
+          : first(first)
+          , last(last)
+        {
+        }
+
+        const uint32_t* begin() const { return first; }
+        const uint32_t* end() const { return last; }
+        size_t size() const { return size_t(last - first); }
+        bool empty() const { return first == last; }
+
+      private:
+        const uint32_t* first;
+        const uint32_t* last;
+    };
+
+    explicit TransformHierarchy(const Node* root);
+
+    /// \brief Brings the world transforms up to date. Rebuilds the arrays if
+    /// the children of any node changed since the last update.
+    void update();
+
+    size_t size() const { return nodes.size(); }
+    const Node* node(size_t instance) const { return nodes[instance]; }
+    /// The instance of the parent, or -1 for the root.
+    int32_t parent(size_t instance) const { return parents[instance]; }
+    const glm::mat4& world(size_t instance) const { return worlds[instance]; }
+
+    /// \brief The number of instances below the instance, itself included.
+    /// They follow it.
+    uint32_t extent(size_t instance) const { return extents[instance]; }
+
+    /// \brief Brings the bounds up to date after update(). Only instances
+    /// whose world transforms changed and those above them are recomputed.
+    void updateBounds();
+
+    /// \brief Tests the bounds of the instance and everything below it.
+    /// Instances with shapes without bounds always intersect.
+    ViewFrustum::Containment test(size_t instance,
+                                  const ViewFrustum& frustum) const;
+    /// \brief Tests the bounds of the models of the instance alone.
+    bool modelsVisible(size_t instance, const ViewFrustum& frustum) const;
+
+    /// \brief Whether the ray enters the bounds of the instance and
+    /// everything below it in front of its origin and before maxDistance.
+    bool intersects(size_t instance, const ci::Ray& ray,
+                    float maxDistance) const;
+    /// \brief The same for the bounds of the models of the instance alone.
+    bool modelsIntersect(size_t instance, const ci::Ray& ray,
+                         float maxDistance) const;
+
+    /// \brief The instances of the node, empty if it is not below the root.
+    /// Looked up in constant time without allocating, valid until the next
+    /// update. Follow parent() from an instance for its path to the root.
+    Instances instances(const Node* node) const;
+
+  private:
+    void build();
+    void updateModelBounds();
+
+    enum : uint8_t
+    {
+        MODELS_UNBOUNDED = 1,
+        UNBOUNDED = 2
+    };
+
+    const Node* root;
+    std::vector<const Node*> nodes;
+    std::vector<int32_t> parents;
+    std::vector<uint32_t> extents;
+    std::vector<glm::mat4> locals;
+    std::vector<glm::mat4> worlds;
+    std::vector<uint8_t> dirty;
+    /// Bounds of the models in node space, then in world space, then of the
+    /// whole subtree in world space. Empty boxes have min > max.
+    std::vector<glm::vec3> modelMin, modelMax;
+    std::vector<glm::vec3> worldModelMin, worldModelMax;
+    std::vector<glm::vec3> boundsMin, boundsMax;
+    std::vector<uint8_t> unbounded;
+    std::vector<uint8_t> staleBounds;
+    bool boundsChanged = false;
+    /// The instances of each node are [first, first + count) of
+    /// nodeInstances.
+    std::unordered_map<const Node*, std::pair<uint32_t, uint32_t>> index;
+    std::vector<uint32_t> nodeInstances;
+    uint64_t structure = 0;
+    uint64_t epoch = 0;
+    uint64_t modelBoundsVersion = 0;
+};
+
 class Node : public Drawable, public std::enable_shared_from_this<Node>
 {
   public:
@@ -135,13 +486,71 @@ class Node : public Drawable, public std::enable_shared_from_this<Node>
       const glm::mat4& transform = glm::mat4(),
       const std::vector<NodeRef> children = std::vector<NodeRef>());
 
+    /// \brief Draws the models of all nodes below with the world transforms
+    /// of a TransformHierarchy that the node keeps for this. Subtrees whose
+    /// bounds are outside the frustum of the current matrices are skipped.
+    /// The draws go through a RenderQueue while renderQueueEnabled().
     void draw() override;
     void draw(const std::string& pass) override;
 
+    /// \brief Draws, culling against a frustum in the space the node is
+    /// drawn in, as given by the current model matrix.
+    void draw(const std::string& pass, const ViewFrustum& frustum);
+
+    /// \brief Adds the draws of the shapes below the node that are not
+    /// culled to the queue, for example to sort the draws of several nodes
+    /// or passes together.
+    void enqueue(RenderQueue& queue, const std::string& pass,
+                 const ViewFrustum& frustum);
+
+    /// \brief The queue the node draws through, with the stats of the last
+    /// draw.
+    const RenderQueue& renderQueue() const { return queue; }
+
+    /// \brief What the last draw culled.
+    const CullStats& cullStats() const { return stats; }
+
+    /// \brief Finds the closest triangle the ray hits among the shapes below
+    /// the node that have a TriangleBvh. The ray is in the space the node is
+    /// drawn in. Subtrees whose bounds the ray misses, or enters behind the
+    /// closest hit so far, are skipped. Returns false if nothing is hit.
+    bool pick(const ci::Ray& ray, PickResult& result);
+
+    /// \brief The world transforms of all instances of the node below this
+    /// one. Prefer transforms().instances(), which does not allocate.
     std::vector<Transformed> find(const NodeRef& node);
 
-    std::vector<ModelRef> models;
-    glm::mat4 transform;
-    std::vector<NodeRef> children;
+    /// \brief The transform hierarchy below the node, brought up to date.
+    const TransformHierarchy& transforms();
+
+    /// \brief The transform relative to the parents. Setting it marks the
+    /// world transforms below as stale.
+    const glm::mat4& transform() const { return transform_; }
+    void setTransform(const glm::mat4& transform);
+
+    /// \brief The children. Changing them makes the hierarchies rebuild.
+    const std::vector<NodeRef>& children() const { return children_; }
+    void setChildren(const std::vector<NodeRef>& children);
+    void addChild(const NodeRef& child);
+    void removeChild(const NodeRef& child);
+
+    /// \brief The models. Changing them makes the hierarchies rebuild.
+    const std::vector<ModelRef>& models() const { return models_; }
+    void setModels(const std::vector<ModelRef>& models);
+
+  private:
+    friend class TransformHierarchy;
+
+    template <typename Visit>
+    void visit(const ViewFrustum& frustum, Visit visitInstance);
+
+    std::vector<ModelRef> models_;
+    glm::mat4 transform_;
+    std::vector<NodeRef> children_;
+    /// The transform epoch of the last change of the transform.
+    uint64_t changed = 0;
+    std::unique_ptr<TransformHierarchy> hierarchy;
+    CullStats stats;
+    RenderQueue queue;
 };
 }
@@ -0,0 +1,213 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#pragma once
+
+#include "RTR/TextureCompression.hpp"
+#include "cinder/Surface.h"
+#include "cinder/gl/gl.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace rtr {
+
+class Texture;
+using TextureRef = std::shared_ptr<Texture>;
+
+///
+/// \brief A 2d texture that may still be loading in the background. Until the
+/// image is resident on the GPU, get() returns a placeholder.
+///
+class Texture
+{
+  public:
+    /// \brief Wraps a texture that is already resident.
+    static TextureRef create(const ci::gl::TextureBaseRef& texture);
+
+    /// \brief The texture, or a white 1x1 placeholder if it is not resident
+    /// yet. Must be called on the GL thread.
+    const ci::gl::TextureBaseRef& get() const;
+
+    bool resident() const { return bool(texture_); }
+    const boost::filesystem::path& file() const { return file_; }
+
+    /// \brief GPU memory used by the texture, 0 while it is not resident or
+    /// if it shares the GPU texture of another file with the same content.
+    size_t residentBytes() const { return resident() ? bytes_ : 0; }
+
+  private:
+    friend class TextureLoader;
+    friend class TextureCache;
+
+    boost::filesystem::path file_;
+    ci::gl::TextureBaseRef texture_;
+    size_t bytes_ = 0;
+    /// Loaded as a block compressed mip chain.
+    bool compressed_ = false;
+    /// Content hash of the file, set when it has been loaded.
+    uint64_t hash_ = 0;
+    /// The texture whose GPU texture this one shares, if any.
+    TextureRef source_;
+};
+
+///
+/// \brief Decodes images on a pool of worker threads and uploads them through
+/// pixel buffer objects on the GL thread, a few rows at a time, within a
+/// time budget per frame. Images may be loaded as block compressed mip chains
+/// from the .rtrtex cache instead, see load().
+///
+class TextureLoader
+{
+  public:
+    TextureLoader();
+    ~TextureLoader();
+
+    /// \brief Queues the image file for loading and returns immediately. If
+    /// compress is set, the image is loaded as a block compressed mip chain
+    /// from its .rtrtex file in the cache directory, which is built on the
+    /// first load, see cacheFilePath().
+    TextureRef load(const boost::filesystem::path& file, bool compress = true,
+                    const boost::filesystem::path& cacheDirectory =
+                      boost::filesystem::path());
+
+    /// \brief Uploads decoded images for at most budget seconds. Call once
+    /// per frame on the GL thread. Without it, textures only arrive while
+    /// materials that use them are bound, see poll().
+    void update(double budget = 0.002);
+
+    /// \brief Runs update() if textures are pending and it did not run
+    /// during the last frame or so. Material::bind() calls it for textures
+    /// that are not resident yet, so that they arrive even if nobody calls
+    /// update().
+    void poll();
+
+    /// \brief Blocks until all queued textures are resident or have failed.
+    /// Call on the GL thread, for example after loading a scene, instead of
+    /// showing placeholders.
+    void finish();
+
+    /// \brief Number of textures that are queued, decoding or uploading.
+    size_t pending() const { return pending_; }
+
+    /// \brief Stops the worker threads and drops all queued textures and the
+    /// upload in flight. Call on the GL thread. Loading again restarts the
+    /// workers.
+    void shutdown();
+
+  private:
+    TextureLoader(const TextureLoader&) = delete;
+    TextureLoader& operator=(const TextureLoader&) = delete;
+
+    struct Job
+    {
+        std::weak_ptr<Texture> texture;
+        boost::filesystem::path file;
+        bool compress = true;
+        boost::filesystem::path cacheDirectory;
+        uint64_t hash = 0;
+        ci::Surface8u image;
+        CompressedImage compressed;
+        std::string error;
+    };
+
+    struct Upload
+    {
+        TextureRef texture;
+        ci::Surface8u image;
+        CompressedImage compressed;
+        ci::gl::PboRef pbo;
+        ci::gl::Texture2dRef target;
+        size_t level;
+        int32_t row;
+    };
+
+    void decode();
+    bool beginUpload();
+    void continueUpload();
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::deque<Job> jobs;
+    std::deque<Job> decoded;
+    bool stop;
+
+    Upload upload;
+    std::atomic<size_t> pending_;
+    std::chrono::steady_clock::time_point lastUpdate;
+};
+
+///
+/// \brief Shares textures between materials. Files with identical content
+/// share one GPU texture: the loader hashes each file on its workers, and a
+/// file whose content is resident already reuses that texture instead of
+/// being uploaded again. Textures that no material references anymore are
+/// kept until the resident bytes exceed the budget, then the least recently
+/// requested ones are evicted.
+///
+class TextureCache
+{
+  public:
+    TextureCache();
+
+    /// \brief Returns the cached texture for the file, or starts loading it
+    /// with textureLoader, see TextureLoader::load(). Compressed and plain
+    /// textures of a file are cached separately. The texture is a placeholder
+    /// until it has been uploaded by textureLoader.update(), poll() or
+    /// finish().
+    TextureRef get(const boost::filesystem::path& file, bool compress = true,
+                   const boost::filesystem::path& cacheDirectory =
+                     boost::filesystem::path());
+
+    /// \brief The budget is soft: textures that are in use are never evicted.
+    void setBudget(size_t bytes);
+    size_t budget() const { return budget_; }
+
+    /// \brief Sum of the resident bytes of all cached textures.
+    size_t residentBytes() const;
+
+    /// \brief All cached textures. See Texture::residentBytes().
+    std::vector<TextureRef> textures() const;
+
+    /// \brief Evicts unused textures until the budget is met.
+    void trim();
+
+    /// \brief Evicts all unused textures.
+    void clear();
+
+    /// \brief Drops all textures, also those in use. Materials keep the
+    /// textures they hold.
+    void release();
+
+    /// \brief A cached texture with the content hash and compression that is
+    /// resident and has a GPU texture of its own, or null.
+    TextureRef find(uint64_t hash, bool compressed) const;
+
+  private:
+    struct Entry
+    {
+        TextureRef texture;
+        uint64_t lastUse;
+    };
+
+    /// By file and compression.
+    std::map<std::pair<boost::filesystem::path, bool>, Entry> entries;
+    size_t budget_;
+    uint64_t clock;
+};
+
+extern TextureLoader textureLoader;
+extern TextureCache textureCache;
+
+/// \brief Stops textureLoader and releases the textures of textureCache and
+/// the placeholder. The globals would otherwise release their GL objects and
+/// join their threads during static destruction, after the GL context is
+/// gone. Call from App::cleanup(), after dropping the materials.
+void shutdownTextures();
+}
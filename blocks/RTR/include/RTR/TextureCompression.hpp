@@ -0,0 +1,108 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#pragma once
+
+#include "RTR/MappedFile.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace rtr {
+
+/// \brief Block compressed formats produced by compressImage(). BC1 (DXT1)
+/// stores 4x4 opaque texels in 8 bytes, BC3 (DXT5) stores 4x4 texels with
+/// alpha in 16 bytes.
+enum class BlockFormat : uint32_t
+{
+    BC1 = 1,
+    BC3 = 3
+};
+
+/// \brief One level of a mip chain. Data points into the owning
+/// CompressedImage.
+struct CompressedLevel
+{
+    int32_t width;
+    int32_t height;
+    size_t offset; ///< Offset of the level from the first level.
+    size_t size;
+    const uint8_t* data;
+};
+
+/// \brief A block compressed image with a complete mip chain, either in memory
+/// or mapped from a .rtrtex cache file. Copies share the data.
+class CompressedImage
+{
+  public:
+    CompressedImage();
+
+    BlockFormat format() const { return format_; }
+    int32_t width() const { return levels_.empty() ? 0 : levels_[0].width; }
+    int32_t height() const { return levels_.empty() ? 0 : levels_[0].height; }
+    const std::vector<CompressedLevel>& levels() const { return levels_; }
+
+    /// \brief Size of all levels together.
+    size_t size() const;
+
+    /// \brief The matching GL internal format.
+    unsigned int glInternalFormat() const;
+
+    static size_t blockBytes(BlockFormat format);
+
+  private:
+    friend void compressImage(const uint8_t*, int32_t, int32_t, ptrdiff_t,
+                              CompressedImage&);
+    friend bool readCompressedTexture(const boost::filesystem::path&,
+                                      uint64_t, CompressedImage&);
+
+    void setLevels(BlockFormat format, int32_t width, int32_t height,
+                   const uint8_t* data);
+
+    BlockFormat format_;
+    std::vector<CompressedLevel> levels_;
+    std::shared_ptr<std::vector<uint8_t>> storage;
+    std::shared_ptr<MappedFile> file;
+};
+
+/// \brief Builds the mip chain of an RGBA8 image and compresses every level.
+/// Uses BC1 if all texels are opaque and BC3 otherwise. Rows are stored in
+/// the order given, pass a negative stride to flip the image. Pure CPU code
+/// without any GL dependency.
+void compressImage(const uint8_t* rgba, int32_t width, int32_t height,
+                   ptrdiff_t rowStride, CompressedImage& result);
+
+/// \brief Writes a .rtrtex file. Returns false on failure.
+bool writeCompressedTexture(const boost::filesystem::path& file,
+                            uint64_t sourceHash, const CompressedImage& image);
+
+/// \brief Maps a .rtrtex file. Returns false if it does not exist, is invalid
+/// or was not built from a source with the given content hash.
+bool readCompressedTexture(const boost::filesystem::path& file,
+                           uint64_t sourceHash, CompressedImage& image);
+
+/// \brief Returns the .rtrtex cache file of an image file in the cache
+/// directory, see cacheFilePath().
+boost::filesystem::path compressedTexturePath(
+  const boost::filesystem::path& source,
+  const boost::filesystem::path& cacheDirectory = boost::filesystem::path());
+
+/// \brief Loads the compressed mip chain of an image file from the cache, or
+/// builds and caches it. sourceHash is the hashFile() of the image file. The
+/// image is flipped so that the first row is the bottom row, like
+/// gl::Texture2d does by default. Throws if the image cannot be decoded.
+void loadCompressedTexture(const boost::filesystem::path& source,
+                           uint64_t sourceHash,
+                           const boost::filesystem::path& cacheDirectory,
+                           CompressedImage& image);
+
+/// \brief The bake step: decodes the image file and writes its compressed
+/// mip chain to the cache, unless the cache is up to date already. Returns
+/// false if the image cannot be loaded or the cache cannot be written.
+bool bakeTexture(
+  const boost::filesystem::path& source,
+  const boost::filesystem::path& cacheDirectory = boost::filesystem::path());
+}
@@ -0,0 +1,79 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#pragma once
+
+#include "cinder/Ray.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace rtr {
+
+class TriangleBvh;
+using TriangleBvhRef = std::shared_ptr<TriangleBvh>;
+
+///
+/// \brief A bounding volume hierarchy over the triangles of a mesh for ray
+/// queries. It is built top-down with the surface area heuristic over binned
+/// centroids (Wald, "On fast Construction of SAH-based Bounding Volume
+/// Hierarchies", 2007), large subtrees on all cores. Keeps its own copy of
+/// the triangles in leaf order, 36 bytes per triangle plus 32 bytes per node,
+/// so it does not depend on the mesh afterwards.
+///
+class TriangleBvh
+{
+  public:
+    struct Hit
+    {
+        /// Along the ray, in units of its direction.
+        float distance;
+        /// Index of the first index of the triangle, divided by 3.
+        uint32_t triangle;
+        /// Weights of the second and the third vertex.
+        ci::vec2 barycentrics;
+    };
+
+    /// \brief Builds over the triangles of the indices. Positions are three
+    /// floats, stride is in floats. firstTriangle is added to the triangles
+    /// of hits, for indices that start within a larger index buffer.
+    static TriangleBvhRef create(const uint32_t* indices, size_t numIndices,
+                                 const float* positions, size_t stride,
+                                 uint32_t firstTriangle = 0);
+
+    /// \brief Finds the closest triangle the ray hits in front of its origin
+    /// and before maxDistance. Both faces of a triangle are hit.
+    bool intersect(const ci::Ray& ray, float maxDistance, Hit& hit) const;
+
+    size_t numTriangles() const { return triangles.size(); }
+    size_t numNodes() const { return nodes.size(); }
+
+  private:
+    struct Node
+    {
+        ci::vec3 min;
+        /// The first triangle of a leaf, or the first of the two children.
+        uint32_t first;
+        ci::vec3 max;
+        /// Triangles of a leaf, 0 for inner nodes.
+        uint32_t count;
+    };
+
+    /// A corner and the two edges from it.
+    struct Triangle
+    {
+        ci::vec3 v0;
+        ci::vec3 e1;
+        ci::vec3 e2;
+    };
+
+    friend class BvhBuilder;
+
+    std::vector<Node> nodes;
+    std::vector<Triangle> triangles;
+    /// The triangle of the mesh for each triangle.
+    std::vector<uint32_t> ids;
+};
+}
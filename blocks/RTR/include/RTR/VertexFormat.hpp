@@ -0,0 +1,119 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#pragma once
+
+#include "cinder/GeomIo.h"
+#include "cinder/Sphere.h"
+#include "cinder/gl/gl.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+
+namespace rtr {
+
+/// \brief How an attribute is stored in a vertex buffer. The encoding is
+/// picked by the type a program declares for the attribute.
+enum class AttribEncoding : uint8_t
+{
+    /// 32 bit floats. Declared as float or vecN.
+    FLOAT,
+    /// 16 bit floats, two per int, odd counts padded with 1.0. Declared as
+    /// int for two components (texture coordinates) and ivec2 for three or
+    /// four (positions). Half floats keep about three decimal digits, which
+    /// suits normalized models.
+    HALF,
+    /// A unit vector, octahedral-mapped to two snorm16 in one int. Declared
+    /// as int (normals, tangents and bitangents).
+    OCTAHEDRAL
+};
+
+/// \brief The attributes a vertex buffer holds and their encodings.
+using VertexFormat = std::map<ci::geom::Attrib, AttribEncoding>;
+
+/// \brief The attributes the program consumes and the encodings it declares
+/// for them. Attributes without a semantic are ignored.
+VertexFormat vertexFormat(const ci::gl::GlslProgRef& program);
+
+/// \brief GLSL functions that decode the quantized encodings: vec2
+/// decodeHalf2(int), vec4 decodeHalf4(ivec2) and vec3 decodeOctahedral(int).
+/// Insert after the #version line, GLSL 1.50 is enough.
+extern const char* const vertexDecodeGlsl;
+
+/// \brief How the attributes are arranged in a vertex buffer.
+enum class VertexLayout : uint8_t
+{
+    /// Each attribute in a block of its own.
+    PLANAR,
+    /// All attributes of a vertex next to each other, so that a vertex is
+    /// fetched from as few cache lines as possible. The stride is the sum of
+    /// the encoded sizes of the attributes.
+    INTERLEAVED
+};
+
+/// \brief Sets the layout of the meshes built by MeshBuilder. Interleaved by
+/// default, which suits static meshes.
+void setVertexLayout(VertexLayout layout);
+VertexLayout vertexLayout();
+
+/// \brief One attribute of a set of vertices. Data points at the value of the
+/// first vertex, stride is in floats.
+struct VertexInput
+{
+    ci::geom::Attrib attrib;
+    uint8_t dims;
+    const float* data;
+    size_t stride;
+};
+
+/// \brief Meshes with at most this many vertices get 16 bit indices.
+const uint32_t maxShortIndexVertices = 65536;
+
+/// \brief Packs the attributes the format asks for into one vertex buffer
+/// with the given layout and uploads it along with the indices of the
+/// triangles. The indices are uploaded as 16 bit if there are at most
+/// maxShortIndexVertices vertices, which halves their memory and bandwidth.
+/// Attributes the inputs lack are left out.
+ci::gl::VboMeshRef createVboMesh(
+  uint32_t numVertices, const std::vector<VertexInput>& inputs,
+  uint32_t numIndices, const uint32_t* indices, const VertexFormat& format,
+  VertexLayout layout = VertexLayout::INTERLEAVED);
+
+class MeshBuilder;
+using MeshBuilderRef = std::shared_ptr<MeshBuilder>;
+
+///
+/// \brief Builds a mesh in any vertex format from geometry that is kept on
+/// the CPU side. Shapes use it to build meshes with just the attributes their
+/// programs consume, and to rebuild them when a program is replaced.
+///
+class MeshBuilder
+{
+  public:
+    virtual ~MeshBuilder() {}
+
+    /// \brief Builds a mesh with the current vertexLayout().
+    virtual ci::gl::VboMeshRef build(const VertexFormat& format) const = 0;
+
+    /// \brief A sphere around the positions, computed on first use. A
+    /// radius of 0 if the builder has no positions or cannot tell.
+    virtual ci::Sphere bounds() const;
+
+    /// \brief Builds from a copy of the geometry source.
+    static MeshBuilderRef create(const ci::geom::Source& source);
+
+    /// \brief Builds from vertices and indices in memory that the owner
+    /// keeps alive.
+    static MeshBuilderRef create(uint32_t numVertices,
+                                 const std::vector<VertexInput>& inputs,
+                                 uint32_t numIndices, const uint32_t* indices,
+                                 const std::shared_ptr<const void>& owner);
+
+    /// \brief Builds through the builder, but hands out the same mesh for
+    /// the same format and layout as long as it is in use. Lets the shapes
+    /// whose indices are ranges of one set of vertices share its buffers.
+    static MeshBuilderRef shared(const MeshBuilderRef& builder);
+};
+}
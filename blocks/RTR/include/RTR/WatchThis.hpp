@@ -38,7 +38,16 @@ class WatchThis
     void watch(const ci::gl::GlslProgRef& program,
                const ShaderSources& shaderSources);
 
+    /// \brief Rebuilds the mesh of a batch created from a geometry source
+    /// when its reloaded program consumes other attributes.
+    struct BatchBuilder
+    {
+        MeshBuilderRef builder;
+        VertexFormat format;
+    };
+
     std::map<ShaderSources, std::set<ci::gl::BatchRef>> watchedBatches;
+    std::map<ci::gl::BatchRef, BatchBuilder> batchBuilders;
     std::map<ShaderSources, std::set<MaterialRef>> watchedMaterials;
     std::map<ShaderSources, ci::gl::GlslProgRef> watchedPrograms;
 
@@ -96,6 +96,12 @@ typedef struct {
   mesh_t mesh;
 } shape_t;
 
+// Axis-aligned bounds of the 'v' records. bmin > bmax if there are none.
+typedef struct {
+  float bmin[3];
+  float bmax[3];
+} bounds_t;
+
 class MaterialReader {
 public:
   MaterialReader() {}
@@ -120,6 +126,39 @@ private:
   std::string m_mtlBasePath;
 };
 
+/// Read-only view of a whole file. The file is memory-mapped, so pages are
+/// only brought in as they are touched and no copy of the file is made.
+/// 'sequential' hints that the file is read once from front to back.
+class mapped_file {
+public:
+  mapped_file();
+  ~mapped_file();
+
+  /// Returns false if the file cannot be opened or mapped.
+  bool open(const char *filename, bool sequential = false);
+#ifdef _WIN32
+  bool open(const wchar_t *filename, bool sequential = false);
+#endif
+  void close();
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  mapped_file(const mapped_file &);
+  mapped_file &operator=(const mapped_file &);
+#ifdef _WIN32
+  bool map();
+#endif
+
+  const char *data_;
+  size_t size_;
+#ifdef _WIN32
+  void *file_;    // HANDLE
+  void *mapping_; // HANDLE
+#endif
+};
+
 /// Loads .obj from a file.
 /// 'shapes' will be filled with parsed shape data
 /// The function returns error string.
@@ -128,11 +167,30 @@ private:
 /// 'mtl_basepath' is optional, and used for base path for .mtl file.
 /// 'triangulate' is optional, and used whether triangulate polygon face in .obj
 /// or not.
+/// The file is memory-mapped and parsed in place (see the buffer overload).
 bool LoadObj(std::vector<shape_t> &shapes,       // [output]
              std::vector<material_t> &materials, // [output]
              std::string &err,                   // [output]
              const char *filename, const char *mtl_basepath = NULL,
-             bool triangulate = true);
+             bool triangulate = true, unsigned int num_threads = 1);
+
+/// Loads object from `size` bytes of memory, uses MaterialReader to retrieve
+/// materials.
+/// The buffer is tokenized in place without copying lines, so it is well
+/// suited for memory-mapped files. It does not need to be null-terminated.
+/// 'num_threads' > 1 splits the buffer at line boundaries and parses the
+/// chunks in parallel, 0 uses all hardware threads. The result is the same as
+/// with a single thread.
+/// 'bounds' is optional and receives the bounds of all vertex positions,
+/// accumulated while they are parsed.
+/// Returns true when loading .obj become success.
+/// Returns warning and error message into `err`
+bool LoadObj(std::vector<shape_t> &shapes,       // [output]
+             std::vector<material_t> &materials, // [output]
+             std::string &err,                   // [output]
+             const char *buf, size_t size, MaterialReader &readMatFn,
+             bool triangulate = true, unsigned int num_threads = 1,
+             bounds_t *bounds = NULL);
 
 /// Loads object from a std::istream, uses GetMtlIStreamFn to retrieve
 /// std::istream for materials.
@@ -157,12 +215,32 @@ void LoadMtl(std::map<std::string, int> &material_map, // [output]
 #include <cmath>
 #include <cstddef>
 #include <cctype>
+#include <limits>
 
 #include <string>
 #include <vector>
 #include <map>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "tiny_obj_loader.h"
 
@@ -172,6 +250,11 @@ MaterialReader::~MaterialReader() {}
 
 #define TINYOBJ_SSCANF_BUFFER_SIZE (4096)
 
+// Minimum number of bytes per thread for parallel loading.
+#ifndef TINYOBJ_PARALLEL_MIN_CHUNK_SIZE
+#define TINYOBJ_PARALLEL_MIN_CHUNK_SIZE (1 << 20)
+#endif
+
 struct vertex_index {
   int v_idx, vt_idx, vn_idx;
   vertex_index() {}
@@ -187,18 +270,86 @@ struct tag_sizes {
   int num_strings;
 };
 
-// for std::map
-static inline bool operator<(const vertex_index &a, const vertex_index &b) {
-  if (a.v_idx != b.v_idx)
-    return (a.v_idx < b.v_idx);
-  if (a.vn_idx != b.vn_idx)
-    return (a.vn_idx < b.vn_idx);
-  if (a.vt_idx != b.vt_idx)
-    return (a.vt_idx < b.vt_idx);
-
-  return false;
+static inline bool operator==(const vertex_index &a, const vertex_index &b) {
+  return a.v_idx == b.v_idx && a.vt_idx == b.vt_idx && a.vn_idx == b.vn_idx;
 }
 
+// Maps a (v, vt, vn) triple to the index of the vertex emitted for it.
+// Open addressing with linear probing in a flat, power-of-two sized table.
+// Slots are stamped with a generation, so clear() is O(1) and a single table
+// is reused for all face groups without reallocating.
+class vertex_cache {
+public:
+  vertex_cache() : mask_(0), size_(0), generation_(1) {}
+
+  // Returns the value stored for `key`. If the key is new, it is inserted,
+  // `inserted` is set and the value has to be assigned by the caller.
+  unsigned int &insert(const vertex_index &key, bool &inserted) {
+    if (2 * (size_ + 1) > slots_.size())
+      grow();
+    size_t i = hash(key) & mask_;
+    while (slots_[i].generation == generation_) {
+      if (slots_[i].key == key) {
+        inserted = false;
+        return slots_[i].value;
+      }
+      i = (i + 1) & mask_;
+    }
+    slots_[i].key = key;
+    slots_[i].generation = generation_;
+    size_++;
+    inserted = true;
+    return slots_[i].value;
+  }
+
+  void clear() {
+    size_ = 0;
+    if (++generation_ == 0) {
+      for (size_t i = 0; i < slots_.size(); i++)
+        slots_[i].generation = 0;
+      generation_ = 1;
+    }
+  }
+
+private:
+  struct slot {
+    slot() : generation(0) {}
+    vertex_index key;
+    unsigned int value;
+    unsigned int generation;
+  };
+
+  static size_t hash(const vertex_index &key) {
+    unsigned long long h =
+        static_cast<unsigned int>(key.v_idx) |
+        static_cast<unsigned long long>(static_cast<unsigned int>(key.vt_idx))
+            << 32;
+    h ^= static_cast<unsigned int>(key.vn_idx) * 0xc2b2ae3d27d4eb4fULL;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return static_cast<size_t>(h ^ (h >> 32));
+  }
+
+  void grow() {
+    std::vector<slot> old;
+    old.swap(slots_);
+    slots_.resize(old.empty() ? 1024 : 2 * old.size());
+    mask_ = slots_.size() - 1;
+    for (size_t j = 0; j < old.size(); j++) {
+      if (old[j].generation != generation_)
+        continue;
+      size_t i = hash(old[j].key) & mask_;
+      while (slots_[i].generation == generation_)
+        i = (i + 1) & mask_;
+      slots_[i] = old[j];
+    }
+  }
+
+  std::vector<slot> slots_;
+  size_t mask_;
+  size_t size_;
+  unsigned int generation_;
+};
+
 struct obj_shape {
   std::vector<float> v;
   std::vector<float> vn;
@@ -211,6 +362,183 @@ static inline bool isNewLine(const char c) {
   return (c == '\r') || (c == '\n') || (c == '\0');
 }
 
+mapped_file::mapped_file() : data_(NULL), size_(0) {
+#ifdef _WIN32
+  file_ = INVALID_HANDLE_VALUE;
+  mapping_ = NULL;
+#endif
+}
+
+mapped_file::~mapped_file() { close(); }
+
+#ifdef _WIN32
+
+bool mapped_file::open(const char *filename, bool sequential) {
+  close();
+  file_ = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                      OPEN_EXISTING,
+                      sequential ? FILE_FLAG_SEQUENTIAL_SCAN
+                                 : FILE_ATTRIBUTE_NORMAL,
+                      NULL);
+  return map();
+}
+
+bool mapped_file::open(const wchar_t *filename, bool sequential) {
+  close();
+  file_ = CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                      OPEN_EXISTING,
+                      sequential ? FILE_FLAG_SEQUENTIAL_SCAN
+                                 : FILE_ATTRIBUTE_NORMAL,
+                      NULL);
+  return map();
+}
+
+bool mapped_file::map() {
+  if (file_ == INVALID_HANDLE_VALUE)
+    return false;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file_, &size)) {
+    close();
+    return false;
+  }
+  size_ = static_cast<size_t>(size.QuadPart);
+  if (size_ == 0)
+    return true; // Empty files cannot be mapped.
+  mapping_ = CreateFileMappingW(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping_ == NULL) {
+    close();
+    return false;
+  }
+  data_ = static_cast<const char *>(
+      MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+  if (data_ == NULL) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void mapped_file::close() {
+  if (data_)
+    UnmapViewOfFile(data_);
+  if (mapping_)
+    CloseHandle(mapping_);
+  if (file_ != INVALID_HANDLE_VALUE)
+    CloseHandle(file_);
+  file_ = INVALID_HANDLE_VALUE;
+  mapping_ = NULL;
+  data_ = NULL;
+  size_ = 0;
+}
+
+#else
+
+bool mapped_file::open(const char *filename, bool sequential) {
+  close();
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return false;
+  }
+  size_ = static_cast<size_t>(st.st_size);
+  if (size_ == 0) {
+    ::close(fd);
+    return true; // Empty files cannot be mapped.
+  }
+  void *p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    size_ = 0;
+    return false;
+  }
+  if (sequential)
+    madvise(p, size_, MADV_SEQUENTIAL);
+  data_ = static_cast<const char *>(p);
+  return true;
+}
+
+void mapped_file::close() {
+  if (data_)
+    munmap(const_cast<char *>(data_), size_);
+  data_ = NULL;
+  size_ = 0;
+}
+
+#endif
+
+// Hands out one line of input at a time. A returned line is terminated by
+// '\n', '\r' or '\0' and stays valid until the next call to next(). Returns
+// NULL at the end of the input.
+class line_reader {
+public:
+  virtual ~line_reader() {}
+  virtual const char *next() = 0;
+};
+
+class stream_line_reader : public line_reader {
+public:
+  stream_line_reader(std::istream &inStream)
+      : inStream_(inStream), buf_(static_cast<size_t>(maxchars)) {}
+
+  const char *next() {
+    if (inStream_.peek() == -1)
+      return NULL;
+    inStream_.getline(&buf_[0], maxchars);
+    return &buf_[0];
+  }
+
+private:
+  static const int maxchars = 8192; // Alloc enough size.
+
+  std::istream &inStream_;
+  std::vector<char> buf_;
+};
+
+// Returns lines as pointers into the buffer itself, no copies are made. Only
+// a final line without a trailing newline is copied so it can be terminated.
+class memory_line_reader : public line_reader {
+public:
+  memory_line_reader(const char *buf, size_t size)
+      : curr_(buf), end_(buf + size) {}
+
+  const char *next() {
+    if (curr_ >= end_)
+      return NULL;
+    const char *line = curr_;
+    const char *eol = static_cast<const char *>(
+        memchr(curr_, '\n', static_cast<size_t>(end_ - curr_)));
+    if (eol) {
+      curr_ = eol + 1;
+      return line;
+    }
+    tail_.assign(line, end_);
+    tail_.push_back('\0');
+    curr_ = end_;
+    return &tail_[0];
+  }
+
+private:
+  const char *curr_;
+  const char *end_;
+  std::vector<char> tail_;
+};
+
+// All faces of a face group, stored flat so that reading a face does not
+// allocate.
+struct face_group {
+  std::vector<vertex_index> vertices; // vertices of all faces, concatenated
+  std::vector<int> num_vertices;      // number of vertices per face
+
+  bool empty() const { return num_vertices.empty(); }
+  void clear() {
+    vertices.clear();
+    num_vertices.clear();
+  }
+};
+
 // Make index zero-base, and also support relative index.
 static inline int fixIndex(int idx, int n) {
   if (idx > 0)
@@ -223,7 +551,7 @@ static inline int fixIndex(int idx, int n) {
 static inline std::string parseString(const char *&token) {
   std::string s;
   token += strspn(token, " \t");
-  size_t e = strcspn(token, " \t\r");
+  size_t e = strcspn(token, " \t\r\n");
   s = std::string(token, &token[e]);
   token += e;
   return s;
@@ -232,10 +560,45 @@ static inline std::string parseString(const char *&token) {
 static inline int parseInt(const char *&token) {
   token += strspn(token, " \t");
   int i = atoi(token);
-  token += strcspn(token, " \t\r");
+  token += strcspn(token, " \t\r\n");
   return i;
 }
 
+static inline bool isDigit(const char c) {
+  return static_cast<unsigned int>(c - '0') < 10;
+}
+
+// Loads 8 characters in little-endian order.
+static inline unsigned long long loadEightChars(const char *s) {
+  unsigned long long v;
+  memcpy(&v, s, sizeof(v));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+  v = ((v & 0x00000000000000ffULL) << 56) | ((v & 0x000000000000ff00ULL) << 40) |
+      ((v & 0x0000000000ff0000ULL) << 24) | ((v & 0x00000000ff000000ULL) << 8) |
+      ((v & 0x000000ff00000000ULL) >> 8) | ((v & 0x0000ff0000000000ULL) >> 24) |
+      ((v & 0x00ff000000000000ULL) >> 40) | ((v & 0xff00000000000000ULL) >> 56);
+#endif
+  return v;
+}
+
+// True if all 8 characters packed into `v` are digits.
+static inline bool isEightDigits(unsigned long long v) {
+  return ((v & 0xf0f0f0f0f0f0f0f0ULL) |
+          (((v + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4)) ==
+         0x3333333333333333ULL;
+}
+
+// Converts 8 digits packed into `v` in one go (SWAR).
+static inline unsigned int parseEightDigits(unsigned long long v) {
+  const unsigned long long mask = 0x000000ff000000ffULL;
+  const unsigned long long mul1 = 100 + (1000000ULL << 32);
+  const unsigned long long mul2 = 1 + (10000ULL << 32);
+  v -= 0x3030303030303030ULL;
+  v = (v * 10) + (v >> 8);
+  v = (((v & mask) * mul1) + (((v >> 16) & mask) * mul2)) >> 32;
+  return static_cast<unsigned int>(v);
+}
+
 // Tries to parse a floating point number located at s.
 //
 // s_end should be a location in the string where reading should absolutely
@@ -252,8 +615,8 @@ static inline int parseInt(const char *&token) {
 //  Valid strings are for example:
 //   -0	 +3.1417e+2  -0.0E-3  1.0324  -1.41   11e2
 //
-// If the parsing is a success, result is set to the parsed value and true
-// is returned.
+// If the parsing is a success, result is set to the correctly rounded value
+// and true is returned.
 //
 // The function is greedy and will parse until any of the following happens:
 //  - a non-conforming character is encountered.
@@ -263,120 +626,148 @@ static inline int parseInt(const char *&token) {
 //  - s >= s_end.
 //  - parse failure.
 //
-static bool tryParseDouble(const char *s, const char *s_end, double *result) {
+// The digits are accumulated into a 64 bit integer mantissa, fractional
+// digits 8 at a time where possible. Numbers with up to 7 significant digits
+// and a small exponent, which covers typical OBJ coordinates, are converted
+// exactly with a single float operation. Up to 19 digits a single double
+// operation is used. Everything else falls back to strtof().
+//
+static bool tryParseFloat(const char *s, const char *s_end, float *result) {
+  // Powers of ten that are exactly representable.
+  static const float pow10f[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+  static const double pow10d[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                  1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                  1e18, 1e19, 1e20, 1e21, 1e22};
+  const int maxDigits = 19; // Always fits into 64 bits.
+
   if (s >= s_end) {
     return false;
   }
 
-  double mantissa = 0.0;
-  // This exponent is base 2 rather than 10.
-  // However the exponent we parse is supposed to be one of ten,
-  // thus we must take care to convert the exponent/and or the
-  // mantissa to a * 2^E, where a is the mantissa and E is the
-  // exponent.
-  // To get the final double we will use ldexp, it requires the
-  // exponent to be in base 2.
-  int exponent = 0;
-
-  // NOTE: THESE MUST BE DECLARED HERE SINCE WE ARE NOT ALLOWED
-  // TO JUMP OVER DEFINITIONS.
-  char sign = '+';
-  char exp_sign = '+';
-  char const *curr = s;
-
-  // How many characters were read in a loop.
-  int read = 0;
-  // Tells whether a loop terminated due to reaching s_end.
-  bool end_not_reached = false;
-
-  /*
-          BEGIN PARSING.
-  */
+  const char *curr = s;
+  bool negative = false;
+  unsigned long long mantissa = 0;
+  int exponent = 0;      // base 10
+  int digits = 0;        // significant digits in mantissa
+  bool truncated = false; // non-zero digits were dropped
 
   // Find out what sign we've got.
   if (*curr == '+' || *curr == '-') {
-    sign = *curr;
+    negative = *curr == '-';
     curr++;
-  } else if (isdigit(*curr)) { /* Pass through. */
-  } else {
-    goto fail;
+  } else if (!isDigit(*curr)) {
+    return false;
   }
 
   // Read the integer part.
-  while ((end_not_reached = (curr != s_end)) && isdigit(*curr)) {
-    mantissa *= 10;
-    mantissa += static_cast<int>(*curr - 0x30);
-    curr++;
-    read++;
+  const char *integer = curr;
+  for (; curr != s_end && isDigit(*curr); curr++) {
+    if (digits < maxDigits) {
+      mantissa = mantissa * 10 + static_cast<unsigned int>(*curr - '0');
+      if (mantissa != 0)
+        digits++;
+    } else {
+      exponent++;
+      truncated |= *curr != '0';
+    }
   }
 
   // We must make sure we actually got something.
-  if (read == 0)
-    goto fail;
-  // We allow numbers of form "#", "###" etc.
-  if (!end_not_reached)
-    goto assemble;
+  if (curr == integer)
+    return false;
 
   // Read the decimal part.
-  if (*curr == '.') {
+  if (curr != s_end && *curr == '.') {
     curr++;
-    read = 1;
-    while ((end_not_reached = (curr != s_end)) && isdigit(*curr)) {
-      // NOTE: Don't use powf here, it will absolutely murder precision.
-      mantissa += static_cast<int>(*curr - 0x30) * pow(10.0, -read);
-      read++;
-      curr++;
+    while (s_end - curr >= 8 && digits + 8 <= maxDigits) {
+      unsigned long long chars = loadEightChars(curr);
+      if (!isEightDigits(chars))
+        break;
+      mantissa = mantissa * 100000000 + parseEightDigits(chars);
+      if (mantissa != 0)
+        digits += 8;
+      exponent -= 8;
+      curr += 8;
+    }
+    for (; curr != s_end && isDigit(*curr); curr++) {
+      if (digits < maxDigits) {
+        mantissa = mantissa * 10 + static_cast<unsigned int>(*curr - '0');
+        if (mantissa != 0)
+          digits++;
+        exponent--;
+      } else {
+        truncated |= *curr != '0';
+      }
     }
-  } else if (*curr == 'e' || *curr == 'E') {
-  } else {
-    goto assemble;
   }
 
-  if (!end_not_reached)
-    goto assemble;
-
   // Read the exponent part.
-  if (*curr == 'e' || *curr == 'E') {
+  if (curr != s_end && (*curr == 'e' || *curr == 'E')) {
     curr++;
     // Figure out if a sign is present and if it is.
-    if ((end_not_reached = (curr != s_end)) && (*curr == '+' || *curr == '-')) {
-      exp_sign = *curr;
+    bool exp_negative = false;
+    if (curr != s_end && (*curr == '+' || *curr == '-')) {
+      exp_negative = *curr == '-';
       curr++;
-    } else if (isdigit(*curr)) { /* Pass through. */
-    } else {
-      // Empty E is not allowed.
-      goto fail;
     }
 
-    read = 0;
-    while ((end_not_reached = (curr != s_end)) && isdigit(*curr)) {
-      exponent *= 10;
-      exponent += static_cast<int>(*curr - 0x30);
-      curr++;
-      read++;
+    const char *exp_digits = curr;
+    int exp_value = 0;
+    for (; curr != s_end && isDigit(*curr); curr++) {
+      if (exp_value < 100000)
+        exp_value = exp_value * 10 + (*curr - '0');
+    }
+    // Empty E is not allowed.
+    if (curr == exp_digits)
+      return false;
+    exponent += exp_negative ? -exp_value : exp_value;
+  }
+
+  if (mantissa == 0) {
+    *result = negative ? -0.0f : 0.0f;
+    return true;
+  }
+
+  if (!truncated && mantissa <= (1ULL << 24) && exponent >= -10 &&
+      exponent <= 10) {
+    float f = static_cast<float>(mantissa);
+    f = exponent < 0 ? f / pow10f[-exponent] : f * pow10f[exponent];
+    *result = negative ? -f : f;
+    return true;
+  }
+
+  if (!truncated && mantissa <= (1ULL << 53) && exponent >= -22 &&
+      exponent <= 22) {
+    double d = static_cast<double>(mantissa);
+    d = exponent < 0 ? d / pow10d[-exponent] : d * pow10d[exponent];
+    // Rounding to double and then to float gives the correctly rounded float
+    // unless the double lies exactly halfway between two floats.
+    unsigned long long bits;
+    memcpy(&bits, &d, sizeof(bits));
+    if ((bits & 0x1fffffffULL) != 0x10000000ULL) {
+      float f = static_cast<float>(d);
+      *result = negative ? -f : f;
+      return true;
     }
-    exponent *= (exp_sign == '+' ? 1 : -1);
-    if (read == 0)
-      goto fail;
   }
 
-assemble:
-  *result =
-      (sign == '+' ? 1 : -1) * ldexp(mantissa * pow(5.0, exponent), exponent);
+  // Slow path for long or extreme numbers.
+  std::string number(s, curr);
+  *result = strtof(number.c_str(), NULL);
   return true;
-fail:
-  return false;
 }
+
 static inline float parseFloat(const char *&token) {
   token += strspn(token, " \t");
 #ifdef TINY_OBJ_LOADER_OLD_FLOAT_PARSER
   float f = (float)atof(token);
-  token += strcspn(token, " \t\r");
+  token += strcspn(token, " \t\r\n");
 #else
-  const char *end = token + strcspn(token, " \t\r");
-  double val = 0.0;
-  tryParseDouble(token, end, &val);
-  float f = static_cast<float>(val);
+  const char *end = token + strcspn(token, " \t\r\n");
+  float f = 0.0f;
+  tryParseFloat(token, end, &f);
   token = end;
 #endif
   return f;
@@ -398,21 +789,23 @@ static tag_sizes parseTagTriple(const char *&token) {
   tag_sizes ts;
 
   ts.num_ints = atoi(token);
-  token += strcspn(token, "/ \t\r");
+  token += strcspn(token, "/ \t\r\n");
   if (token[0] != '/') {
     return ts;
   }
   token++;
 
   ts.num_floats = atoi(token);
-  token += strcspn(token, "/ \t\r");
+  token += strcspn(token, "/ \t\r\n");
   if (token[0] != '/') {
     return ts;
   }
   token++;
 
   ts.num_strings = atoi(token);
-  token += strcspn(token, "/ \t\r") + 1;
+  token += strcspn(token, "/ \t\r\n");
+  if (!isNewLine(token[0]))
+    token++;
 
   return ts;
 }
@@ -423,7 +816,7 @@ static vertex_index parseTriple(const char *&token, int vsize, int vnsize,
   vertex_index vi(-1);
 
   vi.v_idx = fixIndex(atoi(token), vsize);
-  token += strcspn(token, "/ \t\r");
+  token += strcspn(token, "/ \t\r\n");
   if (token[0] != '/') {
     return vi;
   }
@@ -433,13 +826,13 @@ static vertex_index parseTriple(const char *&token, int vsize, int vnsize,
   if (token[0] == '/') {
     token++;
     vi.vn_idx = fixIndex(atoi(token), vnsize);
-    token += strcspn(token, "/ \t\r");
+    token += strcspn(token, "/ \t\r\n");
     return vi;
   }
 
   // i/j/k or i/j
   vi.vt_idx = fixIndex(atoi(token), vtsize);
-  token += strcspn(token, "/ \t\r");
+  token += strcspn(token, "/ \t\r\n");
   if (token[0] != '/') {
     return vi;
   }
@@ -447,22 +840,22 @@ static vertex_index parseTriple(const char *&token, int vsize, int vnsize,
   // i/j/k
   token++; // skip '/'
   vi.vn_idx = fixIndex(atoi(token), vnsize);
-  token += strcspn(token, "/ \t\r");
+  token += strcspn(token, "/ \t\r\n");
   return vi;
 }
 
 static unsigned int
-updateVertex(std::map<vertex_index, unsigned int> &vertexCache,
-             std::vector<float> &positions, std::vector<float> &normals,
-             std::vector<float> &texcoords,
+updateVertex(vertex_cache &vertexCache, std::vector<float> &positions,
+             std::vector<float> &normals, std::vector<float> &texcoords,
              const std::vector<float> &in_positions,
              const std::vector<float> &in_normals,
              const std::vector<float> &in_texcoords, const vertex_index &i) {
-  const std::map<vertex_index, unsigned int>::iterator it = vertexCache.find(i);
+  bool inserted;
+  unsigned int &cached = vertexCache.insert(i, inserted);
 
-  if (it != vertexCache.end()) {
+  if (!inserted) {
     // found cache
-    return it->second;
+    return cached;
   }
 
   assert(in_positions.size() > static_cast<unsigned int>(3 * i.v_idx + 2));
@@ -485,7 +878,7 @@ updateVertex(std::map<vertex_index, unsigned int> &vertexCache,
   }
 
   unsigned int idx = static_cast<unsigned int>(positions.size() / 3 - 1);
-  vertexCache[i] = idx;
+  cached = idx;
 
   return idx;
 }
@@ -513,29 +906,27 @@ static void InitMaterial(material_t &material) {
   material.unknown_parameter.clear();
 }
 
-static bool exportFaceGroupToShape(
-    shape_t &shape, std::map<vertex_index, unsigned int> vertexCache,
-    const std::vector<float> &in_positions,
-    const std::vector<float> &in_normals,
-    const std::vector<float> &in_texcoords,
-    const std::vector<std::vector<vertex_index> > &faceGroup,
-    std::vector<tag_t> &tags, const int material_id, const std::string &name,
-    bool clearCache, bool triangulate) {
-  if (faceGroup.empty()) {
-    return false;
-  }
-
+// Appends `num_faces` faces to the mesh of `shape`. `face` points to the
+// vertices of the first face, `num_vertices` holds the vertex count per face.
+static void exportFaces(shape_t &shape,
+                        vertex_cache &vertexCache,
+                        const std::vector<float> &in_positions,
+                        const std::vector<float> &in_normals,
+                        const std::vector<float> &in_texcoords,
+                        const vertex_index *face, const int *num_vertices,
+                        size_t num_faces, const int material_id,
+                        bool triangulate) {
   // Flatten vertices and indices
-  for (size_t i = 0; i < faceGroup.size(); i++) {
-    const std::vector<vertex_index> &face = faceGroup[i];
-
-    vertex_index i0 = face[0];
-    vertex_index i1(-1);
-    vertex_index i2 = face[1];
-
-    size_t npolys = face.size();
+  for (size_t i = 0; i < num_faces; face += num_vertices[i], i++) {
+    size_t npolys = static_cast<size_t>(num_vertices[i]);
 
     if (triangulate) {
+      if (npolys < 3)
+        continue; // Nothing to triangulate.
+
+      vertex_index i0 = face[0];
+      vertex_index i1(-1);
+      vertex_index i2 = face[1];
 
       // Polygon -> triangle fan conversion
       for (size_t k = 2; k < npolys; k++) {
@@ -574,6 +965,24 @@ static bool exportFaceGroupToShape(
       shape.mesh.material_ids.push_back(material_id); // per face
     }
   }
+}
+
+static bool exportFaceGroupToShape(
+    shape_t &shape, vertex_cache &vertexCache,
+    const std::vector<float> &in_positions,
+    const std::vector<float> &in_normals,
+    const std::vector<float> &in_texcoords,
+    const face_group &faceGroup, std::vector<tag_t> &tags,
+    const int material_id, const std::string &name, bool clearCache,
+    bool triangulate) {
+  if (faceGroup.empty()) {
+    return false;
+  }
+
+  exportFaces(shape, vertexCache, in_positions, in_normals, in_texcoords,
+              faceGroup.vertices.empty() ? NULL : &faceGroup.vertices[0],
+              &faceGroup.num_vertices[0], faceGroup.num_vertices.size(),
+              material_id, triangulate);
 
   shape.name = name;
   shape.mesh.tags.swap(tags);
@@ -835,79 +1244,126 @@ bool MaterialFileReader::operator()(const std::string &matId,
   return true;
 }
 
-bool LoadObj(std::vector<shape_t> &shapes,       // [output]
-             std::vector<material_t> &materials, // [output]
-             std::string &err, const char *filename, const char *mtl_basepath,
-             bool trianglulate) {
+// Parses the vertices of an 'f' record into `faceGroup`. `vsize`, `vnsize`
+// and `vtsize` are the attribute counts read so far, used to resolve
+// relative indices.
+static void parseFace(const char *token, int vsize, int vnsize, int vtsize,
+                      face_group &faceGroup) {
+  token += strspn(token, " \t");
 
-  shapes.clear();
+  int npolys = 0;
+  while (!isNewLine(token[0])) {
+    vertex_index vi = parseTriple(token, vsize, vnsize, vtsize);
+    faceGroup.vertices.push_back(vi);
+    npolys++;
+    size_t n = strspn(token, " \t\r");
+    token += n;
+  }
 
-  std::stringstream errss;
+  faceGroup.num_vertices.push_back(npolys);
+}
 
-  std::ifstream ifs(filename);
-  if (!ifs) {
-    errss << "Cannot open file [" << filename << "]" << std::endl;
-    err = errss.str();
-    return false;
+// Parses a 'g' record, `token` points to the 'g'.
+static std::string parseGroupName(const char *token) {
+  std::vector<std::string> names;
+  while (!isNewLine(token[0])) {
+    std::string str = parseString(token);
+    names.push_back(str);
+    token += strspn(token, " \t\r"); // skip tag
   }
 
-  std::string basePath;
-  if (mtl_basepath) {
-    basePath = mtl_basepath;
+  assert(names.size() > 0);
+
+  // names[0] must be 'g', so skip the 0th element.
+  if (names.size() > 1) {
+    return names[1];
+  } else {
+    return "";
   }
-  MaterialFileReader matFileReader(basePath);
+}
 
-  return LoadObj(shapes, materials, err, ifs, matFileReader, trianglulate);
+// Parses the body of a 't' record.
+static tag_t parseTag(const char *token) {
+  tag_t tag;
+
+  tag.name = parseString(token);
+  token += strspn(token, " \t");
+
+  tag_sizes ts = parseTagTriple(token);
+
+  tag.intValues.resize(static_cast<size_t>(ts.num_ints));
+
+  for (size_t i = 0; i < static_cast<size_t>(ts.num_ints); ++i) {
+    tag.intValues[i] = atoi(token);
+    token += strcspn(token, "/ \t\r\n");
+    if (!isNewLine(token[0]))
+      token++;
+  }
+
+  tag.floatValues.resize(static_cast<size_t>(ts.num_floats));
+  for (size_t i = 0; i < static_cast<size_t>(ts.num_floats); ++i) {
+    tag.floatValues[i] = parseFloat(token);
+    token += strcspn(token, "/ \t\r\n");
+    if (!isNewLine(token[0]))
+      token++;
+  }
+
+  tag.stringValues.resize(static_cast<size_t>(ts.num_strings));
+  for (size_t i = 0; i < static_cast<size_t>(ts.num_strings); ++i) {
+    tag.stringValues[i] = parseString(token);
+    token += strspn(token, " \t");
+  }
+
+  return tag;
 }
 
-bool LoadObj(std::vector<shape_t> &shapes,       // [output]
-             std::vector<material_t> &materials, // [output]
-             std::string &err, std::istream &inStream,
-             MaterialReader &readMatFn, bool triangulate) {
+static void initBounds(bounds_t &bounds) {
+  for (int i = 0; i < 3; i++) {
+    bounds.bmin[i] = std::numeric_limits<float>::max();
+    bounds.bmax[i] = -std::numeric_limits<float>::max();
+  }
+}
+
+static inline void includePosition(bounds_t &bounds, const float *p) {
+  for (int i = 0; i < 3; i++) {
+    bounds.bmin[i] = std::min(bounds.bmin[i], p[i]);
+    bounds.bmax[i] = std::max(bounds.bmax[i], p[i]);
+  }
+}
+
+static bool LoadObjFromLines(std::vector<shape_t> &shapes,       // [output]
+                             std::vector<material_t> &materials, // [output]
+                             std::string &err, line_reader &lineReader,
+                             MaterialReader &readMatFn, bool triangulate,
+                             bounds_t *bounds) {
   std::stringstream errss;
 
+  bounds_t vertexBounds;
+  initBounds(vertexBounds);
+
   std::vector<float> v;
   std::vector<float> vn;
   std::vector<float> vt;
   std::vector<tag_t> tags;
-  std::vector<std::vector<vertex_index> > faceGroup;
+  face_group faceGroup;
   std::string name;
 
   // material
   std::map<std::string, int> material_map;
-  std::map<vertex_index, unsigned int> vertexCache;
+  vertex_cache vertexCache;
   int material = -1;
 
   shape_t shape;
 
-  int maxchars = 8192;                                  // Alloc enough size.
-  std::vector<char> buf(static_cast<size_t>(maxchars)); // Alloc enough size.
-  while (inStream.peek() != -1) {
-    inStream.getline(&buf[0], maxchars);
-
-    std::string linebuf(&buf[0]);
-
-    // Trim newline '\r\n' or '\n'
-    if (linebuf.size() > 0) {
-      if (linebuf[linebuf.size() - 1] == '\n')
-        linebuf.erase(linebuf.size() - 1);
-    }
-    if (linebuf.size() > 0) {
-      if (linebuf[linebuf.size() - 1] == '\r')
-        linebuf.erase(linebuf.size() - 1);
-    }
-
-    // Skip if empty line.
-    if (linebuf.empty()) {
-      continue;
-    }
+  const char *line;
+  while ((line = lineReader.next()) != NULL) {
 
     // Skip leading space.
-    const char *token = linebuf.c_str();
+    const char *token = line;
     token += strspn(token, " \t");
 
     assert(token);
-    if (token[0] == '\0')
+    if (isNewLine(token[0]))
       continue; // empty line
 
     if (token[0] == '#')
@@ -916,11 +1372,10 @@ bool LoadObj(std::vector<shape_t> &shapes,       // [output]
     // vertex
     if (token[0] == 'v' && isSpace((token[1]))) {
       token += 2;
-      float x, y, z;
-      parseFloat3(x, y, z, token);
-      v.push_back(x);
-      v.push_back(y);
-      v.push_back(z);
+      float p[3];
+      parseFloat3(p[0], p[1], p[2], token);
+      includePosition(vertexBounds, p);
+      v.insert(v.end(), p, p + 3);
       continue;
     }
 
@@ -948,40 +1403,23 @@ bool LoadObj(std::vector<shape_t> &shapes,       // [output]
     // face
     if (token[0] == 'f' && isSpace((token[1]))) {
       token += 2;
-      token += strspn(token, " \t");
-
-      std::vector<vertex_index> face;
-      while (!isNewLine(token[0])) {
-        vertex_index vi = parseTriple(token, static_cast<int>(v.size() / 3),
-                                      static_cast<int>(vn.size() / 3),
-                                      static_cast<int>(vt.size() / 2));
-        face.push_back(vi);
-        size_t n = strspn(token, " \t\r");
-        token += n;
-      }
-
-      faceGroup.push_back(face);
-
+      parseFace(token, static_cast<int>(v.size() / 3),
+                static_cast<int>(vn.size() / 3),
+                static_cast<int>(vt.size() / 2), faceGroup);
       continue;
     }
 
     // use mtl
     if ((0 == strncmp(token, "usemtl", 6)) && isSpace((token[6]))) {
-
-      char namebuf[TINYOBJ_SSCANF_BUFFER_SIZE];
       token += 7;
-#ifdef _MSC_VER
-      sscanf_s(token, "%s", namebuf, (unsigned)_countof(namebuf));
-#else
-      sscanf(token, "%s", namebuf);
-#endif
+      std::string namebuf = parseString(token);
 
       // Create face group per material.
       bool ret =
           exportFaceGroupToShape(shape, vertexCache, v, vn, vt, faceGroup, tags,
                                  material, name, true, triangulate);
       if (ret) {
-        shapes.push_back(shape);
+        shapes.push_back(std::move(shape));
       }
       shape = shape_t();
       faceGroup.clear();
@@ -998,13 +1436,8 @@ bool LoadObj(std::vector<shape_t> &shapes,       // [output]
 
     // load mtl
     if ((0 == strncmp(token, "mtllib", 6)) && isSpace((token[6]))) {
-      char namebuf[TINYOBJ_SSCANF_BUFFER_SIZE];
       token += 7;
-#ifdef _MSC_VER
-      sscanf_s(token, "%s", namebuf, (unsigned)_countof(namebuf));
-#else
-      sscanf(token, "%s", namebuf);
-#endif
+      std::string namebuf = parseString(token);
 
       std::string err_mtl;
       bool ok = readMatFn(namebuf, materials, material_map, err_mtl);
@@ -1026,7 +1459,7 @@ bool LoadObj(std::vector<shape_t> &shapes,       // [output]
           exportFaceGroupToShape(shape, vertexCache, v, vn, vt, faceGroup, tags,
                                  material, name, true, triangulate);
       if (ret) {
-        shapes.push_back(shape);
+        shapes.push_back(std::move(shape));
       }
 
       shape = shape_t();
@@ -1034,22 +1467,7 @@ bool LoadObj(std::vector<shape_t> &shapes,       // [output]
       // material = -1;
       faceGroup.clear();
 
-      std::vector<std::string> names;
-      while (!isNewLine(token[0])) {
-        std::string str = parseString(token);
-        names.push_back(str);
-        token += strspn(token, " \t\r"); // skip tag
-      }
-
-      assert(names.size() > 0);
-
-      // names[0] must be 'g', so skip the 0th element.
-      if (names.size() > 1) {
-        name = names[1];
-      } else {
-        name = "";
-      }
-
+      name = parseGroupName(token);
       continue;
     }
 
@@ -1061,7 +1479,7 @@ bool LoadObj(std::vector<shape_t> &shapes,       // [output]
           exportFaceGroupToShape(shape, vertexCache, v, vn, vt, faceGroup, tags,
                                  material, name, true, triangulate);
       if (ret) {
-        shapes.push_back(shape);
+        shapes.push_back(std::move(shape));
       }
 
       // material = -1;
@@ -1069,67 +1487,400 @@ bool LoadObj(std::vector<shape_t> &shapes,       // [output]
       shape = shape_t();
 
       // @todo { multiple object name? }
-      char namebuf[TINYOBJ_SSCANF_BUFFER_SIZE];
       token += 2;
-#ifdef _MSC_VER
-      sscanf_s(token, "%s", namebuf, (unsigned)_countof(namebuf));
-#else
-      sscanf(token, "%s", namebuf);
-#endif
-      name = std::string(namebuf);
+      name = parseString(token);
 
       continue;
     }
 
     if (token[0] == 't' && isSpace(token[1])) {
-      tag_t tag;
+      token += 2;
+      tags.push_back(parseTag(token));
+    }
 
-      char namebuf[4096];
+    // Ignore unknown command.
+  }
+
+  bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt, faceGroup,
+                                    tags, material, name, true, triangulate);
+  if (ret) {
+    shapes.push_back(std::move(shape));
+  }
+  faceGroup.clear(); // for safety
+
+  if (bounds)
+    *bounds = vertexBounds;
+  err += errss.str();
+  return true;
+}
+
+// Parallel loading. The input is split into one chunk per thread at line
+// boundaries. A first pass counts the attribute records of every chunk, so
+// that each chunk knows its global attribute offsets and can resolve relative
+// indices and write its attributes in place while it is parsed. Group
+// boundaries are recorded per chunk and replayed in file order afterwards,
+// before the face groups are exported to shapes in parallel.
+
+struct obj_attribute_counts {
+  obj_attribute_counts() : v(0), vn(0), vt(0) {}
+  size_t v, vn, vt;
+};
+
+enum obj_command_type {
+  OBJ_COMMAND_USEMTL,
+  OBJ_COMMAND_MTLLIB,
+  OBJ_COMMAND_GROUP,
+  OBJ_COMMAND_OBJECT,
+  OBJ_COMMAND_TAG
+};
+
+// A record that affects grouping, together with its position in the faces of
+// the chunk.
+struct obj_command {
+  obj_command_type type;
+  size_t face;   // faces in the chunk before this record
+  size_t vertex; // face vertices in the chunk before this record
+  std::string name;
+  tag_t tag;
+};
+
+struct obj_chunk {
+  obj_chunk() : begin(NULL), size(0) {}
+
+  const char *begin;
+  size_t size;
+  obj_attribute_counts offset; // attributes in all preceding chunks
+  bounds_t bounds;              // of the positions in this chunk
+  face_group faces;
+  std::vector<obj_command> commands;
+};
+
+// A run of consecutive faces of one chunk that belongs to a face group.
+struct obj_face_range {
+  const obj_chunk *chunk;
+  size_t face_begin, face_end;
+  size_t vertex_begin;
+};
+
+// A face group that may span several chunks.
+struct obj_face_group {
+  std::vector<obj_face_range> ranges;
+  int material_id;
+  std::string name;
+  std::vector<tag_t> tags;
+};
+
+// Runs fn(i) for every i in [0, num_threads) on its own thread.
+template <typename Fn>
+static void parallelFor(unsigned int num_threads, const Fn &fn) {
+  std::vector<std::thread> threads;
+  for (unsigned int i = 1; i < num_threads; i++)
+    threads.push_back(std::thread(fn, i));
+  fn(0);
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+}
+
+static obj_attribute_counts countAttributes(const obj_chunk &chunk) {
+  obj_attribute_counts counts;
+  memory_line_reader lineReader(chunk.begin, chunk.size);
+  const char *line;
+  while ((line = lineReader.next()) != NULL) {
+    const char *token = line + strspn(line, " \t");
+    if (token[0] != 'v')
+      continue;
+    // Same tests, in the same order, as in parseChunk().
+    if (isSpace(token[1]))
+      counts.v++;
+    else if (token[1] == 'n' && isSpace(token[2]))
+      counts.vn++;
+    else if (token[1] == 't' && isSpace(token[2]))
+      counts.vt++;
+  }
+  return counts;
+}
+
+static void parseChunk(obj_chunk &chunk, std::vector<float> &v,
+                       std::vector<float> &vn, std::vector<float> &vt) {
+  float *pv = v.empty() ? NULL : &v[3 * chunk.offset.v];
+  float *pvn = vn.empty() ? NULL : &vn[3 * chunk.offset.vn];
+  float *pvt = vt.empty() ? NULL : &vt[2 * chunk.offset.vt];
+  obj_attribute_counts count = chunk.offset;
+  initBounds(chunk.bounds);
+
+  memory_line_reader lineReader(chunk.begin, chunk.size);
+  const char *line;
+  while ((line = lineReader.next()) != NULL) {
+
+    // Skip leading space.
+    const char *token = line;
+    token += strspn(token, " \t");
+
+    if (isNewLine(token[0]) || token[0] == '#')
+      continue;
+
+    // vertex
+    if (token[0] == 'v' && isSpace((token[1]))) {
       token += 2;
-      sscanf(token, "%s", namebuf);
-      tag.name = std::string(namebuf);
+      parseFloat3(pv[0], pv[1], pv[2], token);
+      includePosition(chunk.bounds, pv);
+      pv += 3;
+      count.v++;
+      continue;
+    }
 
-      token += tag.name.size() + 1;
+    // normal
+    if (token[0] == 'v' && token[1] == 'n' && isSpace((token[2]))) {
+      token += 3;
+      parseFloat3(pvn[0], pvn[1], pvn[2], token);
+      pvn += 3;
+      count.vn++;
+      continue;
+    }
 
-      tag_sizes ts = parseTagTriple(token);
+    // texcoord
+    if (token[0] == 'v' && token[1] == 't' && isSpace((token[2]))) {
+      token += 3;
+      parseFloat2(pvt[0], pvt[1], token);
+      pvt += 2;
+      count.vt++;
+      continue;
+    }
 
-      tag.intValues.resize(static_cast<size_t>(ts.num_ints));
+    // face
+    if (token[0] == 'f' && isSpace((token[1]))) {
+      token += 2;
+      parseFace(token, static_cast<int>(count.v), static_cast<int>(count.vn),
+                static_cast<int>(count.vt), chunk.faces);
+      continue;
+    }
 
-      for (size_t i = 0; i < static_cast<size_t>(ts.num_ints); ++i) {
-        tag.intValues[i] = atoi(token);
-        token += strcspn(token, "/ \t\r") + 1;
-      }
+    obj_command command;
+    command.face = chunk.faces.num_vertices.size();
+    command.vertex = chunk.faces.vertices.size();
 
-      tag.floatValues.resize(static_cast<size_t>(ts.num_floats));
-      for (size_t i = 0; i < static_cast<size_t>(ts.num_floats); ++i) {
-        tag.floatValues[i] = parseFloat(token);
-        token += strcspn(token, "/ \t\r") + 1;
-      }
+    if ((0 == strncmp(token, "usemtl", 6)) && isSpace((token[6]))) {
+      token += 7;
+      command.type = OBJ_COMMAND_USEMTL;
+      command.name = parseString(token);
+    } else if ((0 == strncmp(token, "mtllib", 6)) && isSpace((token[6]))) {
+      token += 7;
+      command.type = OBJ_COMMAND_MTLLIB;
+      command.name = parseString(token);
+    } else if (token[0] == 'g' && isSpace((token[1]))) {
+      command.type = OBJ_COMMAND_GROUP;
+      command.name = parseGroupName(token);
+    } else if (token[0] == 'o' && isSpace((token[1]))) {
+      token += 2;
+      command.type = OBJ_COMMAND_OBJECT;
+      command.name = parseString(token);
+    } else if (token[0] == 't' && isSpace(token[1])) {
+      token += 2;
+      command.type = OBJ_COMMAND_TAG;
+      command.tag = parseTag(token);
+    } else {
+      continue; // Ignore unknown command.
+    }
+
+    chunk.commands.push_back(command);
+  }
+}
+
+static bool LoadObjParallel(std::vector<shape_t> &shapes,       // [output]
+                            std::vector<material_t> &materials, // [output]
+                            std::string &err, const char *buf, size_t size,
+                            MaterialReader &readMatFn, bool triangulate,
+                            unsigned int num_threads, bounds_t *bounds) {
+  // Split at line boundaries.
+  std::vector<obj_chunk> chunks(num_threads);
+  const char *end = buf + size;
+  const char *begin = buf;
+  for (unsigned int i = 0; i < num_threads; i++) {
+    const char *chunkEnd = end;
+    if (i + 1 < num_threads) {
+      chunkEnd = begin + std::min(size / num_threads,
+                                  static_cast<size_t>(end - begin));
+      const char *eol = static_cast<const char *>(
+          memchr(chunkEnd, '\n', static_cast<size_t>(end - chunkEnd)));
+      chunkEnd = eol ? eol + 1 : end;
+    }
+    chunks[i].begin = begin;
+    chunks[i].size = static_cast<size_t>(chunkEnd - begin);
+    begin = chunkEnd;
+  }
+
+  std::vector<obj_attribute_counts> counts(num_threads);
+  parallelFor(num_threads,
+              [&](unsigned int i) { counts[i] = countAttributes(chunks[i]); });
+
+  obj_attribute_counts total;
+  for (unsigned int i = 0; i < num_threads; i++) {
+    chunks[i].offset = total;
+    total.v += counts[i].v;
+    total.vn += counts[i].vn;
+    total.vt += counts[i].vt;
+  }
+
+  std::vector<float> v(3 * total.v);
+  std::vector<float> vn(3 * total.vn);
+  std::vector<float> vt(2 * total.vt);
+  parallelFor(num_threads,
+              [&](unsigned int i) { parseChunk(chunks[i], v, vn, vt); });
+  if (bounds) {
+    initBounds(*bounds);
+    for (unsigned int i = 0; i < num_threads; i++) {
+      includePosition(*bounds, chunks[i].bounds.bmin);
+      includePosition(*bounds, chunks[i].bounds.bmax);
+    }
+  }
 
-      tag.stringValues.resize(static_cast<size_t>(ts.num_strings));
-      for (size_t i = 0; i < static_cast<size_t>(ts.num_strings); ++i) {
-        char stringValueBuffer[4096];
+  // Replay the group boundaries in file order.
+  std::vector<obj_face_group> groups;
+  std::map<std::string, int> material_map;
+  obj_face_group group;
+  group.material_id = -1;
+
+  for (size_t c = 0; c < chunks.size(); c++) {
+    const obj_chunk &chunk = chunks[c];
+    obj_face_range range;
+    range.chunk = &chunk;
+    range.face_begin = 0;
+    range.vertex_begin = 0;
+
+    for (size_t i = 0; i <= chunk.commands.size(); i++) {
+      const bool last = i == chunk.commands.size();
+      const size_t face =
+          last ? chunk.faces.num_vertices.size() : chunk.commands[i].face;
+      const size_t vertex =
+          last ? chunk.faces.vertices.size() : chunk.commands[i].vertex;
+      if (face > range.face_begin) {
+        range.face_end = face;
+        group.ranges.push_back(range);
+        range.face_begin = face;
+        range.vertex_begin = vertex;
+      }
+      if (last)
+        break;
+
+      const obj_command &command = chunk.commands[i];
+      switch (command.type) {
+      case OBJ_COMMAND_TAG:
+        group.tags.push_back(command.tag);
+        continue;
+      case OBJ_COMMAND_MTLLIB: {
+        std::string err_mtl;
+        bool ok = readMatFn(command.name, materials, material_map, err_mtl);
+        err += err_mtl;
+        if (!ok)
+          return false;
+        continue;
+      }
+      default:
+        break;
+      }
 
-        sscanf(token, "%s", stringValueBuffer);
-        tag.stringValues[i] = stringValueBuffer;
-        token += tag.stringValues[i].size() + 1;
+      // flush previous face group.
+      if (!group.ranges.empty()) {
+        groups.push_back(group);
+        group.ranges.clear();
+        group.tags.clear();
       }
 
-      tags.push_back(tag);
+      if (command.type == OBJ_COMMAND_USEMTL) {
+        std::map<std::string, int>::const_iterator it =
+            material_map.find(command.name);
+        group.material_id = it != material_map.end() ? it->second : -1;
+      } else {
+        group.name = command.name;
+      }
+    }
+  }
+  if (!group.ranges.empty())
+    groups.push_back(group);
+
+  // Export groups to shapes in parallel. Shapes are written in place, so the
+  // order matches the sequential loader.
+  size_t firstShape = shapes.size();
+  shapes.resize(firstShape + groups.size());
+  std::atomic<size_t> nextGroup(0);
+  parallelFor(num_threads, [&](unsigned int) {
+    vertex_cache vertexCache;
+    for (size_t g = nextGroup++; g < groups.size(); g = nextGroup++) {
+      obj_face_group &faceGroup = groups[g];
+      shape_t &shape = shapes[firstShape + g];
+      vertexCache.clear();
+      for (size_t r = 0; r < faceGroup.ranges.size(); r++) {
+        const obj_face_range &range = faceGroup.ranges[r];
+        const face_group &faces = range.chunk->faces;
+        exportFaces(shape, vertexCache, v, vn, vt,
+                    faces.vertices.empty()
+                        ? NULL
+                        : &faces.vertices[0] + range.vertex_begin,
+                    &faces.num_vertices[range.face_begin],
+                    range.face_end - range.face_begin, faceGroup.material_id,
+                    triangulate);
+      }
+      shape.name = faceGroup.name;
+      shape.mesh.tags.swap(faceGroup.tags);
     }
+  });
 
-    // Ignore unknown command.
+  return true;
+}
+
+bool LoadObj(std::vector<shape_t> &shapes,       // [output]
+             std::vector<material_t> &materials, // [output]
+             std::string &err, const char *filename, const char *mtl_basepath,
+             bool trianglulate, unsigned int num_threads) {
+
+  shapes.clear();
+
+  std::stringstream errss;
+
+  mapped_file file;
+  if (!file.open(filename, true)) {
+    errss << "Cannot open file [" << filename << "]" << std::endl;
+    err = errss.str();
+    return false;
   }
 
-  bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt, faceGroup,
-                                    tags, material, name, true, triangulate);
-  if (ret) {
-    shapes.push_back(shape);
+  std::string basePath;
+  if (mtl_basepath) {
+    basePath = mtl_basepath;
   }
-  faceGroup.clear(); // for safety
+  MaterialFileReader matFileReader(basePath);
 
-  err += errss.str();
-  return true;
+  return LoadObj(shapes, materials, err, file.data(), file.size(),
+                 matFileReader, trianglulate, num_threads);
+}
+
+bool LoadObj(std::vector<shape_t> &shapes,       // [output]
+             std::vector<material_t> &materials, // [output]
+             std::string &err, std::istream &inStream,
+             MaterialReader &readMatFn, bool triangulate) {
+  stream_line_reader lineReader(inStream);
+  return LoadObjFromLines(shapes, materials, err, lineReader, readMatFn,
+                          triangulate, NULL);
+}
+
+bool LoadObj(std::vector<shape_t> &shapes,       // [output]
+             std::vector<material_t> &materials, // [output]
+             std::string &err, const char *buf, size_t size,
+             MaterialReader &readMatFn, bool triangulate,
+             unsigned int num_threads, bounds_t *bounds) {
+  if (num_threads == 0)
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  // Not worth spawning threads for small files.
+  num_threads = static_cast<unsigned int>(
+      std::min(static_cast<size_t>(num_threads),
+               size / TINYOBJ_PARALLEL_MIN_CHUNK_SIZE + 1));
+  if (num_threads > 1)
+    return LoadObjParallel(shapes, materials, err, buf, size, readMatFn,
+                           triangulate, num_threads, bounds);
+
+  memory_line_reader lineReader(buf, size);
+  return LoadObjFromLines(shapes, materials, err, lineReader, readMatFn,
+                          triangulate, bounds);
 }
 
 } // namespace
@@ -23,6 +23,12 @@ Material::Material(const std::string& name, const gl::GlslProgRef& program)
 void
 Material::texture(const std::string& name,
                   const ci::gl::TextureBaseRef& texture)
+{
+    textures[name] = Texture::create(texture);
+}
+
+void
+Material::texture(const std::string& name, const TextureRef& texture)
 {
     textures[name] = texture;
 }
@@ -42,7 +48,9 @@ Material::bind()
     for (auto& texture : textures) {
         // Discard uniforms that are not active on the shader
         if (activeUniforms.find(texture.first) != activeUniforms.end()) {
-            texture.second->bind(unit);
+            if (!texture.second->resident())
+                textureLoader.poll();
+            texture.second->get()->bind(unit);
             program_->uniform(texture.first, unit);
             unit++;
         }
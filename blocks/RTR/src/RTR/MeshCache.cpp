@@ -0,0 +1,537 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#include "RTR/MeshCache.hpp"
+#include "cinder/Log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace ci;
+using namespace std;
+
+namespace rtr {
+
+// File layout, all values in native byte order and 4 byte aligned:
+//
+//   header       magic, version, MeshCacheFlags, source hash, bounds (min,
+//                max)
+//   dependencies count, then (path, hash) for each
+//   materials    count, then the fields of each tinyobj::material_t that
+//                the loader uses
+//   streams      count, then for each: vertex count, index count, stride,
+//                attribute count, range count, (attrib, dims, offset) per
+//                attribute, (material, first, count) per range, part count,
+//                for each part its first range, range count, bounding sphere
+//                (center, radius), LOD count and (error, (first, count) per
+//                range) per LOD, then cluster count, the interleaved
+//                vertices, the indices and the clusters
+//
+// Strings are stored as length and characters, padded to 4 bytes.
+//
+// Bump the version whenever the layout or the content of the streams
+// changes, so that stale cache files are rebuilt.
+static const char magic[8] = { 'R', 'T', 'R', 'M', 'E', 'S', 'H', 0 };
+static const uint32_t version = 7;
+
+// The cache of the current user, so that asset directories stay untouched
+// and may be read-only.
+fs::path
+defaultCacheDirectory()
+{
+#ifdef _WIN32
+    if (auto local = _wgetenv(L"LOCALAPPDATA"))
+        return fs::path(local) / "RTR" / "Cache";
+#else
+    auto xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg)
+        return fs::path(xdg) / "rtr";
+    if (auto home = getenv("HOME"))
+        return fs::path(home) / ".cache" / "rtr";
+#endif
+    boost::system::error_code error;
+    return fs::temp_directory_path(error) / "rtr-cache";
+}
+
+fs::path
+cacheFilePath(const fs::path& source, const std::string& suffix,
+              const fs::path& directory)
+{
+    // Files from different directories may share a name.
+    auto name = source.filename().string() + suffix;
+    auto absolute = fs::absolute(source).string();
+    std::stringstream prefix;
+    prefix << std::hex << std::setw(16) << std::setfill('0')
+           << hashBytes(absolute.data(), absolute.size());
+    return (directory.empty() ? defaultCacheDirectory() : directory) /
+           (prefix.str() + "-" + name);
+}
+
+fs::path
+meshCachePath(const fs::path& source, bool normalize,
+              const fs::path& directory)
+{
+    return cacheFilePath(source, normalize ? ".normalized.rtrmesh" : ".rtrmesh",
+                         directory);
+}
+
+static fs::path
+temporaryCachePath(const fs::path& file)
+{
+#ifdef _WIN32
+    auto process = _getpid();
+#else
+    auto process = getpid();
+#endif
+    static std::atomic<uint32_t> counter(0);
+    auto temporary = file;
+    temporary += "." + std::to_string(process) + "." +
+                 std::to_string(counter++) + ".tmp";
+    return temporary;
+}
+
+bool
+writeCacheFile(const fs::path& file,
+               const std::function<void(std::ostream&)>& write)
+{
+    boost::system::error_code error;
+    fs::create_directories(file.parent_path(), error);
+
+    auto temporary = temporaryCachePath(file);
+    {
+        std::ofstream stream(temporary.string().c_str(),
+                             std::ios::binary | std::ios::trunc);
+        if (!stream)
+            return false;
+        write(stream);
+        if (!stream) {
+            stream.close();
+            fs::remove(temporary, error);
+            return false;
+        }
+    }
+
+    fs::rename(temporary, file, error);
+    if (error) {
+        fs::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
+
+static inline uint64_t
+rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t
+hashBytes(const void* data, size_t size, uint64_t seed)
+{
+    const uint64_t prime1 = 0x9e3779b185ebca87ull;
+    const uint64_t prime2 = 0xc2b2ae3d27d4eb4full;
+
+    const char* p = static_cast<const char*>(data);
+    const char* end = p + size;
+
+    // Four independent lanes keep the multipliers busy.
+    uint64_t lanes[4] = { seed + prime1 + prime2, seed + prime2, seed,
+                          seed - prime1 };
+    for (; end - p >= 32; p += 32) {
+        for (int i = 0; i < 4; i++) {
+            uint64_t word;
+            memcpy(&word, p + 8 * i, 8);
+            lanes[i] = rotl(lanes[i] + word * prime2, 31) * prime1;
+        }
+    }
+
+    uint64_t h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) +
+                 rotl(lanes[3], 18) + uint64_t(size);
+    for (; p < end; p++)
+        h = rotl(h ^ (uint8_t(*p) * prime1), 11) * prime2;
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime1;
+    h ^= h >> 32;
+    return h;
+}
+
+bool
+hashFile(const fs::path& file, uint64_t& hash)
+{
+    MappedFile mapped;
+    if (!mapped.open(file))
+        return false;
+    hash = hashBytes(mapped.data(), mapped.size());
+    return true;
+}
+
+namespace {
+
+class Writer
+{
+  public:
+    Writer(std::ostream& out)
+      : out(out)
+    {
+    }
+
+    template <typename T>
+    void value(const T& v)
+    {
+        out.write(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+
+    template <typename T>
+    void array(const T* data, size_t count)
+    {
+        out.write(reinterpret_cast<const char*>(data), sizeof(T) * count);
+    }
+
+    void string(const std::string& s)
+    {
+        value(uint32_t(s.size()));
+        out.write(s.data(), s.size());
+        static const char padding[4] = {};
+        out.write(padding, (4 - s.size() % 4) % 4);
+    }
+
+  private:
+    std::ostream& out;
+};
+
+class Reader
+{
+  public:
+    Reader(const char* data, size_t size)
+      : curr(data)
+      , end(data + size)
+    {
+    }
+
+    template <typename T>
+    bool value(T& v)
+    {
+        if (size_t(end - curr) < sizeof(T))
+            return false;
+        memcpy(&v, curr, sizeof(T));
+        curr += sizeof(T);
+        return true;
+    }
+
+    /// Returns a pointer into the mapping, or nullptr if out of bounds.
+    template <typename T>
+    const T* array(size_t count)
+    {
+        if (size_t(end - curr) / sizeof(T) < count)
+            return nullptr;
+        auto data = reinterpret_cast<const T*>(curr);
+        curr += sizeof(T) * count;
+        return data;
+    }
+
+    bool string(std::string& s)
+    {
+        uint32_t length;
+        if (!value(length))
+            return false;
+        size_t padded = (size_t(length) + 3) / 4 * 4;
+        if (size_t(end - curr) < padded)
+            return false;
+        s.assign(curr, length);
+        curr += padded;
+        return true;
+    }
+
+  private:
+    const char* curr;
+    const char* end;
+};
+
+void
+writeMaterial(Writer& out, const tinyobj::material_t& mat)
+{
+    out.string(mat.name);
+    out.array(mat.ambient, 3);
+    out.array(mat.diffuse, 3);
+    out.array(mat.specular, 3);
+    out.array(mat.transmittance, 3);
+    out.array(mat.emission, 3);
+    out.value(mat.shininess);
+    out.value(mat.ior);
+    out.value(mat.dissolve);
+    out.value(int32_t(mat.illum));
+    out.string(mat.ambient_texname);
+    out.string(mat.diffuse_texname);
+    out.string(mat.specular_texname);
+    out.string(mat.specular_highlight_texname);
+    out.string(mat.bump_texname);
+    out.string(mat.displacement_texname);
+    out.string(mat.alpha_texname);
+}
+
+bool
+readFloats(Reader& in, float* values, size_t count)
+{
+    auto data = in.array<float>(count);
+    if (!data)
+        return false;
+    std::copy(data, data + count, values);
+    return true;
+}
+
+bool
+readMaterial(Reader& in, tinyobj::material_t& mat)
+{
+    int32_t illum;
+    bool ok = in.string(mat.name) && readFloats(in, mat.ambient, 3) &&
+              readFloats(in, mat.diffuse, 3) &&
+              readFloats(in, mat.specular, 3) &&
+              readFloats(in, mat.transmittance, 3) &&
+              readFloats(in, mat.emission, 3) && in.value(mat.shininess) &&
+              in.value(mat.ior) && in.value(mat.dissolve) && in.value(illum) &&
+              in.string(mat.ambient_texname) &&
+              in.string(mat.diffuse_texname) &&
+              in.string(mat.specular_texname) &&
+              in.string(mat.specular_highlight_texname) &&
+              in.string(mat.bump_texname) &&
+              in.string(mat.displacement_texname) &&
+              in.string(mat.alpha_texname);
+    mat.illum = illum;
+    mat.dummy = 0;
+    return ok;
+}
+
+}
+
+bool
+MeshCacheFile::open(const fs::path& path, uint64_t sourceHash, uint32_t flags)
+{
+    materials_.clear();
+    shapes_.clear();
+
+    if (!fs::exists(path) || !file.open(path))
+        return false;
+
+    if (!read(sourceHash, flags)) {
+        materials_.clear();
+        shapes_.clear();
+        file.close();
+        return false;
+    }
+    return true;
+}
+
+bool
+MeshCacheFile::read(uint64_t sourceHash, uint32_t flags)
+{
+    Reader in(file.data(), file.size());
+
+    auto fileMagic = in.array<char>(sizeof(magic));
+    uint32_t fileVersion, fileFlags;
+    uint64_t fileSourceHash;
+    if (!fileMagic || memcmp(fileMagic, magic, sizeof(magic)) != 0 ||
+        !in.value(fileVersion) || fileVersion != version ||
+        !in.value(fileFlags) || !in.value(fileSourceHash))
+        return false;
+    if (fileSourceHash != sourceHash || fileFlags != flags)
+        return false;
+    vec3 boundsMin, boundsMax;
+    if (!in.value(boundsMin) || !in.value(boundsMax))
+        return false;
+    bounds_ = AxisAlignedBox(boundsMin, boundsMax);
+
+    uint32_t numDependencies;
+    if (!in.value(numDependencies))
+        return false;
+    for (uint32_t i = 0; i < numDependencies; i++) {
+        std::string dependency;
+        uint64_t hash, current = 0;
+        if (!in.string(dependency) || !in.value(hash))
+            return false;
+        hashFile(dependency, current);
+        if (current != hash)
+            return false;
+    }
+
+    uint32_t numMaterials;
+    if (!in.value(numMaterials))
+        return false;
+    for (uint32_t i = 0; i < numMaterials; i++) {
+        tinyobj::material_t material;
+        if (!readMaterial(in, material))
+            return false;
+        materials_.push_back(material);
+    }
+
+    uint32_t numShapes;
+    if (!in.value(numShapes))
+        return false;
+    for (uint32_t i = 0; i < numShapes; i++) {
+        MeshStreams shape;
+        uint32_t numAttributes, numRanges;
+        if (!in.value(shape.numVertices) || !in.value(shape.numIndices) ||
+            !in.value(shape.stride) || !in.value(numAttributes) ||
+            !in.value(numRanges))
+            return false;
+
+        for (uint32_t a = 0; a < numAttributes; a++) {
+            uint32_t attrib, dims, offset;
+            if (!in.value(attrib) || !in.value(dims) || !in.value(offset) ||
+                attrib >= geom::NUM_ATTRIBS || dims == 0 || dims > 4 ||
+                offset + dims > shape.stride)
+                return false;
+            shape.attributes.push_back(
+              { geom::Attrib(attrib), uint8_t(dims), offset });
+        }
+        for (uint32_t r = 0; r < numRanges; r++) {
+            MeshRange range;
+            if (!in.value(range.material) || !in.value(range.first) ||
+                !in.value(range.count) || range.first > shape.numIndices ||
+                range.count > shape.numIndices - range.first)
+                return false;
+            shape.ranges.push_back(range);
+        }
+        uint32_t numParts;
+        if (!in.value(numParts))
+            return false;
+        for (uint32_t p = 0; p < numParts; p++) {
+            MeshPart part;
+            vec3 center;
+            float radius;
+            uint32_t numLods;
+            if (!in.value(part.firstRange) || !in.value(part.numRanges) ||
+                part.firstRange > numRanges ||
+                part.numRanges > numRanges - part.firstRange ||
+                !in.value(center) || !in.value(radius) || !in.value(numLods))
+                return false;
+            part.bounds = Sphere(center, radius);
+            for (uint32_t l = 0; l < numLods; l++) {
+                MeshLod lod;
+                if (!in.value(lod.error))
+                    return false;
+                for (uint32_t r = 0; r < part.numRanges; r++) {
+                    const auto& full = shape.ranges[part.firstRange + r];
+                    MeshRange range = { full.material, 0, 0 };
+                    if (!in.value(range.first) || !in.value(range.count) ||
+                        range.first > shape.numIndices ||
+                        range.count > shape.numIndices - range.first)
+                        return false;
+                    lod.ranges.push_back(range);
+                }
+                part.lods.push_back(lod);
+            }
+            shape.parts.push_back(part);
+        }
+        if (!in.value(shape.numClusters))
+            return false;
+        shape.vertices =
+          in.array<float>(size_t(shape.numVertices) * shape.stride);
+        if (!shape.vertices)
+            return false;
+        shape.indices = in.array<uint32_t>(shape.numIndices);
+        if (!shape.indices)
+            return false;
+        // A damaged file must not make the GPU read past the vertices.
+        uint32_t maxIndex = 0;
+        for (uint32_t j = 0; j < shape.numIndices; j++)
+            maxIndex = std::max(maxIndex, shape.indices[j]);
+        if (shape.numIndices > 0 && maxIndex >= shape.numVertices)
+            return false;
+        shape.clusters = in.array<MeshCluster>(shape.numClusters);
+        if (!shape.clusters)
+            return false;
+        for (uint32_t c = 0; c < shape.numClusters; c++) {
+            const auto& cluster = shape.clusters[c];
+            if (cluster.first > shape.numIndices ||
+                cluster.count > shape.numIndices - cluster.first)
+                return false;
+        }
+
+        shapes_.push_back(shape);
+    }
+
+    return true;
+}
+
+bool
+writeMeshCache(const fs::path& file, uint64_t sourceHash, uint32_t flags,
+               const AxisAlignedBox& bounds,
+               const std::vector<MeshCacheDependency>& dependencies,
+               const std::vector<tinyobj::material_t>& materials,
+               const std::vector<MeshStreams>& shapes)
+{
+    auto write = [&](std::ostream& stream) {
+        Writer out(stream);
+        out.array(magic, sizeof(magic));
+        out.value(version);
+        out.value(flags);
+        out.value(sourceHash);
+        out.value(bounds.getMin());
+        out.value(bounds.getMax());
+
+        out.value(uint32_t(dependencies.size()));
+        for (const auto& dependency : dependencies) {
+            out.string(dependency.file.string());
+            out.value(dependency.hash);
+        }
+
+        out.value(uint32_t(materials.size()));
+        for (const auto& material : materials)
+            writeMaterial(out, material);
+
+        out.value(uint32_t(shapes.size()));
+        for (const auto& shape : shapes) {
+            out.value(shape.numVertices);
+            out.value(shape.numIndices);
+            out.value(shape.stride);
+            out.value(uint32_t(shape.attributes.size()));
+            out.value(uint32_t(shape.ranges.size()));
+            for (const auto& attribute : shape.attributes) {
+                out.value(uint32_t(attribute.attrib));
+                out.value(uint32_t(attribute.dims));
+                out.value(attribute.offset);
+            }
+            for (const auto& range : shape.ranges) {
+                out.value(range.material);
+                out.value(range.first);
+                out.value(range.count);
+            }
+            out.value(uint32_t(shape.parts.size()));
+            for (const auto& part : shape.parts) {
+                out.value(part.firstRange);
+                out.value(part.numRanges);
+                out.value(part.bounds.getCenter());
+                out.value(part.bounds.getRadius());
+                out.value(uint32_t(part.lods.size()));
+                for (const auto& lod : part.lods) {
+                    out.value(lod.error);
+                    for (const auto& range : lod.ranges) {
+                        out.value(range.first);
+                        out.value(range.count);
+                    }
+                }
+            }
+            out.value(shape.numClusters);
+            out.array(shape.vertices, size_t(shape.numVertices) * shape.stride);
+            out.array(shape.indices, shape.numIndices);
+            out.array(shape.clusters, shape.numClusters);
+        }
+    };
+    return writeCacheFile(file, write);
+}
+}
@@ -0,0 +1,922 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#include "RTR/MeshOptimizer.hpp"
+
+#include "glm/glm.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1) ||            \
+  defined(__SSE__)
+#define RTR_SSE
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+using namespace glm;
+
+namespace rtr {
+
+VertexCacheStats&
+VertexCacheStats::operator+=(const VertexCacheStats& other)
+{
+    triangles += other.triangles;
+    vertices += other.vertices;
+    misses += other.misses;
+    return *this;
+}
+
+namespace {
+
+const uint32_t none = ~0u;
+
+// A FIFO cache that remembers when each vertex entered it. A vertex is
+// cached while fewer than size vertices entered after it.
+class FifoCache
+{
+  public:
+    FifoCache(size_t numVertices, unsigned int size)
+      : stamps(numVertices, 0)
+      , size(size)
+      , time(size + 1)
+    {
+    }
+
+    /// Returns the number of vertices of the triangle that missed.
+    unsigned int triangle(const uint32_t* triangle)
+    {
+        unsigned int misses = 0;
+        for (int c = 0; c < 3; c++) {
+            auto& stamp = stamps[triangle[c]];
+            if (time - stamp > size) {
+                stamp = time++;
+                misses++;
+            }
+        }
+        return misses;
+    }
+
+    void clear() { time += size + 1; }
+
+  private:
+    std::vector<uint32_t> stamps;
+    uint32_t size;
+    uint32_t time;
+};
+
+inline vec3
+position(const float* positions, size_t stride, uint32_t vertex)
+{
+    auto p = positions + stride * vertex;
+    return vec3(p[0], p[1], p[2]);
+}
+
+// The sum of squared distances to a set of planes, as a symmetric 4x4
+// matrix.
+struct Quadric
+{
+    double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+    Quadric() { a2 = ab = ac = ad = b2 = bc = bd = c2 = cd = d2 = 0.0; }
+
+    void addPlane(const dvec3& n, double d)
+    {
+        a2 += n.x * n.x;
+        ab += n.x * n.y;
+        ac += n.x * n.z;
+        ad += n.x * d;
+        b2 += n.y * n.y;
+        bc += n.y * n.z;
+        bd += n.y * d;
+        c2 += n.z * n.z;
+        cd += n.z * d;
+        d2 += d * d;
+    }
+
+    Quadric& operator+=(const Quadric& q)
+    {
+        a2 += q.a2;
+        ab += q.ab;
+        ac += q.ac;
+        ad += q.ad;
+        b2 += q.b2;
+        bc += q.bc;
+        bd += q.bd;
+        c2 += q.c2;
+        cd += q.cd;
+        d2 += q.d2;
+        return *this;
+    }
+
+    double operator()(const vec3& p) const
+    {
+        double x = p.x, y = p.y, z = p.z;
+        auto value = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z +
+                     2 * ad * x + b2 * y * y + 2 * bc * y * z + 2 * bd * y +
+                     c2 * z * z + 2 * cd * z + d2;
+        return std::max(0.0, value);
+    }
+};
+
+inline uint64_t
+edgeKey(uint32_t a, uint32_t b)
+{
+    return a < b ? (uint64_t(a) << 32 | b) : (uint64_t(b) << 32 | a);
+}
+
+// As many threads as there are cores, but with at least grain items each.
+size_t
+threadCount(size_t count, size_t grain)
+{
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    return std::max(size_t(1), std::min(threads, count / grain));
+}
+
+// Runs fn(begin, end) on equal parts of [0, count) on threadCount() threads.
+template <typename Fn>
+void
+parallelFor(size_t count, size_t grain, const Fn& fn)
+{
+    auto threads = threadCount(count, grain);
+    auto step = (count + threads - 1) / threads;
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; t++)
+        workers.push_back(std::thread(fn, std::min(count, t * step),
+                                      std::min(count, (t + 1) * step)));
+    fn(size_t(0), std::min(count, step));
+    for (auto& worker : workers)
+        worker.join();
+}
+
+// The tangent and bitangent directions of triangles [begin, end), six floats
+// each, written from directions on with the arithmetic of
+// ci::geom::calculateTangents(). Four triangles at a time with SSE, which
+// rounds exactly like the scalar code.
+void
+triangleDirections(const uint32_t* indices, const float* positions,
+                   const float* texCoords, size_t stride, size_t begin,
+                   size_t end, float* directions)
+{
+    size_t t = begin;
+#ifdef RTR_SSE
+    for (; t + 4 <= end; t += 4) {
+        auto corner = indices + 3 * t;
+        __m128 p[3][3], w[3][2];
+        for (int c = 0; c < 3; c++) {
+            auto v0 = corner[c] * stride, v1 = corner[3 + c] * stride,
+                 v2 = corner[6 + c] * stride, v3 = corner[9 + c] * stride;
+            for (int k = 0; k < 3; k++)
+                p[c][k] = _mm_setr_ps(positions[v0 + k], positions[v1 + k],
+                                      positions[v2 + k], positions[v3 + k]);
+            for (int k = 0; k < 2; k++)
+                w[c][k] = _mm_setr_ps(texCoords[v0 + k], texCoords[v1 + k],
+                                      texCoords[v2 + k], texCoords[v3 + k]);
+        }
+        auto s1 = _mm_sub_ps(w[1][0], w[0][0]);
+        auto s2 = _mm_sub_ps(w[2][0], w[0][0]);
+        auto t1 = _mm_sub_ps(w[1][1], w[0][1]);
+        auto t2 = _mm_sub_ps(w[2][1], w[0][1]);
+        auto det = _mm_sub_ps(_mm_mul_ps(s1, t2), _mm_mul_ps(s2, t1));
+        auto r = _mm_and_ps(_mm_div_ps(_mm_set1_ps(1.0f), det),
+                            _mm_cmpneq_ps(det, _mm_setzero_ps()));
+
+        float out[6][4];
+        for (int k = 0; k < 3; k++) {
+            auto e1 = _mm_sub_ps(p[1][k], p[0][k]);
+            auto e2 = _mm_sub_ps(p[2][k], p[0][k]);
+            _mm_storeu_ps(out[k], _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(t2, e1),
+                                                        _mm_mul_ps(t1, e2)),
+                                             r));
+            _mm_storeu_ps(out[3 + k],
+                          _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(s1, e2),
+                                                _mm_mul_ps(s2, e1)),
+                                     r));
+        }
+        for (int i = 0; i < 4; i++)
+            for (int k = 0; k < 6; k++)
+                directions[6 * (t - begin + i) + k] = out[k][i];
+    }
+#endif
+    for (; t < end; t++) {
+        auto corner = indices + 3 * t;
+        const float* p[3];
+        const float* w[3];
+        for (int c = 0; c < 3; c++) {
+            p[c] = positions + stride * corner[c];
+            w[c] = texCoords + stride * corner[c];
+        }
+        auto s1 = w[1][0] - w[0][0];
+        auto s2 = w[2][0] - w[0][0];
+        auto t1 = w[1][1] - w[0][1];
+        auto t2 = w[2][1] - w[0][1];
+        auto det = s1 * t2 - s2 * t1;
+        auto r = det != 0.0f ? 1.0f / det : 0.0f;
+        for (int k = 0; k < 3; k++) {
+            auto e1 = p[1][k] - p[0][k];
+            auto e2 = p[2][k] - p[0][k];
+            directions[6 * (t - begin) + k] = (t2 * e1 - t1 * e2) * r;
+            directions[6 * (t - begin) + 3 + k] = (s1 * e2 - s2 * e1) * r;
+        }
+    }
+}
+
+// Gram-Schmidt against the normal.
+inline vec3
+orthonormalize(const vec3& v, const vec3& normal)
+{
+    auto orthogonal = v - normal * dot(normal, v);
+    return length(orthogonal) > 0.0f ? normalize(orthogonal) : vec3(0.0f);
+}
+}
+
+uint32_t
+weldVertices(std::vector<float>& vertices, size_t stride, uint32_t* indices,
+             size_t numIndices, float epsilon)
+{
+    auto numVertices = vertices.size() / stride;
+
+    // Bit-identical vertices share the cell of their exact position. With an
+    // epsilon, cells are epsilon wide and the neighbour cells are searched
+    // as well. Cells that collide in the hash just share a chain.
+    auto cell = [&](float value) -> int64_t {
+        if (epsilon == 0.0f) {
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            return bits;
+        }
+        auto scaled = std::floor(double(value) / epsilon);
+        return int64_t(std::max(-4e18, std::min(4e18, scaled)));
+    };
+    auto hash = [](int64_t x, int64_t y, int64_t z) -> uint64_t {
+        return uint64_t(x) * 0x9e3779b97f4a7c15ull ^
+               uint64_t(y) * 0xc2b2ae3d27d4eb4full ^
+               uint64_t(z) * 0x165667b19e3779f9ull;
+    };
+    auto equal = [&](const float* a, const float* b) -> bool {
+        if (epsilon == 0.0f)
+            return memcmp(a, b, sizeof(float) * stride) == 0;
+        for (size_t k = 0; k < stride; k++)
+            if (!(std::abs(a[k] - b[k]) <= epsilon))
+                return false;
+        return true;
+    };
+
+    // The first vertex of each cell, and the next one in the same cell.
+    std::unordered_map<uint64_t, uint32_t> cells;
+    cells.reserve(numVertices);
+    std::vector<uint32_t> chain;
+    std::vector<uint32_t> remap(numVertices);
+    std::vector<float> result;
+    result.reserve(vertices.size());
+    int64_t reach = epsilon == 0.0f ? 0 : 1;
+
+    for (size_t v = 0; v < numVertices; v++) {
+        auto vertex = &vertices[v * stride];
+        auto x = cell(vertex[0]), y = cell(vertex[1]), z = cell(vertex[2]);
+
+        auto found = none;
+        for (auto dx = -reach; dx <= reach && found == none; dx++) {
+            for (auto dy = -reach; dy <= reach && found == none; dy++) {
+                for (auto dz = -reach; dz <= reach && found == none; dz++) {
+                    auto head = cells.find(hash(x + dx, y + dy, z + dz));
+                    if (head == cells.end())
+                        continue;
+                    for (auto w = head->second; w != none; w = chain[w]) {
+                        if (equal(vertex, &result[size_t(w) * stride])) {
+                            found = w;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        if (found == none) {
+            found = uint32_t(chain.size());
+            auto head =
+              cells.insert(std::make_pair(hash(x, y, z), none)).first;
+            chain.push_back(head->second);
+            head->second = found;
+            result.insert(result.end(), vertex, vertex + stride);
+        }
+        remap[v] = found;
+    }
+
+    for (size_t i = 0; i < numIndices; i++)
+        indices[i] = remap[indices[i]];
+    vertices.swap(result);
+    return uint32_t(chain.size());
+}
+
+VertexCacheStats
+analyzeVertexCache(const uint32_t* indices, size_t numIndices,
+                   size_t numVertices, unsigned int cacheSize)
+{
+    VertexCacheStats stats;
+    stats.triangles = numIndices / 3;
+
+    FifoCache cache(numVertices, cacheSize);
+    for (size_t t = 0; t < stats.triangles; t++)
+        stats.misses += cache.triangle(indices + 3 * t);
+
+    std::vector<bool> used(numVertices, false);
+    for (size_t i = 0; i < stats.triangles * 3; i++) {
+        if (!used[indices[i]]) {
+            used[indices[i]] = true;
+            stats.vertices++;
+        }
+    }
+    return stats;
+}
+
+size_t
+removeDegenerateTriangles(uint32_t* indices, size_t numIndices,
+                          const float* positions, size_t stride)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i + 2 < numIndices; i += 3) {
+        auto a = indices[i], b = indices[i + 1], c = indices[i + 2];
+        if (a == b || b == c || c == a)
+            continue;
+        auto pa = position(positions, stride, a);
+        auto normal = cross(position(positions, stride, b) - pa,
+                            position(positions, stride, c) - pa);
+        if (normal == vec3(0.0f))
+            continue;
+        indices[kept++] = a;
+        indices[kept++] = b;
+        indices[kept++] = c;
+    }
+    return kept;
+}
+
+// Tipsify fans around one vertex at a time, emitting all of its remaining
+// triangles. The next fanning vertex is one of the vertices just emitted
+// that is still in the cache and will stay there while its own remaining
+// triangles are emitted. If there is none, it backtracks to a recently
+// emitted vertex, or takes the next vertex in index order.
+void
+optimizeVertexCache(uint32_t* indices, size_t numIndices, size_t numVertices,
+                    unsigned int cacheSize, std::vector<uint32_t>* clusters)
+{
+    if (clusters)
+        clusters->clear();
+    auto numTriangles = numIndices / 3;
+    if (numTriangles == 0)
+        return;
+
+    // Triangles around each vertex, and how many of them are not emitted.
+    std::vector<uint32_t> live(numVertices, 0);
+    for (size_t i = 0; i < numTriangles * 3; i++)
+        live[indices[i]]++;
+    std::vector<uint32_t> offsets(numVertices + 1, 0);
+    for (size_t v = 0; v < numVertices; v++)
+        offsets[v + 1] = offsets[v] + live[v];
+    std::vector<uint32_t> adjacency(numTriangles * 3);
+    {
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < numTriangles * 3; i++)
+            adjacency[fill[indices[i]]++] = uint32_t(i / 3);
+    }
+
+    std::vector<uint32_t> cacheTime(numVertices, 0);
+    std::vector<bool> emitted(numTriangles, false);
+    std::vector<uint32_t> deadEnd, candidates, result;
+    result.reserve(numTriangles * 3);
+    uint32_t time = cacheSize + 1;
+    size_t cursor = 0;
+
+    auto skipDeadEnd = [&]() -> uint32_t {
+        while (!deadEnd.empty()) {
+            auto vertex = deadEnd.back();
+            deadEnd.pop_back();
+            if (live[vertex])
+                return vertex;
+        }
+        for (; cursor < numVertices; cursor++)
+            if (live[cursor])
+                return uint32_t(cursor);
+        return none;
+    };
+
+    auto fanning = skipDeadEnd();
+    bool cold = true;
+    while (fanning != none) {
+        if (cold && clusters)
+            clusters->push_back(uint32_t(result.size() / 3));
+
+        candidates.clear();
+        for (auto a = offsets[fanning]; a < offsets[fanning + 1]; a++) {
+            auto triangle = adjacency[a];
+            if (emitted[triangle])
+                continue;
+            emitted[triangle] = true;
+            for (int c = 0; c < 3; c++) {
+                auto vertex = indices[3 * triangle + c];
+                result.push_back(vertex);
+                deadEnd.push_back(vertex);
+                candidates.push_back(vertex);
+                live[vertex]--;
+                if (time - cacheTime[vertex] > cacheSize)
+                    cacheTime[vertex] = time++;
+            }
+        }
+
+        // Prefer the vertex that entered the cache first, as long as its
+        // remaining triangles (at most two new vertices each) fit.
+        auto next = none;
+        int64_t priority = -1;
+        for (auto vertex : candidates) {
+            if (!live[vertex])
+                continue;
+            int64_t p = 0;
+            if (time - cacheTime[vertex] + 2 * live[vertex] <= cacheSize)
+                p = time - cacheTime[vertex];
+            if (p > priority) {
+                priority = p;
+                next = vertex;
+            }
+        }
+        cold = next == none;
+        fanning = cold ? skipDeadEnd() : next;
+    }
+
+    std::copy(result.begin(), result.end(), indices);
+}
+
+void
+optimizeOverdraw(uint32_t* indices, size_t numIndices, const float* positions,
+                 size_t stride, size_t numVertices,
+                 const std::vector<uint32_t>& clusters, unsigned int cacheSize,
+                 float threshold)
+{
+    auto numTriangles = uint32_t(numIndices / 3);
+    if (numTriangles == 0)
+        return;
+
+    // Split each cluster where the misses so far are close to the average of
+    // the whole cluster, restarting with a cold cache.
+    std::vector<uint32_t> starts;
+    FifoCache cache(numVertices, cacheSize);
+    for (size_t c = 0; c < clusters.size(); c++) {
+        auto begin = clusters[c];
+        auto end = c + 1 < clusters.size() ? clusters[c + 1] : numTriangles;
+
+        cache.clear();
+        size_t clusterMisses = 0;
+        for (auto t = begin; t < end; t++)
+            clusterMisses += cache.triangle(indices + 3 * t);
+        auto limit = threshold * float(clusterMisses) / float(end - begin);
+
+        cache.clear();
+        starts.push_back(begin);
+        size_t misses = 0, count = 0;
+        for (auto t = begin; t < end; t++) {
+            misses += cache.triangle(indices + 3 * t);
+            count++;
+            if (t + 1 < end && float(misses) <= limit * float(count)) {
+                starts.push_back(t + 1);
+                cache.clear();
+                misses = 0;
+                count = 0;
+            }
+        }
+    }
+    if (starts.empty() || starts.front() != 0)
+        starts.insert(starts.begin(), 0);
+
+    // Area weighted centroid and normal of each cluster.
+    struct Cluster
+    {
+        uint32_t begin, end;
+        vec3 centroid;
+        vec3 normal;
+        float area;
+        float sortKey;
+    };
+    std::vector<Cluster> sorted;
+    vec3 meshCentroid(0.0f);
+    float meshArea = 0.0f;
+    for (size_t s = 0; s < starts.size(); s++) {
+        Cluster cluster;
+        cluster.begin = starts[s];
+        cluster.end = s + 1 < starts.size() ? starts[s + 1] : numTriangles;
+        cluster.centroid = vec3(0.0f);
+        cluster.normal = vec3(0.0f);
+        cluster.area = 0.0f;
+        for (auto t = cluster.begin; t < cluster.end; t++) {
+            auto a = position(positions, stride, indices[3 * t]);
+            auto b = position(positions, stride, indices[3 * t + 1]);
+            auto c = position(positions, stride, indices[3 * t + 2]);
+            auto normal = cross(b - a, c - a);
+            auto area = length(normal);
+            cluster.centroid += (a + b + c) * (area / 3.0f);
+            cluster.normal += normal;
+            cluster.area += area;
+        }
+        meshCentroid += cluster.centroid;
+        meshArea += cluster.area;
+        if (cluster.area > 0.0f)
+            cluster.centroid /= cluster.area;
+        sorted.push_back(cluster);
+    }
+    if (meshArea > 0.0f)
+        meshCentroid /= meshArea;
+
+    for (auto& cluster : sorted) {
+        auto normal = cluster.normal;
+        auto normalLength = length(normal);
+        cluster.sortKey =
+          normalLength > 0.0f
+            ? dot(cluster.centroid - meshCentroid, normal / normalLength)
+            : 0.0f;
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const Cluster& a, const Cluster& b) {
+                         return a.sortKey > b.sortKey;
+                     });
+
+    std::vector<uint32_t> result;
+    result.reserve(numTriangles * 3);
+    for (const auto& cluster : sorted)
+        result.insert(result.end(), indices + 3 * cluster.begin,
+                      indices + 3 * cluster.end);
+    std::copy(result.begin(), result.end(), indices);
+}
+
+std::vector<uint32_t>
+buildClusters(const uint32_t* indices, size_t numIndices, size_t numVertices,
+              unsigned int maxVertices, unsigned int maxTriangles)
+{
+    std::vector<uint32_t> clusters;
+    // The cluster each vertex was last counted in.
+    std::vector<uint32_t> seen(numVertices, none);
+    unsigned int vertices = 0, triangles = 0;
+    for (size_t i = 0; i + 2 < numIndices; i += 3) {
+        unsigned int added = 0;
+        for (int k = 0; k < 3; k++)
+            added += seen[indices[i + k]] != clusters.size() - 1;
+        // Shared vertices of the triangle are counted twice here, which
+        // only ever ends a cluster early.
+        if (clusters.empty() || vertices + added > maxVertices ||
+            triangles == maxTriangles) {
+            clusters.push_back(uint32_t(i));
+            vertices = 0;
+            triangles = 0;
+        }
+        auto cluster = uint32_t(clusters.size() - 1);
+        for (int k = 0; k < 3; k++) {
+            auto& tag = seen[indices[i + k]];
+            if (tag != cluster) {
+                tag = cluster;
+                vertices++;
+            }
+        }
+        triangles++;
+    }
+    return clusters;
+}
+
+ClusterBounds
+clusterBounds(const uint32_t* indices, size_t numIndices,
+              const float* positions, size_t stride)
+{
+    ClusterBounds bounds;
+    auto mf = std::numeric_limits<float>::max();
+    vec3 minPos(mf), maxPos(-mf), normals(0.0f);
+    for (size_t i = 0; i + 2 < numIndices; i += 3) {
+        vec3 p[3];
+        for (int k = 0; k < 3; k++) {
+            p[k] = position(positions, stride, indices[i + k]);
+            minPos = min(minPos, p[k]);
+            maxPos = max(maxPos, p[k]);
+        }
+        auto normal = cross(p[1] - p[0], p[2] - p[0]);
+        auto area = length(normal);
+        if (area > 0.0f)
+            normals += normal / area;
+    }
+
+    auto center = (minPos + maxPos) / 2.0f;
+    float radius = 0.0f;
+    for (size_t i = 0; i < numIndices; i++)
+        radius = std::max(
+          radius, distance(center, position(positions, stride, indices[i])));
+
+    // The cone around the mean normal, if it is narrower than a hemisphere.
+    auto axis = length(normals) > 0.0f ? normalize(normals) : vec3(0.0f);
+    float minDot = 1.0f;
+    for (size_t i = 0; i + 2 < numIndices; i += 3) {
+        auto p0 = position(positions, stride, indices[i]);
+        auto normal = cross(position(positions, stride, indices[i + 1]) - p0,
+                            position(positions, stride, indices[i + 2]) - p0);
+        auto area = length(normal);
+        if (area > 0.0f)
+            minDot = std::min(minDot, dot(axis, normal / area));
+    }
+
+    std::copy_n(&center.x, 3, bounds.center);
+    bounds.radius = radius;
+    std::copy_n(&axis.x, 3, bounds.coneAxis);
+    bounds.coneCutoff =
+      minDot > 0.0f ? std::sqrt(1.0f - minDot * minDot) : 1.0f;
+    return bounds;
+}
+
+std::vector<uint32_t>
+simplifyMesh(const uint32_t* indices, size_t numIndices, const float* positions,
+             size_t stride, size_t numVertices, size_t targetIndices,
+             float* error)
+{
+    std::vector<uint32_t> result(indices, indices + numIndices / 3 * 3);
+    double maxCost = 0.0;
+    auto pos = [&](uint32_t vertex) {
+        return position(positions, stride, vertex);
+    };
+
+    // Vertices that share a position with another vertex are locked. The
+    // others stand for their position in the topology below.
+    std::vector<uint32_t> used(result);
+    std::sort(used.begin(), used.end());
+    used.erase(std::unique(used.begin(), used.end()), used.end());
+    std::sort(used.begin(), used.end(), [&](uint32_t a, uint32_t b) {
+        auto pa = pos(a), pb = pos(b);
+        return std::tie(pa.x, pa.y, pa.z) < std::tie(pb.x, pb.y, pb.z);
+    });
+    std::vector<uint32_t> rep(numVertices);
+    std::vector<uint8_t> locked(numVertices, 0);
+    for (size_t i = 0; i < used.size();) {
+        size_t j = i + 1;
+        while (j < used.size() && pos(used[j]) == pos(used[i]))
+            j++;
+        for (auto k = i; k < j; k++) {
+            rep[used[k]] = used[i];
+            locked[used[k]] = j - i > 1;
+        }
+        i = j;
+    }
+
+    // Edges of a single triangle are on the border.
+    {
+        std::vector<uint64_t> edges;
+        edges.reserve(result.size());
+        for (size_t i = 0; i < result.size(); i += 3)
+            for (int e = 0; e < 3; e++)
+                edges.push_back(edgeKey(rep[result[i + e]],
+                                        rep[result[i + (e + 1) % 3]]));
+        std::sort(edges.begin(), edges.end());
+        for (size_t i = 0; i < edges.size();) {
+            size_t j = i + 1;
+            while (j < edges.size() && edges[j] == edges[i])
+                j++;
+            if (j - i == 1) {
+                locked[uint32_t(edges[i] >> 32)] = 1;
+                locked[uint32_t(edges[i])] = 1;
+            }
+            i = j;
+        }
+        for (auto vertex : used)
+            locked[vertex] |= locked[rep[vertex]];
+    }
+
+    std::vector<Quadric> quadrics(numVertices);
+    for (size_t i = 0; i < result.size(); i += 3) {
+        auto a = pos(result[i]), b = pos(result[i + 1]), c = pos(result[i + 2]);
+        auto normal = cross(dvec3(b - a), dvec3(c - a));
+        auto area = length(normal);
+        if (area == 0.0)
+            continue;
+        normal /= area;
+        auto d = -dot(normal, dvec3(a));
+        for (int k = 0; k < 3; k++)
+            quadrics[result[i + k]].addPlane(normal, d);
+    }
+
+    struct Collapse
+    {
+        uint32_t from, to;
+        double cost;
+    };
+    std::vector<Collapse> collapses;
+    std::vector<uint32_t> remap(numVertices), offsets, adjacency;
+    std::vector<uint8_t> touched(numVertices);
+    std::vector<uint64_t> edges;
+
+    // Each pass collapses a set of disjoint edges, cheapest first, then
+    // rewrites the triangles.
+    while (result.size() > targetIndices) {
+        edges.clear();
+        for (size_t i = 0; i < result.size(); i += 3)
+            for (int e = 0; e < 3; e++)
+                edges.push_back(
+                  edgeKey(result[i + e], result[i + (e + 1) % 3]));
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+        collapses.clear();
+        for (auto edge : edges) {
+            auto a = uint32_t(edge >> 32), b = uint32_t(edge);
+            if (locked[a] && locked[b])
+                continue;
+            auto quadric = quadrics[a];
+            quadric += quadrics[b];
+            auto toB = locked[a] ? -1.0 : quadric(pos(b));
+            auto toA = locked[b] ? -1.0 : quadric(pos(a));
+            if (toA < 0.0 || (toB >= 0.0 && toB <= toA))
+                collapses.push_back({ a, b, toB });
+            else
+                collapses.push_back({ b, a, toA });
+        }
+        std::sort(collapses.begin(), collapses.end(),
+                  [](const Collapse& x, const Collapse& y) {
+                      return x.cost < y.cost;
+                  });
+
+        // Triangles around each vertex, for the flip test.
+        offsets.assign(numVertices + 1, 0);
+        for (auto vertex : result)
+            offsets[vertex + 1]++;
+        for (size_t v = 0; v < numVertices; v++)
+            offsets[v + 1] += offsets[v];
+        adjacency.resize(result.size());
+        {
+            std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+            for (size_t i = 0; i < result.size(); i++)
+                adjacency[fill[result[i]]++] = uint32_t(i / 3);
+        }
+        auto flips = [&](uint32_t from, uint32_t to) -> bool {
+            for (auto a = offsets[from]; a < offsets[from + 1]; a++) {
+                auto t = result.data() + 3 * adjacency[a];
+                if (t[0] == to || t[1] == to || t[2] == to)
+                    continue;
+                // The test assumes the other vertices stay where they are.
+                for (int k = 0; k < 3; k++)
+                    if (remap[t[k]] != t[k])
+                        return true;
+                vec3 p[3] = { pos(t[0]), pos(t[1]), pos(t[2]) };
+                auto before = cross(p[1] - p[0], p[2] - p[0]);
+                for (int k = 0; k < 3; k++)
+                    if (t[k] == from)
+                        p[k] = pos(to);
+                auto after = cross(p[1] - p[0], p[2] - p[0]);
+                // Also reject turns by more than about 75 degrees, which
+                // tend to fold the surface over a few passes.
+                if (dot(before, after) <=
+                    0.25f * length(before) * length(after))
+                    return true;
+            }
+            return false;
+        };
+
+        for (size_t v = 0; v < numVertices; v++)
+            remap[v] = uint32_t(v);
+        std::fill(touched.begin(), touched.end(), 0);
+        size_t excess = (result.size() - targetIndices) / 3;
+        size_t removed = 0;
+        for (const auto& collapse : collapses) {
+            if (removed >= excess)
+                break;
+            if (touched[collapse.from] || touched[collapse.to] ||
+                flips(collapse.from, collapse.to))
+                continue;
+            remap[collapse.from] = collapse.to;
+            touched[collapse.from] = touched[collapse.to] = 1;
+            quadrics[collapse.to] += quadrics[collapse.from];
+            maxCost = std::max(maxCost, collapse.cost);
+            // An interior edge is shared by two triangles.
+            removed += 2;
+        }
+        if (removed == 0)
+            break;
+
+        size_t kept = 0;
+        for (size_t i = 0; i < result.size(); i += 3) {
+            auto a = remap[result[i]], b = remap[result[i + 1]],
+                 c = remap[result[i + 2]];
+            if (a == b || b == c || c == a)
+                continue;
+            result[kept++] = a;
+            result[kept++] = b;
+            result[kept++] = c;
+        }
+        result.resize(kept);
+    }
+
+    if (error)
+        *error = float(std::sqrt(maxCost));
+    return result;
+}
+
+void
+computeTangents(const uint32_t* indices, size_t numIndices, size_t numVertices,
+                const float* positions, const float* normals,
+                const float* texCoords, float* tangents, float* bitangents,
+                size_t stride)
+{
+    const size_t grain = 1 << 15;
+    auto numTriangles = numIndices / 3;
+
+    if (threadCount(numTriangles, grain) == 1) {
+        // Add up the directions in place, a block of triangles at a time.
+        for (size_t v = 0; v < numVertices; v++) {
+            std::fill_n(tangents + v * stride, 3, 0.0f);
+            std::fill_n(bitangents + v * stride, 3, 0.0f);
+        }
+        const size_t block = 256;
+        float directions[6 * block];
+        for (size_t begin = 0; begin < numTriangles; begin += block) {
+            auto end = std::min(begin + block, numTriangles);
+            triangleDirections(indices, positions, texCoords, stride, begin,
+                               end, directions);
+            for (auto i = 3 * begin; i < 3 * end; i++) {
+                auto direction = directions + 6 * (i / 3 - begin);
+                auto tangent = tangents + indices[i] * stride;
+                auto bitangent = bitangents + indices[i] * stride;
+                for (int k = 0; k < 3; k++) {
+                    tangent[k] += direction[k];
+                    bitangent[k] += direction[3 + k];
+                }
+            }
+        }
+        for (size_t v = 0; v < numVertices; v++) {
+            auto normal = position(normals, stride, uint32_t(v));
+            auto tangent = orthonormalize(
+              position(tangents, stride, uint32_t(v)), normal);
+            auto bitangent = orthonormalize(
+              position(bitangents, stride, uint32_t(v)), normal);
+            std::copy_n(&tangent.x, 3, tangents + v * stride);
+            std::copy_n(&bitangent.x, 3, bitangents + v * stride);
+        }
+        return;
+    }
+
+    std::vector<float> directions(6 * numTriangles);
+    parallelFor(numTriangles, grain, [&](size_t begin, size_t end) {
+        triangleDirections(indices, positions, texCoords, stride, begin, end,
+                           directions.data() + 6 * begin);
+    });
+
+    // Each vertex gathers the directions of its triangles, so the sums need
+    // no synchronization. The triangles are listed in order, which adds them
+    // up in the same order as the serial scatter.
+    std::vector<uint32_t> offsets(numVertices + 1, 0);
+    std::vector<uint32_t> adjacency(3 * numTriangles);
+    for (size_t i = 0; i < 3 * numTriangles; i++)
+        offsets[indices[i] + 1]++;
+    for (size_t v = 0; v < numVertices; v++)
+        offsets[v + 1] += offsets[v];
+    {
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < 3 * numTriangles; i++)
+            adjacency[fill[indices[i]]++] = uint32_t(i / 3);
+    }
+
+    parallelFor(numVertices, grain, [&](size_t begin, size_t end) {
+        for (auto v = begin; v < end; v++) {
+            vec3 tangent(0.0f), bitangent(0.0f);
+            for (auto a = offsets[v]; a < offsets[v + 1]; a++) {
+                auto direction = &directions[6 * size_t(adjacency[a])];
+                tangent += vec3(direction[0], direction[1], direction[2]);
+                bitangent += vec3(direction[3], direction[4], direction[5]);
+            }
+            auto normal = position(normals, stride, uint32_t(v));
+            tangent = orthonormalize(tangent, normal);
+            bitangent = orthonormalize(bitangent, normal);
+            std::copy_n(&tangent.x, 3, tangents + v * stride);
+            std::copy_n(&bitangent.x, 3, bitangents + v * stride);
+        }
+    });
+}
+
+uint32_t
+optimizeVertexFetch(std::vector<float>& vertices, size_t stride,
+                    uint32_t* indices, size_t numIndices)
+{
+    auto numVertices = vertices.size() / stride;
+    std::vector<uint32_t> remap(numVertices, none);
+    uint32_t next = 0;
+    for (size_t i = 0; i < numIndices; i++) {
+        auto& target = remap[indices[i]];
+        if (target == none)
+            target = next++;
+        indices[i] = target;
+    }
+
+    std::vector<float> result(size_t(next) * stride);
+    for (size_t v = 0; v < numVertices; v++) {
+        if (remap[v] != none)
+            std::copy_n(&vertices[v * stride], stride,
+                        &result[size_t(remap[v]) * stride]);
+    }
+    vertices.swap(result);
+    return next;
+}
+}
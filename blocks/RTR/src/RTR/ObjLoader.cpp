@@ -3,12 +3,23 @@
 //
 
 #include "RTR/ObjLoader.hpp"
+#include "RTR/MeshCache.hpp"
+#include "RTR/MeshOptimizer.hpp"
 #include "RTR/tiny_obj_loader.h"
 #include "cinder/GeomIo.h"
 #include "cinder/Log.h"
 
 #include "glm/ext.hpp"
 
+#include <algorithm>
+#include <deque>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1) ||            \
+  defined(__SSE__)
+#define RTR_SSE
+#include <xmmintrin.h>
+#endif
+
 using namespace ci;
 using namespace std;
 using namespace glm;
@@ -45,94 +56,102 @@ defaultObjShader()
     return objShader;
 }
 
-map<fs::path, gl::TextureBaseRef> textureCache;
-
-gl::TextureBaseRef
-getTexture(fs::path file)
+// The texture is a placeholder until the loader has uploaded it, see
+// TextureLoader::update().
+TextureRef
+getTexture(fs::path file, const ObjLoadOptions& options)
 {
-    auto texture = textureCache.find(file);
-    if (texture == textureCache.end()) {
-        auto image = loadImage(file);
-        auto newTexture = gl::Texture2d::create(image);
-        textureCache[file] = newTexture;
-        // CI_LOG_I("ObjLoader: 2d texture loaded: " << file);
-        return newTexture;
-    } else {
-        return texture->second;
-    }
+    return textureCache.get(file, options.compressTextures,
+                            options.cacheDirectory);
 }
 
-void
-normalizePositions(std::vector<tinyobj::shape_t>& shapes)
+// The scale that makes the longest side of the bounds 2, or 1 if they are
+// flat in every direction.
+float
+normalizingScale(const AxisAlignedBox& bounds)
 {
-    auto mf = std::numeric_limits<float>::max();
-    vec3 minPos(mf, mf, mf);
-    vec3 maxPos(-mf, -mf, -mf);
+    auto size = bounds.getSize();
+    auto longest = std::max(std::max(size.x, size.y), size.z);
+    return longest > 0.0f ? 2.0f / longest : 1.0f;
+}
 
-    for (auto& shape : shapes) {
-        auto& pos = shape.mesh.positions;
-        for (int i = 0; i < pos.size() / 3; i++) {
-            auto vertex = vec3(pos[i * 3 + 0], pos[i * 3 + 1], pos[i * 3 + 2]);
-            minPos = glm::min(minPos, vertex);
-            maxPos = glm::max(maxPos, vertex);
-        }
-    }
+// Centers the bounds at the origin and scales their longest side to 2.
+mat4
+normalizingTransform(const AxisAlignedBox& bounds)
+{
+    return glm::translate(glm::scale(mat4(), vec3(normalizingScale(bounds))),
+                          -bounds.getCenter());
+}
 
-    auto center = (minPos + maxPos) / 2.0f;
-    auto extend = maxPos - minPos;
-    auto scale = 2.0f / std::max(std::max(extend.x, extend.y), extend.z);
-    auto offset = -center;
+// Bakes normalizingTransform() into the positions in a single pass, four
+// floats at a time with SSE. The three offset vectors repeat every three
+// vertices.
+void
+normalizePositions(std::vector<tinyobj::shape_t>& shapes,
+                   const AxisAlignedBox& bounds)
+{
+    auto offset = -bounds.getCenter();
+    auto scale = normalizingScale(bounds);
 
     for (auto& shape : shapes) {
         auto& pos = shape.mesh.positions;
-        for (int i = 0; i < pos.size() / 3; i++) {
-            auto vertex = vec3(pos[i * 3 + 0], pos[i * 3 + 1], pos[i * 3 + 2]);
-            vertex = (vertex + offset) * scale;
-            pos[i * 3 + 0] = vertex.x;
-            pos[i * 3 + 1] = vertex.y;
-            pos[i * 3 + 2] = vertex.z;
-        }
+        size_t i = 0;
+#ifdef RTR_SSE
+        __m128 offsets[3] = { _mm_setr_ps(offset.x, offset.y, offset.z,
+                                          offset.x),
+                              _mm_setr_ps(offset.y, offset.z, offset.x,
+                                          offset.y),
+                              _mm_setr_ps(offset.z, offset.x, offset.y,
+                                          offset.z) };
+        auto scales = _mm_set1_ps(scale);
+        for (; i + 12 <= pos.size(); i += 12)
+            for (int k = 0; k < 3; k++) {
+                auto p = &pos[i + 4 * k];
+                _mm_storeu_ps(p, _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(p),
+                                                       offsets[k]),
+                                            scales));
+            }
+#endif
+        for (; i < pos.size(); i++)
+            pos[i] = (pos[i] + offset[int(i % 3)]) * scale;
     }
 }
 
-// Lifted from cinder/GeomIo.hpp with a crahing bug fixed.
-class Tangents : public geom::Modifier
+namespace {
+
+/// \brief Reads material libraries like tinyobj::MaterialFileReader and
+/// records the files it has read.
+class RecordingMaterialReader : public tinyobj::MaterialReader
 {
   public:
-    Tangents() {}
+    RecordingMaterialReader(const fs::path& basePath)
+      : basePath(basePath)
+      , reader(basePath.string() + "/")
+    {
+    }
+
+    bool operator()(const std::string& matId,
+                    std::vector<tinyobj::material_t>& materials,
+                    std::map<std::string, int>& matMap,
+                    std::string& err) override
+    {
+        files.push_back(basePath / matId);
+        return reader(matId, materials, matMap, err);
+    }
 
-    uint8_t getAttribDims(geom::Attrib attr,
-                          uint8_t upstreamDims) const override;
-    geom::AttribSet getAvailableAttribs(
-      const Modifier::Params& upstreamParams) const override;
+    std::vector<fs::path> files;
 
-    Modifier* clone() const override { return new Tangents; }
-    void process(geom::SourceModsContext* ctx,
-                 const geom::AttribSet& requestedAttribs) const override;
+  private:
+    fs::path basePath;
+    tinyobj::MaterialFileReader reader;
 };
+}
 
-ModelRef
-loadObjFile(const fs::path& file, bool normalize, const gl::GlslProgRef& shader)
+vector<MaterialRef>
+createMaterials(const std::vector<tinyobj::material_t>& materials,
+                const fs::path& basePath, const ObjLoadOptions& options,
+                const gl::GlslProgRef& shader)
 {
-    auto basePath = fs::absolute(file.parent_path());
-
-    std::vector<ShapeRef> bins;
-
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-
-    std::string err;
-    if (!tinyobj::LoadObj(shapes, materials, err, file.string().c_str(),
-                          (basePath.string() + "/").c_str())) {
-        throw Exception("ObjLoader: error loading: " + file.string() + ": " +
-                        err);
-    }
-    if (!err.empty())
-        CI_LOG_W("ObjLoader: " << err);
-
-    if (normalize)
-        normalizePositions(shapes);
-
     vector<MaterialRef> materialLib;
     for (const auto& mat : materials) {
         auto material =
@@ -141,170 +160,708 @@ loadObjFile(const fs::path& file, bool normalize, const gl::GlslProgRef& shader)
             material->uniform("ka", glm::make_vec3(mat.ambient));
         } else {
             material->uniform("ka", -glm::make_vec3(mat.ambient));
-            material->texture("map_ka",
-                              getTexture(basePath / mat.ambient_texname));
+            material->texture(
+              "map_ka", getTexture(basePath / mat.ambient_texname, options));
         }
         if (mat.diffuse_texname.empty()) {
             material->uniform("kd", glm::make_vec3(mat.diffuse));
         } else {
             material->uniform("kd", -glm::make_vec3(mat.diffuse));
-            material->texture("map_kd",
-                              getTexture(basePath / mat.diffuse_texname));
+            material->texture(
+              "map_kd", getTexture(basePath / mat.diffuse_texname, options));
         }
         if (mat.specular_texname.empty()) {
             material->uniform("ks", glm::make_vec3(mat.specular));
         } else {
             material->uniform("ks", -glm::make_vec3(mat.specular));
-            material->texture("map_ks",
-                              getTexture(basePath / mat.specular_texname));
+            material->texture(
+              "map_ks", getTexture(basePath / mat.specular_texname, options));
         }
         if (mat.specular_highlight_texname.empty()) {
             material->uniform("ns", float(mat.shininess));
         } else {
             material->uniform("ns", -float(mat.shininess));
             material->texture(
-              "map_ns", getTexture(basePath / mat.specular_highlight_texname));
+              "map_ns",
+              getTexture(basePath / mat.specular_highlight_texname, options));
         }
         if (!mat.bump_texname.empty()) {
-            material->texture("map_bump",
-                              getTexture(basePath / mat.bump_texname));
+            material->texture(
+              "map_bump", getTexture(basePath / mat.bump_texname, options));
         }
         if (!mat.displacement_texname.empty()) {
-            material->texture("disp",
-                              getTexture(basePath / mat.displacement_texname));
+            material->texture(
+              "disp", getTexture(basePath / mat.displacement_texname, options));
         }
         if (!mat.alpha_texname.empty()) {
-            material->texture("map_d",
-                              getTexture(basePath / mat.alpha_texname));
+            material->texture(
+              "map_d", getTexture(basePath / mat.alpha_texname, options));
         }
         materialLib.push_back(material);
     }
+    return materialLib;
+}
 
-    // Use all available atttributes to build the mesh so that shaders can
-    // be replaced later without missing any of them. This uses more memory
-    // than necessary but is more flexible. And memory is cheap anyway.
-    geom::AttribSet allAttributes;
-    for (int i = 0; i != geom::Attrib::NUM_ATTRIBS; i++)
-        allAttributes.insert(geom::Attrib(i));
-
-    for (const auto& s : shapes) {
-        const auto& mesh = s.mesh;
-
-        TriMesh::Format meshFormat;
-        meshFormat.positions();
-        if (mesh.normals.size())
-            meshFormat.normals();
-        if (mesh.texcoords.size())
-            meshFormat.texCoords();
-        if (mesh.normals.size() && mesh.texcoords.size())
-            meshFormat.tangents().bitangents();
-
-        TriMesh triMesh(meshFormat);
-
-        triMesh.appendPositions(
-          reinterpret_cast<const vec3*>(&mesh.positions[0]),
-          mesh.positions.size() / 3);
-
-        if (mesh.normals.size())
-            triMesh.appendNormals(
-              reinterpret_cast<const vec3*>(&mesh.normals[0]),
-              mesh.normals.size() / 3);
-
-        if (mesh.texcoords.size())
-            triMesh.appendTexCoords0(
-              reinterpret_cast<const vec2*>(&mesh.texcoords[0]),
-              mesh.texcoords.size() / 2);
-
-        for (size_t i = 0; i < mesh.indices.size(); i += 3)
-            triMesh.appendTriangle(mesh.indices[i + 0], mesh.indices[i + 1],
-                                   mesh.indices[i + 2]);
-
-        // TODO Support per face materials. For now, use the material of the
-        // first face for the entire mesh. Warn, if this assumption is not true.
-        bool homogenous = true;
-        for (auto id : mesh.material_ids)
-            homogenous &= id == mesh.material_ids[0];
-        if (!homogenous)
-            CI_LOG_W("Per-face materials detected and ignored");
-
-        auto& material = materialLib[mesh.material_ids[0]];
-        if (triMesh.hasNormals() && triMesh.hasTexCoords()) {
-            auto withTangents = triMesh >> Tangents();
-            bins.push_back(Shape::create(
-              { gl::VboMesh::create(withTangents, allAttributes) }, material));
-        } else {
-            bins.push_back(Shape::create(
-              { gl::VboMesh::create(triMesh, allAttributes) }, material));
+// The builder keeps the owner of the streams alive, so that meshes can be
+// rebuilt for programs that consume other attributes.
+MeshBuilderRef
+createMeshBuilder(const MeshStreams& streams,
+                  const std::shared_ptr<const void>& owner)
+{
+    std::vector<VertexInput> inputs;
+    for (const auto& attribute : streams.attributes)
+        inputs.push_back({ attribute.attrib, attribute.dims,
+                           streams.vertices + attribute.offset,
+                           streams.stride });
+    return MeshBuilder::create(streams.numVertices, inputs, streams.numIndices,
+                               streams.indices, owner);
+}
+
+// The hierarchy over the triangles of a shape is built in the background
+// after loading. The owner keeps the streams alive until then.
+void
+setTriangleBvhSource(const ShapeRef& shape, const MeshStreams& streams,
+                     const std::shared_ptr<const void>& owner,
+                     uint32_t begin, uint32_t end)
+{
+    for (const auto& attribute : streams.attributes) {
+        if (attribute.attrib != geom::POSITION || attribute.dims != 3)
+            continue;
+        auto indices = streams.indices + begin;
+        auto positions = streams.vertices + attribute.offset;
+        auto stride = streams.stride;
+        shape->setTriangleBvhSource(
+          [indices, positions, stride, begin, end, owner] {
+            return TriangleBvh::create(indices, end - begin, positions, stride,
+                                       begin / 3);
+        });
+    }
+}
+
+ModelRef
+createModel(const std::vector<tinyobj::material_t>& materials,
+            const std::vector<MeshStreams>& shapes, const fs::path& basePath,
+            const ObjLoadOptions& options, const gl::GlslProgRef& shader,
+            const std::shared_ptr<const void>& owner, const mat4& transform)
+{
+    auto materialLib = createMaterials(materials, basePath, options, shader);
+
+    // Faces without a material get a plain grey one.
+    MaterialRef defaultMaterial;
+    auto lookup = [&](int id) -> MaterialRef {
+        if (id >= 0 && id < int(materialLib.size()))
+            return materialLib[id];
+        if (!defaultMaterial) {
+            defaultMaterial = Material::create(
+              "default", shader ? shader : defaultObjShader());
+            defaultMaterial->uniform("ka", vec3(0.0f));
+            defaultMaterial->uniform("kd", vec3(0.8f));
+        }
+        return defaultMaterial;
+    };
+
+    std::vector<ShapeRef> bins;
+    for (const auto& streams : shapes) {
+        // The shapes of the streams share the meshes built for each format.
+        auto builder = MeshBuilder::shared(createMeshBuilder(streams, owner));
+        for (const auto& part : streams.parts) {
+            if (part.numRanges == 0)
+                continue;
+            auto fullRanges = streams.ranges.begin() + part.firstRange;
+            ShapeRef shape;
+            if (part.numRanges == 1) {
+                shape =
+                  Shape::create({ builder }, lookup(fullRanges[0].material));
+            } else {
+                std::vector<MaterialRange> ranges;
+                for (uint32_t r = 0; r < part.numRanges; r++)
+                    ranges.push_back({ lookup(fullRanges[r].material),
+                                       fullRanges[r].first,
+                                       fullRanges[r].count });
+                shape = Shape::create(builder, ranges);
+            }
+
+            // The full shape is the first level.
+            std::vector<LevelOfDetail> levels(1 + part.lods.size());
+            levels[0].error = 0.0f;
+            for (uint32_t r = 0; r < part.numRanges; r++)
+                levels[0].ranges.push_back(
+                  { fullRanges[r].first, fullRanges[r].count });
+            for (size_t l = 0; l < part.lods.size(); l++) {
+                levels[l + 1].error = part.lods[l].error;
+                for (const auto& range : part.lods[l].ranges)
+                    levels[l + 1].ranges.push_back(
+                      { range.first, range.count });
+            }
+
+            // The full ranges of a part are contiguous.
+            auto begin = fullRanges[0].first;
+            auto end = fullRanges[part.numRanges - 1].first +
+                       fullRanges[part.numRanges - 1].count;
+            auto cluster = std::lower_bound(
+              streams.clusters, streams.clusters + streams.numClusters, begin,
+              [](const MeshCluster& cluster, uint32_t first) {
+                  return cluster.first < first;
+              });
+            std::vector<TriangleCluster> clusters;
+            for (; cluster != streams.clusters + streams.numClusters &&
+                   cluster->first < end;
+                 ++cluster) {
+                const auto& bounds = cluster->bounds;
+                clusters.push_back(
+                  { Sphere(make_vec3(bounds.center), bounds.radius),
+                    make_vec3(bounds.coneAxis), bounds.coneCutoff,
+                    { cluster->first, cluster->count } });
+            }
+            shape->setBounds(part.bounds);
+            shape->setLevelsOfDetail(levels);
+            shape->setClusters(clusters);
+            if (options.triangleBvhs && end > begin)
+                setTriangleBvhSource(shape, streams, owner, begin, end);
+            bins.push_back(shape);
         }
     }
 
-    return Model::create(bins);
+    buildTriangleBvhs(bins);
+    return Model::create(bins, transform);
 }
 
-using namespace geom;
+// The interleaved vertices and indices of the shapes of a model.
+struct ShapeBuffers
+{
+    std::deque<std::vector<float>> vertices;
+    std::deque<std::vector<uint32_t>> indices;
+    std::deque<std::vector<MeshCluster>> clusters;
+};
 
-uint8_t
-Tangents::getAttribDims(Attrib attr, uint8_t upstreamDims) const
+// Interleaves the parts of a shape into a buffer of its final size and
+// releases the parser's arrays right away, so that only one copy of the
+// vertices is alive at any time. Faces are sorted by material into
+// contiguous index ranges, in the order the materials first appear.
+MeshStreams
+interleaveShape(tinyobj::shape_t* parts, size_t numParts,
+                std::vector<float>& vertices, std::vector<uint32_t>& indices)
 {
-    if (attr == Attrib::TANGENT || attr == Attrib::BITANGENT)
-        return 3;
-    else
-        return upstreamDims;
+    MeshStreams shape;
+    shape.numVertices = 0;
+    shape.numIndices = 0;
+    shape.numClusters = 0;
+    shape.clusters = nullptr;
+    bool hasNormals = true;
+    bool hasTexCoords = true;
+    for (size_t p = 0; p < numParts; p++) {
+        const auto& mesh = parts[p].mesh;
+        shape.numVertices += uint32_t(mesh.positions.size() / 3);
+        shape.numIndices += uint32_t(mesh.indices.size());
+        hasNormals &= mesh.normals.size() == mesh.positions.size();
+        hasTexCoords &= mesh.texcoords.size() / 2 == mesh.positions.size() / 3;
+    }
+    bool hasTangents = hasNormals && hasTexCoords && shape.numIndices;
+
+    shape.stride = 0;
+    auto addAttribute = [&](geom::Attrib attrib, uint8_t dims) {
+        shape.attributes.push_back({ attrib, dims, shape.stride });
+        shape.stride += dims;
+    };
+    addAttribute(geom::POSITION, 3);
+    if (hasNormals)
+        addAttribute(geom::NORMAL, 3);
+    if (hasTexCoords)
+        addAttribute(geom::TEX_COORD_0, 2);
+    if (hasTangents) {
+        addAttribute(geom::TANGENT, 3);
+        addAttribute(geom::BITANGENT, 3);
+    }
+
+    // Count the faces of each material, then scatter them into place. The
+    // range of material id m is at rangeOf[m + 1], where -1 is no material.
+    const uint32_t noRange = ~0u;
+    std::vector<uint32_t> rangeOf;
+    auto slotOf = [](int material) {
+        return size_t(std::max(material, -1) + 1);
+    };
+    for (size_t p = 0; p < numParts; p++) {
+        for (auto id : parts[p].mesh.material_ids) {
+            auto slot = slotOf(id);
+            if (slot >= rangeOf.size())
+                rangeOf.resize(slot + 1, noRange);
+            if (rangeOf[slot] == noRange) {
+                rangeOf[slot] = uint32_t(shape.ranges.size());
+                shape.ranges.push_back({ id, 0, 0 });
+            }
+            shape.ranges[rangeOf[slot]].count += 3;
+        }
+    }
+
+    std::vector<uint32_t> cursors;
+    uint32_t first = 0;
+    for (auto& range : shape.ranges) {
+        range.first = first;
+        cursors.push_back(first);
+        first += range.count;
+    }
+
+    indices.resize(shape.numIndices);
+    uint32_t baseVertex = 0;
+    for (size_t p = 0; p < numParts; p++) {
+        const auto& mesh = parts[p].mesh;
+        for (size_t f = 0; f < mesh.material_ids.size(); f++) {
+            auto& cursor = cursors[rangeOf[slotOf(mesh.material_ids[f])]];
+            for (int i = 0; i < 3; i++)
+                indices[cursor++] = baseVertex + mesh.indices[3 * f + i];
+        }
+        baseVertex += uint32_t(mesh.positions.size() / 3);
+    }
+    shape.indices = indices.data();
+
+    vertices.resize(size_t(shape.numVertices) * shape.stride);
+    float* out = vertices.data();
+    for (size_t p = 0; p < numParts; p++) {
+        auto& mesh = parts[p].mesh;
+        auto numVertices = mesh.positions.size() / 3;
+
+        // Gaps are left for the tangents, which are computed once the
+        // vertices are welded.
+        for (size_t i = 0; i < numVertices; i++) {
+            out = std::copy_n(&mesh.positions[3 * i], 3, out);
+            if (hasNormals)
+                out = std::copy_n(&mesh.normals[3 * i], 3, out);
+            if (hasTexCoords)
+                out = std::copy_n(&mesh.texcoords[2 * i], 2, out);
+            if (hasTangents)
+                out += 6;
+        }
+
+        mesh = tinyobj::mesh_t();
+    }
+    shape.vertices = vertices.data();
+
+    return shape;
 }
 
-AttribSet
-Tangents::getAvailableAttribs(const Modifier::Params& upstreamParams) const
+// Computes the tangents and bitangents into the gaps interleaveShape() left
+// for them. After welding, vertices that were split across faces sum up the
+// directions of all their triangles.
+void
+tangentShape(MeshStreams& shape, std::vector<float>& vertices)
 {
-    return { Attrib::TANGENT, Attrib::BITANGENT };
+    const MeshAttribute* attributes[5] = {};
+    const geom::Attrib semantics[5] = { geom::POSITION, geom::NORMAL,
+                                        geom::TEX_COORD_0, geom::TANGENT,
+                                        geom::BITANGENT };
+    for (const auto& attribute : shape.attributes)
+        for (int a = 0; a < 5; a++)
+            if (attribute.attrib == semantics[a])
+                attributes[a] = &attribute;
+    if (!attributes[3] || !attributes[4])
+        return;
+
+    auto data = vertices.data();
+    computeTangents(shape.indices, shape.numIndices, shape.numVertices,
+                    data + attributes[0]->offset, data + attributes[1]->offset,
+                    data + attributes[2]->offset, data + attributes[3]->offset,
+                    data + attributes[4]->offset, shape.stride);
 }
 
+// Drops degenerate triangles and reorders the triangles of each range for
+// the vertex cache and for overdraw, then the vertices in the order they are
+// first used. Positions are the first attribute.
 void
-Tangents::process(SourceModsContext* ctx,
-                  const AttribSet& requestedAttribs) const
+optimizeShape(MeshStreams& shape, std::vector<float>& vertices,
+              std::vector<uint32_t>& indices, VertexCacheStats& before,
+              VertexCacheStats& after)
 {
-    AttribSet request = requestedAttribs;
-    request.insert(Attrib::POSITION);
-    request.insert(Attrib::NORMAL);
-    request.insert(Attrib::TEX_COORD_0);
-    ctx->processUpstream(request);
+    before += analyzeVertexCache(indices.data(), indices.size(),
+                                 shape.numVertices);
+
+    uint32_t end = 0;
+    std::vector<uint32_t> clusters;
+    for (auto& range : shape.ranges) {
+        auto first = indices.data() + range.first;
+        auto count = uint32_t(removeDegenerateTriangles(
+          first, range.count, vertices.data(), shape.stride));
+        optimizeVertexCache(first, count, shape.numVertices, vertexCacheSize,
+                            &clusters);
+        optimizeOverdraw(first, count, vertices.data(), shape.stride,
+                         shape.numVertices, clusters);
+        std::copy(first, first + count, indices.data() + end);
+        range.first = end;
+        range.count = count;
+        end += count;
+    }
+    shape.ranges.erase(std::remove_if(shape.ranges.begin(), shape.ranges.end(),
+                                      [](const MeshRange& range) {
+                                          return range.count == 0;
+                                      }),
+                       shape.ranges.end());
+    indices.resize(end);
+    shape.numIndices = end;
+    shape.indices = indices.data();
+
+    shape.numVertices =
+      optimizeVertexFetch(vertices, shape.stride, indices.data(), end);
+    shape.vertices = vertices.data();
+
+    after += analyzeVertexCache(indices.data(), indices.size(),
+                                shape.numVertices);
+}
 
-    const size_t numIndices = ctx->getNumIndices();
-    const size_t numVertices = ctx->getNumVertices();
+// Bounding sphere around the center of the bounding box. Positions are the
+// first attribute.
+Sphere
+boundingSphere(const MeshStreams& shape)
+{
+    if (shape.numVertices == 0)
+        return Sphere(vec3(0.0f), 0.0f);
+
+    auto position = [&](uint32_t i) {
+        return make_vec3(shape.vertices + size_t(i) * shape.stride);
+    };
+    vec3 minPos = position(0), maxPos = minPos;
+    for (uint32_t i = 1; i < shape.numVertices; i++) {
+        minPos = glm::min(minPos, position(i));
+        maxPos = glm::max(maxPos, position(i));
+    }
+    auto center = (minPos + maxPos) / 2.0f;
+    float radius = 0.0f;
+    for (uint32_t i = 0; i < shape.numVertices; i++)
+        radius = std::max(radius, distance(center, position(i)));
+    return Sphere(center, radius);
+}
 
-    if (numIndices == 0) {
-        CI_LOG_W("geom::Tangents requires indexed geometry");
-        return;
+// Splits each range into clusters and computes their bounds. Positions are
+// the first attribute.
+void
+clusterShape(MeshStreams& shape, std::vector<MeshCluster>& clusters)
+{
+    for (const auto& range : shape.ranges) {
+        auto indices = shape.indices + range.first;
+        auto firsts = buildClusters(indices, range.count, shape.numVertices);
+        for (size_t c = 0; c < firsts.size(); c++) {
+            auto end = c + 1 < firsts.size() ? firsts[c + 1] : range.count;
+            auto count = end - firsts[c];
+            clusters.push_back({ range.first + firsts[c], count,
+                                 clusterBounds(indices + firsts[c], count,
+                                               shape.vertices, shape.stride) });
+        }
     }
-    if (ctx->getAttribDims(Attrib::POSITION) != 3) {
-        CI_LOG_W("geom::Tangents requires 3D positions");
-        return;
+    shape.numClusters = uint32_t(clusters.size());
+    shape.clusters = clusters.data();
+}
+
+// Appends levels of detail with about half the triangles of the level before
+// to the indices. Each level is simplified from the one before, so its error
+// bound is the sum of the errors of the steps. Stops when a level would be
+// too small or too coarse, or when simplification stalls, as it does on
+// meshes that are mostly seams and borders. Needs the part with the bounds.
+void
+buildLods(MeshStreams& shape, std::vector<uint32_t>& indices)
+{
+    auto& part = shape.parts.front();
+    const size_t maxLevels = 8;
+    const uint32_t minTriangles = 64;
+
+    auto finer = shape.ranges;
+    uint32_t finerCount = 0;
+    for (const auto& range : finer)
+        finerCount += range.count;
+    float error = 0.0f;
+    while (part.lods.size() < maxLevels && finerCount / 3 >= 2 * minTriangles) {
+        MeshLod lod = { 0.0f, {} };
+        auto end = uint32_t(indices.size());
+        uint32_t count = 0;
+        for (const auto& range : finer) {
+            auto target = std::max(range.count / 3 / 2, 1u) * 3;
+            float rangeError;
+            auto simplified = simplifyMesh(
+              indices.data() + range.first, range.count, shape.vertices,
+              shape.stride, shape.numVertices, target, &rangeError);
+            optimizeVertexCache(simplified.data(), simplified.size(),
+                                shape.numVertices);
+            lod.ranges.push_back({ range.material, uint32_t(indices.size()),
+                                   uint32_t(simplified.size()) });
+            indices.insert(indices.end(), simplified.begin(), simplified.end());
+            lod.error = std::max(lod.error, rangeError);
+            count += uint32_t(simplified.size());
+        }
+        // Levels that are off by more than the size of the shape would only
+        // be drawn at a few pixels, where the shape is culled anyway.
+        if (count > finerCount / 5 * 4 ||
+            error + lod.error > part.bounds.getRadius()) {
+            indices.resize(end);
+            break;
+        }
+        error += lod.error;
+        lod.error = error;
+        part.lods.push_back(lod);
+        finer = lod.ranges;
+        finerCount = count;
     }
-    if (ctx->getAttribDims(Attrib::NORMAL) != 3) {
-        CI_LOG_W("geom::Tangents requires 3D normals");
-        return;
+    shape.numIndices = uint32_t(indices.size());
+    shape.indices = indices.data();
+}
+
+// Gathers shapes with the same attributes into shared streams of at most
+// maxShortIndexVertices vertices, so that they keep 16 bit indices. Larger
+// shapes get streams of their own. The indices, ranges and clusters of each
+// shape are rebased onto the shared buffers, and the buffers of the shapes
+// are released on the way. If weld is set, vertices that are bit-identical
+// across shapes, as along the seams between them, are merged, and the
+// vertices of the pool are put back in the order the indices first use them.
+// Returns the number of vertices merged.
+size_t
+poolShapes(std::vector<MeshStreams>& shapes, ShapeBuffers& buffers, bool weld)
+{
+    auto sameAttributes = [](const MeshStreams& a, const MeshStreams& b) {
+        if (a.stride != b.stride || a.attributes.size() != b.attributes.size())
+            return false;
+        for (size_t i = 0; i < a.attributes.size(); i++) {
+            const auto& x = a.attributes[i];
+            const auto& y = b.attributes[i];
+            if (x.attrib != y.attrib || x.dims != y.dims ||
+                x.offset != y.offset)
+                return false;
+        }
+        return true;
+    };
+
+    std::vector<MeshStreams> pools;
+    ShapeBuffers pooled;
+    for (size_t s = 0; s < shapes.size(); s++) {
+        const auto& shape = shapes[s];
+        if (shape.ranges.empty())
+            continue;
+
+        // First fit, so that small shapes fill up the pools before them.
+        size_t p = 0;
+        while (p < pools.size() &&
+               (!sameAttributes(pools[p], shape) ||
+                pools[p].numVertices + shape.numVertices >
+                  maxShortIndexVertices))
+            p++;
+        if (p == pools.size()) {
+            MeshStreams pool;
+            pool.numVertices = 0;
+            pool.stride = shape.stride;
+            pool.attributes = shape.attributes;
+            pools.push_back(pool);
+            pooled.vertices.emplace_back();
+            pooled.indices.emplace_back();
+            pooled.clusters.emplace_back();
+        }
+        auto& pool = pools[p];
+        auto& vertices = pooled.vertices[p];
+        auto& indices = pooled.indices[p];
+        auto baseVertex = pool.numVertices;
+        auto baseIndex = uint32_t(indices.size());
+
+        vertices.insert(vertices.end(), shape.vertices,
+                        shape.vertices +
+                          size_t(shape.numVertices) * shape.stride);
+        for (uint32_t i = 0; i < shape.numIndices; i++)
+            indices.push_back(baseVertex + shape.indices[i]);
+        for (auto part : shape.parts) {
+            part.firstRange += uint32_t(pool.ranges.size());
+            for (auto& lod : part.lods)
+                for (auto& range : lod.ranges)
+                    range.first += baseIndex;
+            pool.parts.push_back(part);
+        }
+        for (auto range : shape.ranges) {
+            range.first += baseIndex;
+            pool.ranges.push_back(range);
+        }
+        for (uint32_t c = 0; c < shape.numClusters; c++) {
+            auto cluster = shape.clusters[c];
+            cluster.first += baseIndex;
+            pooled.clusters[p].push_back(cluster);
+        }
+        pool.numVertices += shape.numVertices;
+
+        std::vector<float>().swap(buffers.vertices[s]);
+        std::vector<uint32_t>().swap(buffers.indices[s]);
+        std::vector<MeshCluster>().swap(buffers.clusters[s]);
     }
-    if (ctx->getAttribDims(Attrib::TEX_COORD_0) != 2) {
-        CI_LOG_W("geom::Tangents requires 2D texture coordinates");
-        return;
+
+    size_t welded = 0;
+    for (size_t p = 0; p < pools.size(); p++) {
+        auto& pool = pools[p];
+        auto& indices = pooled.indices[p];
+        if (weld) {
+            auto numVertices = weldVertices(pooled.vertices[p], pool.stride,
+                                            indices.data(), indices.size());
+            welded += pool.numVertices - numVertices;
+            // Welding keeps the vertex order of the shapes, so the vertices
+            // that the seams merged are no longer in the order of first use.
+            pool.numVertices =
+              optimizeVertexFetch(pooled.vertices[p], pool.stride,
+                                  indices.data(), indices.size());
+        }
+        pool.vertices = pooled.vertices[p].data();
+        pool.numIndices = uint32_t(indices.size());
+        pool.indices = indices.data();
+        pool.numClusters = uint32_t(pooled.clusters[p].size());
+        pool.clusters = pooled.clusters[p].data();
     }
 
-    const vec3* positions = (const vec3*)ctx->getAttribData(geom::POSITION);
-    const vec3* normals = (const vec3*)ctx->getAttribData(geom::NORMAL);
-    const vec2* texCoords = (const vec2*)ctx->getAttribData(geom::TEX_COORD_0);
-
-    if (requestedAttribs.count(geom::TANGENT) ||
-        requestedAttribs.count(geom::BITANGENT)) {
-        vector<vec3> tangents, bitangents;
-        calculateTangents(numIndices, ctx->getIndicesData(), numVertices,
-                          positions, normals, texCoords, &tangents,
-                          &bitangents);
-
-        if (requestedAttribs.count(geom::TANGENT))
-            ctx->copyAttrib(Attrib::TANGENT, 3, 0,
-                            (const float*)tangents.data(), numVertices);
-        if (requestedAttribs.count(geom::BITANGENT))
-            ctx->copyAttrib(Attrib::BITANGENT, 3, 0,
-                            (const float*)bitangents.data(), numVertices);
+    shapes.swap(pools);
+    buffers.vertices.swap(pooled.vertices);
+    buffers.indices.swap(pooled.indices);
+    buffers.clusters.swap(pooled.clusters);
+    return welded;
+}
+
+ModelRef
+loadObjFile(const fs::path& file, bool normalize, const ObjLoadOptions& options,
+            const gl::GlslProgRef& shader)
+{
+    auto basePath = fs::absolute(file.parent_path());
+
+    MappedFile source;
+    if (!source.open(file))
+        throw Exception("ObjLoader: cannot open: " + file.string());
+
+    // Warm path: upload the streams straight from the mapped cache file. The
+    // cache is keyed by the content of the OBJ file, not its time stamp. The
+    // model keeps the mapping to rebuild its meshes; pages that are not
+    // touched again cost no memory.
+    auto sourceHash = hashBytes(source.data(), source.size());
+    // Unless normalization is baked, it leaves the vertices alone and
+    // normalized and plain models share the cache file.
+    bool bake = normalize && options.bakeNormalization;
+    auto cachePath = meshCachePath(file, bake, options.cacheDirectory);
+    uint32_t flags = (bake ? MESH_NORMALIZED : 0) |
+                     (options.optimize ? MESH_OPTIMIZED : 0) |
+                     (options.weld ? MESH_WELDED : 0) |
+                     (options.lods ? MESH_LODS : 0) |
+                     (options.clusters ? MESH_CLUSTERED : 0);
+    // The weld epsilon is no flag, fold it into the key instead.
+    auto epsilon = std::max(0.0f, options.weldEpsilon);
+    if (options.weld)
+        sourceHash = hashBytes(&epsilon, sizeof(epsilon), sourceHash);
+    if (options.cache) {
+        auto cache = std::make_shared<MeshCacheFile>();
+        if (cache->open(cachePath, sourceHash, flags)) {
+            auto transform = normalize && !bake
+                               ? normalizingTransform(cache->bounds())
+                               : mat4();
+            return createModel(cache->materials(), cache->shapes(), basePath,
+                               options, shader, cache, transform);
+        }
     }
+
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+
+    // Parse on all available cores. The parser accumulates the bounds of
+    // the positions on the way.
+    std::string err;
+    RecordingMaterialReader materialReader(basePath);
+    tinyobj::bounds_t parsedBounds;
+    if (!tinyobj::LoadObj(shapes, materials, err, source.data(), source.size(),
+                          materialReader, true, 0, &parsedBounds)) {
+        throw Exception("ObjLoader: error loading: " + file.string() + ": " +
+                        err);
+    }
+    if (!err.empty())
+        CI_LOG_W("ObjLoader: " << err);
+
+    AxisAlignedBox bounds(vec3(0.0f), vec3(0.0f));
+    if (parsedBounds.bmin[0] <= parsedBounds.bmax[0])
+        bounds = AxisAlignedBox(make_vec3(parsedBounds.bmin),
+                                make_vec3(parsedBounds.bmax));
+    mat4 transform;
+    if (bake)
+        normalizePositions(shapes, bounds);
+    else if (normalize)
+        transform = normalizingTransform(bounds);
+
+    // tinyobj starts a new shape at every usemtl statement. Consecutive
+    // shapes of the same name are merged back into one shape with one vertex
+    // buffer, drawn with a material per index range.
+    std::vector<MeshStreams> streams;
+    auto buffers = std::make_shared<ShapeBuffers>();
+    auto& vertices = buffers->vertices;
+    auto& indices = buffers->indices;
+    VertexCacheStats before, after;
+    size_t parsed = 0, welded = 0, lods = 0;
+    for (size_t begin = 0, end; begin < shapes.size(); begin = end) {
+        for (end = begin + 1; end < shapes.size(); end++)
+            if (shapes[end].name != shapes[begin].name)
+                break;
+        vertices.emplace_back();
+        indices.emplace_back();
+        streams.push_back(interleaveShape(&shapes[begin], end - begin,
+                                          vertices.back(), indices.back()));
+        auto& shape = streams.back();
+        if (options.weld) {
+            auto numVertices = shape.numVertices;
+            shape.numVertices =
+              weldVertices(vertices.back(), shape.stride, indices.back().data(),
+                           indices.back().size(), epsilon);
+            shape.vertices = vertices.back().data();
+            welded += numVertices - shape.numVertices;
+            parsed += numVertices;
+        }
+        tangentShape(shape, vertices.back());
+        if (options.optimize)
+            optimizeShape(shape, vertices.back(), indices.back(), before,
+                          after);
+        shape.parts.push_back({ 0, uint32_t(shape.ranges.size()),
+                                boundingSphere(shape), {} });
+        buffers->clusters.emplace_back();
+        if (options.clusters)
+            clusterShape(shape, buffers->clusters.back());
+        if (options.lods) {
+            buildLods(shape, indices.back());
+            lods += shape.parts.front().lods.size();
+        }
+    }
+    if (options.weld)
+        CI_LOG_I("ObjLoader: " << file.filename() << ": welded " << welded
+                               << " of " << parsed << " vertices");
+    if (options.optimize)
+        CI_LOG_I("ObjLoader: " << file.filename() << ": ACMR " << before.acmr()
+                               << " -> " << after.acmr() << ", ATVR "
+                               << before.atvr() << " -> " << after.atvr()
+                               << ", triangles " << before.triangles << " -> "
+                               << after.triangles);
+    if (options.lods)
+        CI_LOG_I("ObjLoader: " << file.filename() << ": " << lods
+                               << " levels of detail in " << streams.size()
+                               << " shapes");
+
+    // Shapes with the same attributes share vertex buffers.
+    auto numShapes = streams.size();
+    auto seams = poolShapes(streams, *buffers, options.weld);
+    CI_LOG_I("ObjLoader: " << file.filename() << ": " << numShapes
+                           << " shapes in " << streams.size()
+                           << " vertex buffers, welded " << seams
+                           << " shared vertices");
+
+    if (options.cache) {
+        std::vector<MeshCacheDependency> dependencies;
+        // Missing material files are recorded with hash 0, so that the
+        // cache is rebuilt once they appear.
+        for (const auto& mtl : materialReader.files) {
+            uint64_t hash = 0;
+            hashFile(mtl, hash);
+            dependencies.push_back({ mtl, hash });
+        }
+        if (writeMeshCache(cachePath, sourceHash, flags, bounds, dependencies,
+                           materials, streams)) {
+            // Continue from the mapping and let go of the buffers.
+            auto cache = std::make_shared<MeshCacheFile>();
+            if (cache->open(cachePath, sourceHash, flags))
+                return createModel(cache->materials(), cache->shapes(),
+                                   basePath, options, shader, cache,
+                                   transform);
+        } else {
+            CI_LOG_W("ObjLoader: cannot write cache: " << cachePath);
+        }
+    }
+
+    return createModel(materials, streams, basePath, options, shader, buffers,
+                       transform);
 }
 }
@@ -0,0 +1,167 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#include "RTR/RenderQueue.hpp"
+#include "RTR/Material.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+using namespace ci;
+
+namespace rtr {
+
+// The fields of a key, from the most significant bits down. Numbers that do
+// not fit share the largest one, which costs state changes but not
+// correctness.
+static const int passBits = 4;
+static const int programBits = 10;
+static const int materialBits = 14;
+static const int batchBits = 14;
+static const int depthBits = 22;
+
+static uint64_t
+field(uint32_t value, int bits)
+{
+    return std::min(value, (1u << bits) - 1u);
+}
+
+// The upper bits of a non-negative float keep its order.
+static uint64_t
+depthField(float depth)
+{
+    depth = std::max(depth, 0.0f);
+    uint32_t bits;
+    std::memcpy(&bits, &depth, sizeof(bits));
+    return bits >> (31 - depthBits);
+}
+
+void
+RenderQueue::reset()
+{
+    view = gl::getViewMatrix();
+    projection = gl::getProjectionMatrix();
+    height = float(gl::getViewport().second.y);
+
+    items.clear();
+    keys.clear();
+    matrices.clear();
+    passes.clear();
+    programs.clear();
+    materials.clear();
+    batches.clear();
+}
+
+uint32_t
+RenderQueue::addMatrix(const glm::mat4& model)
+{
+    matrices.push_back(model);
+    return uint32_t(matrices.size() - 1);
+}
+
+uint32_t
+RenderQueue::pass(const std::string& name)
+{
+    auto found = std::find(passes.begin(), passes.end(), name);
+    if (found != passes.end())
+        return uint32_t(found - passes.begin());
+    passes.push_back(name);
+    return uint32_t(passes.size() - 1);
+}
+
+uint32_t
+RenderQueue::number(std::unordered_map<const void*, uint32_t>& numbers,
+                    const void* object)
+{
+    return numbers.emplace(object, uint32_t(numbers.size())).first->second;
+}
+
+void
+RenderQueue::emit(uint32_t pass, Material* material, gl::Batch* batch,
+                  uint32_t matrix, float depth, GLint first, GLsizei count)
+{
+    auto key = field(pass, passBits);
+    key = key << programBits |
+          field(number(programs, batch->getGlslProg().get()), programBits);
+    key = key << materialBits |
+          field(number(materials, material), materialBits);
+    key = key << batchBits | field(number(batches, batch), batchBits);
+    key = key << depthBits | depthField(depth);
+
+    keys.push_back({ key, uint32_t(items.size()) });
+    items.push_back({ material, batch, matrix, first, count });
+}
+
+// Least significant digit first, eight bits at a time. Digits that are the
+// same in all keys are skipped, which are most of the upper ones.
+void
+RenderQueue::sort()
+{
+    const int digits = 8;
+    uint32_t counts[digits][256] = {};
+    for (const auto& entry : keys)
+        for (int d = 0; d < digits; d++)
+            counts[d][(entry.key >> (8 * d)) & 0xff]++;
+
+    scratch.resize(keys.size());
+    for (int d = 0; d < digits; d++) {
+        auto count = counts[d];
+        if (std::find(count, count + 256, uint32_t(keys.size())) !=
+            count + 256)
+            continue;
+
+        uint32_t offset = 0;
+        for (int b = 0; b < 256; b++) {
+            auto n = count[b];
+            count[b] = offset;
+            offset += n;
+        }
+        for (const auto& entry : keys)
+            scratch[count[(entry.key >> (8 * d)) & 0xff]++] = entry;
+        keys.swap(scratch);
+    }
+}
+
+void
+RenderQueue::submit()
+{
+    sort();
+
+    stats_ = RenderStats();
+    stats_.items = items.size();
+    gl::ScopedModelMatrix m;
+    Material* material = nullptr;
+    gl::Batch* batch = nullptr;
+    uint32_t matrix = uint32_t(-1);
+    // Keeps the vertex array of the batch bound, so that the batch does not
+    // bind and unbind it for each draw.
+    std::unique_ptr<gl::ScopedVao> vao;
+    for (const auto& entry : keys) {
+        const auto& item = items[entry.item];
+        if (item.material != material) {
+            material = item.material;
+            material->bind();
+            stats_.materialBinds++;
+        }
+        if (item.batch != batch) {
+            batch = item.batch;
+            vao.reset();
+            vao.reset(new gl::ScopedVao(batch->getVao()));
+            stats_.vaoBinds++;
+        }
+        if (item.matrix != matrix) {
+            matrix = item.matrix;
+            gl::setModelMatrix(matrices[matrix]);
+            stats_.matrices++;
+        }
+        batch->draw(item.first, item.count);
+    }
+    vao.reset();
+
+    items.clear();
+    keys.clear();
+    matrices.clear();
+}
+}
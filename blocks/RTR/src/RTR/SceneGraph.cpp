@@ -5,12 +5,164 @@
 #include "RTR/SceneGraph.hpp"
 #include "RTR/WatchThis.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <thread>
+
 using namespace ci;
 
 namespace rtr {
 
 const std::string Drawable::surfacePassName = "surface";
 
+static float lodErrorPixels_ = 1.0f;
+static float cullPixels_ = 1.0f;
+static bool clusterCulling = true;
+static bool frustumCulling = true;
+static bool renderQueue_ = true;
+
+// Bumped whenever the children of a node change, which makes every
+// TransformHierarchy rebuild.
+static uint64_t structureVersion = 1;
+// Bumped whenever the bounds of a shape, or the shapes or the transform of a
+// model change through their setters, which makes every TransformHierarchy
+// recompute the bounds of its models.
+static uint64_t boundsVersion = 1;
+// Bumped whenever the transform of a node changes. Nodes remember the value
+// of their last change.
+static uint64_t transformEpoch = 1;
+
+ViewFrustum::ViewFrustum(const glm::mat4& modelViewProjection)
+{
+    // The planes are the last row of the matrix plus or minus each of the
+    // others.
+    auto rows = glm::transpose(modelViewProjection);
+    for (int i = 0; i < 3; i++) {
+        planes[2 * i] = rows[3] + rows[i];
+        planes[2 * i + 1] = rows[3] - rows[i];
+    }
+    for (auto& plane : planes)
+        plane /= length(vec3(plane));
+}
+
+ViewFrustum::Containment
+ViewFrustum::test(const glm::vec3& min, const glm::vec3& max) const
+{
+    auto center = (min + max) / 2.0f;
+    auto extent = (max - min) / 2.0f;
+    auto result = Containment::INSIDE;
+    for (const auto& plane : planes) {
+        auto normal = vec3(plane);
+        auto distance = dot(normal, center) + plane.w;
+        auto radius = dot(abs(normal), extent);
+        if (distance < -radius)
+            return Containment::OUTSIDE;
+        if (distance < radius)
+            result = Containment::INTERSECTING;
+    }
+    return result;
+}
+
+bool
+ViewFrustum::intersects(const ci::Sphere& sphere) const
+{
+    for (const auto& plane : planes)
+        if (dot(vec3(plane), sphere.getCenter()) + plane.w <
+            -sphere.getRadius())
+            return false;
+    return true;
+}
+
+void
+enableFrustumCulling(bool enable)
+{
+    frustumCulling = enable;
+}
+
+bool
+frustumCullingEnabled()
+{
+    return frustumCulling;
+}
+
+void
+enableRenderQueue(bool enable)
+{
+    renderQueue_ = enable;
+}
+
+bool
+renderQueueEnabled()
+{
+    return renderQueue_;
+}
+
+void
+enableClusterCulling(bool enable)
+{
+    clusterCulling = enable;
+}
+
+bool
+clusterCullingEnabled()
+{
+    return clusterCulling;
+}
+
+void
+setLodErrorPixels(float pixels)
+{
+    lodErrorPixels_ = pixels;
+}
+
+float
+lodErrorPixels()
+{
+    return lodErrorPixels_;
+}
+
+void
+setCullPixels(float pixels)
+{
+    cullPixels_ = pixels;
+}
+
+float
+cullPixels()
+{
+    return cullPixels_;
+}
+
+// A sphere around the bounds of all builders, or none if any lacks bounds.
+static Sphere
+buildersBounds(const std::vector<MeshBuilderRef>& builders)
+{
+    Sphere bounds(vec3(0.0f), 0.0f);
+    for (size_t b = 0; b < builders.size(); b++) {
+        auto other = builders[b]->bounds();
+        if (other.getRadius() <= 0.0f)
+            return Sphere(vec3(0.0f), 0.0f);
+        if (b == 0) {
+            bounds = other;
+            continue;
+        }
+        auto d = distance(bounds.getCenter(), other.getCenter());
+        if (d + other.getRadius() <= bounds.getRadius())
+            continue;
+        if (d + bounds.getRadius() <= other.getRadius()) {
+            bounds = other;
+            continue;
+        }
+        auto radius = (d + bounds.getRadius() + other.getRadius()) / 2.0f;
+        auto center =
+          bounds.getCenter() + (other.getCenter() - bounds.getCenter()) *
+                                 ((radius - bounds.getRadius()) / d);
+        bounds = Sphere(center, radius);
+    }
+    return bounds;
+}
+
 /// Creates a new shape from some meshes with a common material that is
 /// rendered during the default 'surface' pass.
 Shape::Shape(const std::vector<ci::gl::VboMeshRef>& vboMeshes,
@@ -31,19 +183,41 @@ Shape::Shape(
   const std::vector<std::reference_wrapper<const ci::geom::Source>>& sources,
   const MaterialRef& material)
 {
-    // Use all available atttributes to build the mesh so that shaders can
-    // be replaced later without missing any of them. This uses more memory
-    // than necessary but is more flexible. And memory is cheap anyway.
-    geom::AttribSet allAttributes;
-    for (int i = 0; i != geom::Attrib::NUM_ATTRIBS; i++)
-        allAttributes.insert(geom::Attrib(i));
-
+    // Keep copies of the sources, the meshes are built for the program.
     for (const auto& source : sources)
-        vboMeshes.push_back(gl::VboMesh::create(source, allAttributes));
+        builders.push_back(MeshBuilder::create(source));
+    bounds_ = buildersBounds(builders);
 
     replaceMaterial(material);
 }
 
+/// Creates a new shape from a single mesh whose index ranges are drawn with
+/// different materials during the default 'surface' pass.
+Shape::Shape(const ci::gl::VboMeshRef& vboMesh,
+             const std::vector<MaterialRange>& ranges)
+  : vboMeshes({ vboMesh })
+{
+    setMaterialRanges(ranges);
+}
+
+/// Creates a new shape whose meshes are built with the attributes the
+/// material's program consumes.
+Shape::Shape(const std::vector<MeshBuilderRef>& builders,
+             const MaterialRef& material)
+  : builders(builders)
+  , bounds_(buildersBounds(builders))
+{
+    replaceMaterial(material);
+}
+
+Shape::Shape(const MeshBuilderRef& builder,
+             const std::vector<MaterialRange>& ranges)
+  : builders({ builder })
+  , bounds_(buildersBounds(builders))
+{
+    setMaterialRanges(ranges);
+}
+
 ShapeRef
 Shape::create(const std::vector<ci::gl::VboMeshRef>& vboMeshes,
               const MaterialRef& material)
@@ -59,6 +233,119 @@ Shape::create(
     return std::make_shared<Shape>(sources, material);
 }
 
+ShapeRef
+Shape::create(const ci::gl::VboMeshRef& vboMesh,
+              const std::vector<MaterialRange>& ranges)
+{
+    return std::make_shared<Shape>(vboMesh, ranges);
+}
+
+ShapeRef
+Shape::create(const std::vector<MeshBuilderRef>& builders,
+              const MaterialRef& material)
+{
+    return std::make_shared<Shape>(builders, material);
+}
+
+ShapeRef
+Shape::create(const MeshBuilderRef& builder,
+              const std::vector<MaterialRange>& ranges)
+{
+    return std::make_shared<Shape>(builder, ranges);
+}
+
+namespace {
+
+// Shapes that draw ranges of the same mesh with the same program share a
+// batch, and with it the vertex array, so drawing them in a row binds it only
+// once. The watcher may replace the mesh or program of a batch later, so
+// entries are checked on lookup.
+gl::BatchRef
+sharedBatch(const gl::VboMeshRef& mesh, const gl::GlslProgRef& program)
+{
+    using Key = std::pair<const gl::VboMesh*, const gl::GlslProg*>;
+    static std::map<Key, std::weak_ptr<gl::Batch>> batches;
+
+    auto& entry = batches[{ mesh.get(), program.get() }];
+    auto batch = entry.lock();
+    if (batch && batch->getVboMesh() == mesh &&
+        batch->getGlslProg() == program)
+        return batch;
+
+    batch = gl::Batch::create(mesh, program);
+    entry = batch;
+    for (auto other = batches.begin(); other != batches.end();) {
+        if (other->second.expired())
+            other = batches.erase(other);
+        else
+            ++other;
+    }
+    return batch;
+}
+
+// The view frustum and the eye in model space.
+class ClusterCuller
+{
+  public:
+    ClusterCuller(const mat4& modelView, const mat4& projection)
+      : frustum(projection * modelView)
+    {
+        eye = vec3(glm::inverse(modelView)[3]);
+        perspective = projection[3][3] != 1.0f;
+    }
+
+    bool visible(const TriangleCluster& cluster) const
+    {
+        if (!frustum.intersects(cluster.bounds))
+            return false;
+        // Every triangle faces away from the eye.
+        if (perspective) {
+            auto toCenter = cluster.bounds.getCenter() - eye;
+            if (dot(toCenter, cluster.coneAxis) >
+                cluster.coneCutoff * length(toCenter) +
+                  cluster.bounds.getRadius())
+                return false;
+        }
+        return true;
+    }
+
+  private:
+    ViewFrustum frustum;
+    vec3 eye;
+    bool perspective;
+};
+
+// Calls draw with the first index and the count of each run of the indices
+// without the clusters in them that the culler rejects.
+template <typename Draw>
+void
+drawIndices(const IndexRange& range,
+            const std::vector<TriangleCluster>& clusters,
+            const ClusterCuller* culler, Draw draw)
+{
+    auto end = range.first + range.count;
+    auto runFirst = range.first;
+    if (culler) {
+        auto cluster = std::lower_bound(
+          clusters.begin(), clusters.end(), range.first,
+          [](const TriangleCluster& cluster, uint32_t first) {
+              return cluster.indices.first < first;
+          });
+        for (; cluster != clusters.end() && cluster->indices.first < end;
+             ++cluster) {
+            if (culler->visible(*cluster))
+                continue;
+            if (cluster->indices.first > runFirst)
+                draw(GLint(runFirst),
+                     GLsizei(cluster->indices.first - runFirst));
+            runFirst = cluster->indices.first + cluster->indices.count;
+        }
+    }
+    if (end > runFirst)
+        draw(GLint(runFirst), GLsizei(end - runFirst));
+}
+}
+
 void
 Shape::draw()
 {
@@ -69,20 +356,212 @@ void
 Shape::draw(const std::string& pass)
 {
     const auto& namedPass = passes.find(pass);
-    if (namedPass != passes.end()) {
-        const auto& pass = namedPass->second;
-        pass.material->bind();
-        for (const auto& batch : pass.batches)
-            batch->draw();
+    if (namedPass == passes.end())
+        return;
+
+    Material* bound = nullptr;
+    draws(namedPass->second, gl::getModelView(), gl::getProjectionMatrix(),
+          float(gl::getViewport().second.y),
+          [&](Material* material, gl::Batch* batch, GLint first,
+              GLsizei count) {
+              if (material != bound) {
+                  material->bind();
+                  bound = material;
+              }
+              batch->draw(first, count);
+          });
+}
+
+void
+Shape::enqueue(RenderQueue& queue, const std::string& pass, uint32_t matrix)
+{
+    const auto& namedPass = passes.find(pass);
+    if (namedPass == passes.end())
+        return;
+
+    auto modelView = queue.viewMatrix() * queue.matrix(matrix);
+    auto passNumber = queue.pass(namedPass->first);
+    auto depth = -(modelView * vec4(bounds_.getCenter(), 1.0f)).z;
+    draws(namedPass->second, modelView, queue.projectionMatrix(),
+          queue.viewportHeight(),
+          [&](Material* material, gl::Batch* batch, GLint first,
+              GLsizei count) {
+              queue.emit(passNumber, material, batch, matrix, depth, first,
+                         count);
+          });
+}
+
+// Calls draw with the material, the batch and the index range of each draw
+// of the pass, after selecting the level of detail and culling the clusters
+// with the matrices. A count of -1 stands for all indices of the batch.
+template <typename Draw>
+void
+Shape::draws(Pass& pass, const mat4& modelView, const mat4& projection,
+             float viewportHeight, Draw draw)
+{
+    if (!selectLod(pass.lod, modelView, projection, viewportHeight))
+        return;
+    updateMeshes(pass);
+
+    // Only the full geometry is split into clusters.
+    std::unique_ptr<ClusterCuller> culler;
+    if (clusterCulling && pass.lod == 0 && !clusters.empty())
+        culler.reset(new ClusterCuller(modelView, projection));
+
+    if (pass.ranges.empty()) {
+        auto material = pass.material.get();
+        if (levels.empty() && !culler) {
+            for (const auto& batch : pass.batches)
+                draw(material, batch.get(), 0, -1);
+        } else {
+            // The meshes also hold the indices of the other levels.
+            IndexRange span = { 0, 0 };
+            if (!levels.empty()) {
+                const auto& ranges = levels[pass.lod].ranges;
+                span.first = ranges.front().first;
+                span.count =
+                  ranges.back().first + ranges.back().count - span.first;
+            } else {
+                span.count = uint32_t(
+                  pass.batches.front()->getVboMesh()->getNumIndices());
+            }
+            for (const auto& batch : pass.batches)
+                drawIndices(span, clusters, culler.get(),
+                            [&](GLint first, GLsizei count) {
+                                draw(material, batch.get(), first, count);
+                            });
+        }
+    } else {
+        for (size_t r = 0; r < pass.ranges.size(); r++) {
+            const auto& range = pass.ranges[r];
+            IndexRange indices = { uint32_t(range.first),
+                                   uint32_t(range.count) };
+            if (!levels.empty())
+                indices = levels[pass.lod].ranges[r];
+            drawIndices(indices, clusters, culler.get(),
+                        [&](GLint first, GLsizei count) {
+                            draw(range.material.get(), range.batch.get(),
+                                 first, count);
+                        });
+        }
     }
 }
 
+// Updates the level of detail to draw with the matrices, starting from the
+// level drawn last. Returns false if the shape is too small to be drawn.
+// Shapes without bounds always draw the first level.
+bool
+Shape::selectLod(size_t& lod, const mat4& modelView, const mat4& projection,
+                 float viewportHeight)
+{
+    auto last = lod;
+    lod = 0;
+    if (bounds_.getRadius() <= 0.0f)
+        return true;
+
+    // Pixels per model unit at the center of the bounds_. The scale is the
+    // largest of the model-view axes.
+    float scale = 0.0f;
+    for (int axis = 0; axis < 3; axis++)
+        scale = std::max(scale, length(vec3(modelView[axis])));
+    auto pixels = projection[1][1] * viewportHeight / 2.0f * scale;
+    if (projection[3][3] != 1.0f) {
+        // Perspective. Inside the bounds everything is close.
+        auto depth = -(modelView * vec4(bounds_.getCenter(), 1.0f)).z;
+        auto radius = bounds_.getRadius() * scale;
+        if (depth <= radius)
+            return true;
+        pixels /= depth;
+    }
+
+    if (2.0f * bounds_.getRadius() * pixels < cullPixels_)
+        return false;
+    if (levels.empty())
+        return true;
+
+    // Go finer beyond the threshold plus a quarter, coarser below the
+    // threshold minus a quarter.
+    const float hysteresis = 0.25f;
+    lod = std::min(last, levels.size() - 1);
+    auto errorPixels = [&](size_t level) {
+        return levels[level].error * pixels;
+    };
+    while (lod > 0 &&
+           errorPixels(lod) > lodErrorPixels_ * (1.0f + hysteresis))
+        lod--;
+    while (lod + 1 < levels.size() &&
+           errorPixels(lod + 1) < lodErrorPixels_ * (1.0f - hysteresis))
+        lod++;
+    return true;
+}
+
 void
 Shape::watchMe()
 {
     for (const auto& namedPass : passes) {
         watcher.watchForUpdates({ namedPass.second.material });
         watcher.watchForUpdates(namedPass.second.batches);
+        for (const auto& range : namedPass.second.ranges) {
+            watcher.watchForUpdates({ range.material });
+            watcher.watchForUpdates({ range.batch });
+        }
+    }
+}
+
+const std::vector<gl::VboMeshRef>&
+Shape::meshes(const gl::GlslProgRef& program)
+{
+    if (builders.empty())
+        return vboMeshes;
+
+    // Passes whose programs consume the same attributes share the meshes.
+    auto format = vertexFormat(program);
+    auto& built = formatMeshes[format];
+    if (built.empty()) {
+        for (const auto& builder : builders)
+            built.push_back(builder->build(format));
+    }
+    return built;
+}
+
+// The watcher replaces the programs of batches behind our back. Rebuild the
+// meshes of batches whose new program consumes other attributes.
+void
+Shape::updateMeshes(Pass& pass)
+{
+    if (builders.empty())
+        return;
+
+    bool changed = false;
+    for (size_t b = 0; b < pass.batches.size(); b++) {
+        auto& batch = pass.batches[b];
+        auto program = batch->getGlslProg();
+        if (program == pass.programs[b])
+            continue;
+        pass.programs[b] = program;
+        const auto& mesh = meshes(program)[pass.ranges.empty() ? b : 0];
+        if (mesh != batch->getVboMesh())
+            batch->replaceVboMesh(mesh);
+        changed = true;
+    }
+    if (changed)
+        pruneMeshes();
+}
+
+// Drops the meshes of formats no batch uses anymore.
+void
+Shape::pruneMeshes()
+{
+    std::set<gl::VboMeshRef> used;
+    for (const auto& namedPass : passes)
+        for (const auto& batch : namedPass.second.batches)
+            used.insert(batch->getVboMesh());
+
+    for (auto entry = formatMeshes.begin(); entry != formatMeshes.end();) {
+        if (used.count(entry->second.front()))
+            ++entry;
+        else
+            entry = formatMeshes.erase(entry);
     }
 }
 
@@ -92,10 +571,42 @@ Shape::setMaterialForPass(const std::string& passName,
 {
     Pass pass;
     pass.material = material;
-    for (const auto& mesh : vboMeshes)
-        pass.batches.push_back(gl::Batch::create(mesh, material->program()));
+    auto program = material->program();
+    for (const auto& mesh : meshes(program)) {
+        pass.batches.push_back(sharedBatch(mesh, program));
+        pass.programs.push_back(program);
+    }
 
     passes[passName] = pass;
+    pruneMeshes();
+    watchMe();
+}
+
+void
+Shape::setMaterialRanges(const std::vector<MaterialRange>& ranges)
+{
+    if (ranges.empty() || (vboMeshes.empty() && builders.empty()))
+        return;
+
+    Pass pass;
+    pass.material = ranges.front().material;
+    std::map<gl::GlslProgRef, gl::BatchRef> programBatches;
+    for (const auto& materialRange : ranges) {
+        auto program = materialRange.material->program();
+        auto& batch = programBatches[program];
+        if (!batch) {
+            batch = sharedBatch(meshes(program).front(), program);
+            pass.batches.push_back(batch);
+            pass.programs.push_back(program);
+        }
+        pass.ranges.push_back({ materialRange.material, batch,
+                                GLint(materialRange.first),
+                                GLsizei(materialRange.count) });
+    }
+
+    passes.clear();
+    passes[surfacePassName] = pass;
+    pruneMeshes();
     watchMe();
 }
 
@@ -124,12 +635,144 @@ Shape::replaceProgram(const ci::gl::GlslProgRef& program)
 {
     auto& pass = passes[surfacePassName];
     pass.material->replaceProgram(program);
-    for (auto batch : pass.batches) {
-        batch->replaceGlslProg(pass.material->program());
+    for (auto& range : pass.ranges)
+        range.material->replaceProgram(program);
+
+    // Other shapes may share the batches and keep their programs.
+    auto replaced = pass.material->program();
+    for (size_t b = 0; b < pass.batches.size(); b++) {
+        auto batch = sharedBatch(
+          meshes(replaced)[pass.ranges.empty() ? b : 0], replaced);
+        for (auto& range : pass.ranges)
+            if (range.batch == pass.batches[b])
+                range.batch = batch;
+        pass.batches[b] = batch;
+        pass.programs[b] = replaced;
     }
+    pruneMeshes();
     watchMe();
 }
 
+void
+Shape::setBounds(const ci::Sphere& bounds)
+{
+    bounds_ = bounds;
+    boundsVersion++;
+}
+
+void
+Shape::setLevelsOfDetail(const std::vector<LevelOfDetail>& levels)
+{
+    this->levels = levels;
+    for (auto& namedPass : passes)
+        namedPass.second.lod = 0;
+}
+
+void
+Shape::setClusters(const std::vector<TriangleCluster>& clusters)
+{
+    this->clusters = clusters;
+    std::sort(this->clusters.begin(), this->clusters.end(),
+              [](const TriangleCluster& a, const TriangleCluster& b) {
+                  return a.indices.first < b.indices.first;
+              });
+}
+
+void
+Shape::setTriangleBvh(const TriangleBvhRef& bvh)
+{
+    triangleBvh_ = bvh;
+    triangleBvhSource = nullptr;
+    triangleBvhFuture = std::shared_future<TriangleBvhRef>();
+    triangleBvhBuild.reset();
+}
+
+void
+Shape::setTriangleBvhSource(const std::function<TriangleBvhRef()>& source)
+{
+    triangleBvh_.reset();
+    triangleBvhSource = source;
+    triangleBvhFuture = std::shared_future<TriangleBvhRef>();
+    triangleBvhBuild.reset();
+}
+
+const TriangleBvhRef&
+Shape::triangleBvh()
+{
+    if (triangleBvhFuture.valid()) {
+        triangleBvh_ = triangleBvhFuture.get();
+        triangleBvhSource = nullptr;
+        triangleBvhFuture = std::shared_future<TriangleBvhRef>();
+        triangleBvhBuild.reset();
+    } else if (triangleBvhSource) {
+        triangleBvh_ = triangleBvhSource();
+        triangleBvhSource = nullptr;
+    }
+    return triangleBvh_;
+}
+
+// The hierarchies of a batch of shapes, built by a few threads that take the
+// next shape until none is left. The shapes share it, and the last one to
+// let go joins the threads.
+class TriangleBvhBuild
+{
+  public:
+    TriangleBvhBuild()
+      : next(0)
+      , cancel(false)
+    {
+    }
+
+    ~TriangleBvhBuild()
+    {
+        cancel = true;
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    void work()
+    {
+        for (size_t i = next++; i < sources.size() && !cancel; i = next++) {
+            try {
+                results[i].set_value(sources[i]());
+            } catch (...) {
+                results[i].set_exception(std::current_exception());
+            }
+            sources[i] = nullptr;
+        }
+    }
+
+    std::vector<std::function<TriangleBvhRef()>> sources;
+    std::vector<std::promise<TriangleBvhRef>> results;
+    std::atomic<size_t> next;
+    std::atomic<bool> cancel;
+    std::vector<std::thread> workers;
+};
+
+void
+buildTriangleBvhs(const std::vector<ShapeRef>& shapes)
+{
+    auto build = std::make_shared<TriangleBvhBuild>();
+    for (const auto& shape : shapes) {
+        if (!shape->triangleBvhSource || shape->triangleBvhFuture.valid())
+            continue;
+        build->sources.push_back(shape->triangleBvhSource);
+        build->results.push_back(std::promise<TriangleBvhRef>());
+        shape->triangleBvhFuture = build->results.back().get_future().share();
+        shape->triangleBvhBuild = build;
+    }
+    if (build->sources.empty())
+        return;
+
+    // Large hierarchies spread over threads of their own, so a few threads
+    // keep the cores busy while leaving one to the application.
+    auto cores = std::max(2u, std::thread::hardware_concurrency());
+    auto threads = std::min(size_t(cores - 1), build->sources.size());
+    auto work = build.get();
+    for (size_t t = 0; t < threads; t++)
+        build->workers.push_back(std::thread([work] { work->work(); }));
+}
+
 MaterialRef
 Shape::material()
 {
@@ -147,15 +790,30 @@ Shape::material(const std::string& pass)
     }
 }
 
-Model::Model(const std::vector<ShapeRef>& shapes)
+Model::Model(const std::vector<ShapeRef>& shapes, const glm::mat4& transform)
   : shapes(shapes)
+  , transform(transform)
 {
 }
 
 ModelRef
-Model::create(const std::vector<ShapeRef>& shapes)
+Model::create(const std::vector<ShapeRef>& shapes, const glm::mat4& transform)
 {
-    return std::make_shared<Model>(shapes);
+    return std::make_shared<Model>(shapes, transform);
+}
+
+void
+Model::setShapes(const std::vector<ShapeRef>& shapes)
+{
+    this->shapes = shapes;
+    boundsVersion++;
+}
+
+void
+Model::setTransform(const glm::mat4& transform)
+{
+    this->transform = transform;
+    boundsVersion++;
 }
 
 void
@@ -167,15 +825,263 @@ Model::draw()
 void
 Model::draw(const std::string& pass)
 {
+    gl::ScopedModelMatrix m;
+    gl::multModelMatrix(transform);
     for (const auto& shape : shapes)
         shape->draw(pass);
 }
 
+// The box around the transformed box. Empty boxes stay empty.
+static void
+transformBox(const mat4& transform, vec3& min, vec3& max)
+{
+    if (min.x > max.x)
+        return;
+    auto center = vec3(transform * vec4((min + max) / 2.0f, 1.0f));
+    auto extent = (max - min) / 2.0f;
+    vec3 radius;
+    for (int row = 0; row < 3; row++)
+        radius[row] = std::abs(transform[0][row]) * extent.x +
+                      std::abs(transform[1][row]) * extent.y +
+                      std::abs(transform[2][row]) * extent.z;
+    min = center - radius;
+    max = center + radius;
+}
+
+TransformHierarchy::TransformHierarchy(const Node* root)
+  : root(root)
+{
+}
+
+void
+TransformHierarchy::update()
+{
+    if (structure != structureVersion) {
+        build();
+        return;
+    }
+    if (modelBoundsVersion != boundsVersion)
+        updateModelBounds();
+    if (epoch == transformEpoch)
+        return;
+
+    // Parents come first, so they are up to date when their children are
+    // reached.
+    for (size_t i = 0; i < nodes.size(); i++) {
+        auto parent = parents[i];
+        bool changed = nodes[i]->changed > epoch;
+        if (changed)
+            locals[i] = nodes[i]->transform_;
+        dirty[i] = changed || (parent >= 0 && dirty[parent]);
+        if (dirty[i]) {
+            worlds[i] = parent >= 0 ? worlds[parent] * locals[i] : locals[i];
+            staleBounds[i] = 1;
+            boundsChanged = true;
+        }
+    }
+    epoch = transformEpoch;
+}
+
+void
+TransformHierarchy::build()
+{
+    nodes.clear();
+    parents.clear();
+    locals.clear();
+    worlds.clear();
+
+    // Depth-first with the children in order, as a recursive traversal
+    // would visit them.
+    std::vector<std::pair<const Node*, int32_t>> stack = { { root, -1 } };
+    while (!stack.empty()) {
+        auto node = stack.back().first;
+        auto parent = stack.back().second;
+        stack.pop_back();
+
+        auto instance = int32_t(nodes.size());
+        nodes.push_back(node);
+        parents.push_back(parent);
+        locals.push_back(node->transform_);
+        worlds.push_back(parent >= 0 ? worlds[parent] * node->transform_
+                                     : node->transform_);
+        for (auto child = node->children_.rbegin();
+             child != node->children_.rend(); ++child)
+            if (*child)
+                stack.push_back({ child->get(), instance });
+    }
+    dirty.assign(nodes.size(), 0);
+
+    extents.assign(nodes.size(), 1);
+    for (size_t i = nodes.size(); i-- > 1;)
+        extents[parents[i]] += extents[i];
+
+    worldModelMin.resize(nodes.size());
+    worldModelMax.resize(nodes.size());
+    boundsMin.resize(nodes.size());
+    boundsMax.resize(nodes.size());
+    updateModelBounds();
+
+    // Count the instances of each node, give each node a block and fill the
+    // blocks in instance order.
+    index.clear();
+    for (auto node : nodes)
+        index[node].second++;
+    uint32_t first = 0;
+    for (auto& entry : index) {
+        entry.second.first = first;
+        first += entry.second.second;
+        entry.second.second = 0;
+    }
+    nodeInstances.resize(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        auto& entry = index[nodes[i]];
+        nodeInstances[entry.first + entry.second++] = uint32_t(i);
+    }
+
+    structure = structureVersion;
+    epoch = transformEpoch;
+}
+
+// The bounds of the models in node space. Marks the bounds of all instances
+// as stale.
+void
+TransformHierarchy::updateModelBounds()
+{
+    const vec3 empty(FLT_MAX);
+    modelMin.assign(nodes.size(), empty);
+    modelMax.assign(nodes.size(), -empty);
+    unbounded.assign(nodes.size(), 0);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        for (const auto& model : nodes[i]->models_) {
+            for (const auto& shape : model->shapes) {
+                const auto& sphere = shape->bounds();
+                if (sphere.getRadius() <= 0.0f) {
+                    unbounded[i] |= MODELS_UNBOUNDED;
+                    continue;
+                }
+                auto min = sphere.getCenter() - vec3(sphere.getRadius());
+                auto max = sphere.getCenter() + vec3(sphere.getRadius());
+                transformBox(model->transform, min, max);
+                modelMin[i] = glm::min(modelMin[i], min);
+                modelMax[i] = glm::max(modelMax[i], max);
+            }
+        }
+    }
+    staleBounds.assign(nodes.size(), 1);
+    boundsChanged = true;
+    modelBoundsVersion = boundsVersion;
+}
+
+void
+TransformHierarchy::updateBounds()
+{
+    if (!boundsChanged)
+        return;
+
+    // Children come after their parents, so going backwards they are up to
+    // date when their parent is reached.
+    for (size_t i = nodes.size(); i-- > 0;) {
+        if (!staleBounds[i])
+            continue;
+        worldModelMin[i] = modelMin[i];
+        worldModelMax[i] = modelMax[i];
+        transformBox(worlds[i], worldModelMin[i], worldModelMax[i]);
+        boundsMin[i] = worldModelMin[i];
+        boundsMax[i] = worldModelMax[i];
+        unbounded[i] &= MODELS_UNBOUNDED;
+        if (unbounded[i])
+            unbounded[i] |= UNBOUNDED;
+        for (auto child = i + 1; child < i + extents[i];
+             child += extents[child]) {
+            boundsMin[i] = glm::min(boundsMin[i], boundsMin[child]);
+            boundsMax[i] = glm::max(boundsMax[i], boundsMax[child]);
+            unbounded[i] |= unbounded[child] & UNBOUNDED;
+        }
+        if (parents[i] >= 0)
+            staleBounds[parents[i]] = 1;
+        staleBounds[i] = 0;
+    }
+    boundsChanged = false;
+}
+
+ViewFrustum::Containment
+TransformHierarchy::test(size_t instance, const ViewFrustum& frustum) const
+{
+    if (unbounded[instance] & UNBOUNDED)
+        return ViewFrustum::Containment::INTERSECTING;
+    if (boundsMin[instance].x > boundsMax[instance].x)
+        return ViewFrustum::Containment::OUTSIDE;
+    return frustum.test(boundsMin[instance], boundsMax[instance]);
+}
+
+bool
+TransformHierarchy::modelsVisible(size_t instance,
+                                  const ViewFrustum& frustum) const
+{
+    if (unbounded[instance] & MODELS_UNBOUNDED)
+        return true;
+    return worldModelMin[instance].x <= worldModelMax[instance].x &&
+           frustum.test(worldModelMin[instance], worldModelMax[instance]) !=
+             ViewFrustum::Containment::OUTSIDE;
+}
+
+// Whether the ray enters the box in front of its origin and before
+// maxDistance, with the slab test (Kay and Kajiya).
+static bool
+rayHitsBox(const Ray& ray, const vec3& min, const vec3& max,
+           float maxDistance)
+{
+    if (min.x > max.x)
+        return false;
+    float lower = 0.0f;
+    float upper = maxDistance;
+    for (int axis = 0; axis < 3; axis++) {
+        auto inverse = 1.0f / ray.getDirection()[axis];
+        auto t0 = (min[axis] - ray.getOrigin()[axis]) * inverse;
+        auto t1 = (max[axis] - ray.getOrigin()[axis]) * inverse;
+        if (t0 > t1)
+            std::swap(t0, t1);
+        lower = std::max(lower, t0);
+        upper = std::min(upper, t1);
+    }
+    return lower <= upper;
+}
+
+bool
+TransformHierarchy::intersects(size_t instance, const Ray& ray,
+                               float maxDistance) const
+{
+    if (unbounded[instance] & UNBOUNDED)
+        return true;
+    return rayHitsBox(ray, boundsMin[instance], boundsMax[instance],
+                      maxDistance);
+}
+
+bool
+TransformHierarchy::modelsIntersect(size_t instance, const Ray& ray,
+                                    float maxDistance) const
+{
+    if (unbounded[instance] & MODELS_UNBOUNDED)
+        return true;
+    return rayHitsBox(ray, worldModelMin[instance], worldModelMax[instance],
+                      maxDistance);
+}
+
+TransformHierarchy::Instances
+TransformHierarchy::instances(const Node* node) const
+{
+    auto entry = index.find(node);
+    if (entry == index.end())
+        return Instances(nullptr, nullptr);
+    auto first = nodeInstances.data() + entry->second.first;
+    return Instances(first, first + entry->second.second);
+}
+
 Node::Node(const std::vector<ModelRef>& models, const glm::mat4& transform,
            const std::vector<NodeRef> children)
-  : models(models)
-  , transform(transform)
-  , children(children)
+  : models_(models)
+  , transform_(transform)
+  , children_(children)
 {
 }
 
@@ -195,34 +1101,184 @@ Node::draw()
 void
 Node::draw(const std::string& pass)
 {
+    draw(pass, ViewFrustum(gl::getModelViewProjection()));
+}
+
+// Calls visitInstance with each instance whose models are not culled.
+template <typename Visit>
+void
+Node::visit(const ViewFrustum& frustum, Visit visitInstance)
+{
+    transforms();
+    bool cull = frustumCulling;
+    if (cull)
+        hierarchy->updateBounds();
+
+    stats = CullStats();
+    stats.instances = hierarchy->size();
+    // Instances before this one lie in a subtree that is inside as a whole.
+    size_t inside = 0;
+    for (size_t i = 0; i < hierarchy->size(); i++) {
+        auto extent = hierarchy->extent(i);
+        if (cull && i >= inside) {
+            stats.tested++;
+            auto containment = hierarchy->test(i, frustum);
+            if (containment == ViewFrustum::Containment::OUTSIDE) {
+                stats.culled += extent;
+                i += extent - 1;
+                continue;
+            }
+            if (containment == ViewFrustum::Containment::INSIDE)
+                inside = i + extent;
+        }
+
+        if (hierarchy->node(i)->models_.empty())
+            continue;
+        // Without children the models have the bounds just tested.
+        if (cull && i >= inside && extent > 1) {
+            stats.tested++;
+            if (!hierarchy->modelsVisible(i, frustum)) {
+                stats.culled++;
+                continue;
+            }
+        }
+        visitInstance(i);
+        stats.drawn++;
+    }
+}
+
+void
+Node::draw(const std::string& pass, const ViewFrustum& frustum)
+{
+    if (renderQueue_) {
+        queue.reset();
+        enqueue(queue, pass, frustum);
+        queue.submit();
+        return;
+    }
+
     gl::ScopedModelMatrix m;
-    gl::multModelMatrix(transform);
-    for (auto& model : models)
-        model->draw(pass);
-    for (auto& child : children)
-        child->draw(pass);
+    auto parent = gl::getModelMatrix();
+    visit(frustum, [&](size_t i) {
+        gl::setModelMatrix(parent * hierarchy->world(i));
+        for (const auto& model : hierarchy->node(i)->models_)
+            model->draw(pass);
+    });
 }
 
-std::vector<Transformed>
-_find(const NodeRef& tree, const NodeRef& node, glm::mat4 worldTransform)
+void
+Node::enqueue(RenderQueue& queue, const std::string& pass,
+              const ViewFrustum& frustum)
 {
-    worldTransform *= tree->transform;
-    if (tree == node) {
-        return { { worldTransform, tree } };
-    } else {
-        std::vector<Transformed> foundHere;
-        for (const auto& child : tree->children) {
-            auto foundChild = _find(child, node, worldTransform);
-            foundHere.insert(foundHere.end(), foundChild.begin(),
-                             foundChild.end());
+    auto parent = gl::getModelMatrix();
+    visit(frustum, [&](size_t i) {
+        auto world = parent * hierarchy->world(i);
+        for (const auto& model : hierarchy->node(i)->models_) {
+            auto matrix = queue.addMatrix(world * model->transform);
+            for (const auto& shape : model->shapes)
+                shape->enqueue(queue, pass, matrix);
+        }
+    });
+}
+
+bool
+Node::pick(const Ray& ray, PickResult& result)
+{
+    transforms();
+    hierarchy->updateBounds();
+
+    const Node* picked = nullptr;
+    float closest = FLT_MAX;
+    for (size_t i = 0; i < hierarchy->size(); i++) {
+        if (!hierarchy->intersects(i, ray, closest)) {
+            i += hierarchy->extent(i) - 1;
+            continue;
+        }
+        const auto& models = hierarchy->node(i)->models_;
+        if (models.empty() || !hierarchy->modelsIntersect(i, ray, closest))
+            continue;
+        for (const auto& model : models) {
+            // Affine maps keep distances along the ray in units of its
+            // direction, so the direction is not normalized.
+            auto toModel = glm::inverse(hierarchy->world(i) * model->transform);
+            Ray local(vec3(toModel * vec4(ray.getOrigin(), 1.0f)),
+                      vec3(toModel * vec4(ray.getDirection(), 0.0f)));
+            for (const auto& shape : model->shapes) {
+                const auto& bvh = shape->triangleBvh();
+                TriangleBvh::Hit hit;
+                if (!bvh || !bvh->intersect(local, closest, hit))
+                    continue;
+                closest = hit.distance;
+                picked = hierarchy->node(i);
+                result.instance = i;
+                result.model = model;
+                result.shape = shape;
+                result.triangle = hit.triangle;
+                result.barycentrics = hit.barycentrics;
+            }
         }
-        return foundHere;
     }
+    if (!picked)
+        return false;
+
+    result.node = std::const_pointer_cast<Node>(picked->shared_from_this());
+    result.distance = closest;
+    result.position = ray.getOrigin() + closest * ray.getDirection();
+    return true;
+}
+
+void
+Node::setTransform(const glm::mat4& transform)
+{
+    transform_ = transform;
+    changed = ++transformEpoch;
+}
+
+void
+Node::setModels(const std::vector<ModelRef>& models)
+{
+    models_ = models;
+    structureVersion++;
+}
+
+void
+Node::setChildren(const std::vector<NodeRef>& children)
+{
+    children_ = children;
+    structureVersion++;
+}
+
+void
+Node::addChild(const NodeRef& child)
+{
+    children_.push_back(child);
+    structureVersion++;
+}
+
+void
+Node::removeChild(const NodeRef& child)
+{
+    children_.erase(std::remove(children_.begin(), children_.end(), child),
+                    children_.end());
+    structureVersion++;
+}
+
+const TransformHierarchy&
+Node::transforms()
+{
+    if (!hierarchy)
+        hierarchy.reset(new TransformHierarchy(this));
+    hierarchy->update();
+    return *hierarchy;
 }
 
 std::vector<Transformed>
 Node::find(const NodeRef& node)
 {
-    return _find(shared_from_this(), node, glm::mat4());
+    const auto& flat = transforms();
+    std::vector<Transformed> found;
+    for (auto instance : flat.instances(node.get()))
+        found.push_back({ flat.world(instance), node });
+    return found;
 }
 }
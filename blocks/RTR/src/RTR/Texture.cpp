@@ -0,0 +1,463 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#include "RTR/Texture.hpp"
+#include "RTR/MeshCache.hpp"
+#include "cinder/ImageIo.h"
+#include "cinder/Log.h"
+
+#include <chrono>
+#include <cstring>
+
+using namespace ci;
+using namespace std;
+
+namespace rtr {
+
+TextureLoader textureLoader;
+TextureCache textureCache;
+
+// Shown in place of textures that are not resident yet.
+static gl::TextureBaseRef placeholder;
+
+void
+shutdownTextures()
+{
+    textureLoader.shutdown();
+    textureCache.release();
+    placeholder.reset();
+}
+
+// Bytes copied into the pixel buffer per step. Small enough to keep a single
+// step well below the frame budget.
+static const size_t uploadStepBytes = 1 << 20;
+
+TextureRef
+Texture::create(const gl::TextureBaseRef& texture)
+{
+    auto result = std::make_shared<Texture>();
+    result->texture_ = texture;
+    // Assume 4 bytes per texel, which is what gl::Texture2d picks by default.
+    auto texture2d = std::dynamic_pointer_cast<gl::Texture2d>(texture);
+    if (texture2d)
+        result->bytes_ =
+          size_t(texture2d->getWidth()) * texture2d->getHeight() * 4;
+    return result;
+}
+
+const gl::TextureBaseRef&
+Texture::get() const
+{
+    if (texture_)
+        return texture_;
+    if (!placeholder) {
+        const uint8_t white[4] = { 255, 255, 255, 255 };
+        placeholder = gl::Texture2d::create(white, GL_RGBA, 1, 1);
+    }
+    return placeholder;
+}
+
+TextureLoader::TextureLoader()
+  : stop(false)
+  , pending_(0)
+{
+    upload.level = 0;
+    upload.row = 0;
+}
+
+TextureLoader::~TextureLoader()
+{
+    shutdown();
+}
+
+void
+TextureLoader::shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    queued.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+    workers.clear();
+
+    jobs.clear();
+    decoded.clear();
+    upload = Upload();
+    upload.level = 0;
+    upload.row = 0;
+    pending_ = 0;
+    stop = false;
+}
+
+TextureRef
+TextureLoader::load(const fs::path& file, bool compress,
+                    const fs::path& cacheDirectory)
+{
+    auto texture = std::make_shared<Texture>();
+    texture->file_ = file;
+    texture->compressed_ = compress;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Start the pool on first use, not during static initialization.
+        if (workers.empty()) {
+            auto threads =
+              std::max(1u, std::min(4u, thread::hardware_concurrency()));
+            for (unsigned int i = 0; i < threads; i++)
+                workers.push_back(thread(&TextureLoader::decode, this));
+        }
+        Job job;
+        job.texture = texture;
+        job.file = file;
+        job.compress = compress;
+        job.cacheDirectory = cacheDirectory;
+        jobs.push_back(job);
+        pending_++;
+    }
+    queued.notify_one();
+    return texture;
+}
+
+void
+TextureLoader::decode()
+{
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queued.wait(lock, [this] { return stop || !jobs.empty(); });
+            if (stop)
+                return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        // Nobody is waiting for textures that were dropped while queued.
+        if (!job.texture.expired()) {
+            try {
+                // Uncompressed images are always decoded to RGBA so that
+                // rows stay 4 byte aligned.
+                if (!hashFile(job.file, job.hash))
+                    job.error = "cannot read the file";
+                else if (job.compress)
+                    loadCompressedTexture(job.file, job.hash,
+                                          job.cacheDirectory, job.compressed);
+                else
+                    job.image = Surface8u(loadImage(job.file),
+                                          SurfaceConstraintsDefault(), true);
+            } catch (std::exception& e) {
+                job.error = e.what();
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        decoded.push_back(std::move(job));
+    }
+}
+
+void
+TextureLoader::update(double budget)
+{
+    auto start = chrono::steady_clock::now();
+    lastUpdate = start;
+    auto elapsed = [&] {
+        return chrono::duration<double>(chrono::steady_clock::now() - start)
+          .count();
+    };
+
+    auto before = pending_.load();
+    do {
+        if (!upload.texture && !beginUpload())
+            break;
+        continueUpload();
+    } while (elapsed() < budget);
+
+    // Newly resident textures may push the cache over its budget.
+    if (pending_ < before)
+        textureCache.trim();
+}
+
+void
+TextureLoader::poll()
+{
+    // Materials bind many times per frame, but the budget is per frame.
+    const chrono::milliseconds frame(10);
+    if (pending_ > 0 && chrono::steady_clock::now() - lastUpdate >= frame)
+        update();
+}
+
+void
+TextureLoader::finish()
+{
+    while (pending_ > 0) {
+        update(1.0);
+        if (pending_ > 0)
+            this_thread::yield();
+    }
+}
+
+bool
+TextureLoader::beginUpload()
+{
+    for (;;) {
+        Job job;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (decoded.empty())
+                return false;
+            job = std::move(decoded.front());
+            decoded.pop_front();
+        }
+
+        auto texture = job.texture.lock();
+        if (!texture) {
+            pending_--;
+            continue;
+        }
+        if (!job.error.empty()) {
+            CI_LOG_W("TextureLoader: cannot load: " << job.file << ": "
+                                                    << job.error);
+            pending_--;
+            continue;
+        }
+
+        // Share the GPU texture of a file with the same content. Uploads run
+        // one after another, so a duplicate finds its original resident.
+        texture->hash_ = job.hash;
+        auto same = textureCache.find(job.hash, job.compress);
+        if (same) {
+            texture->texture_ = same->texture_;
+            texture->source_ = same;
+            pending_--;
+            continue;
+        }
+
+        upload.texture = texture;
+        upload.image = job.image;
+        upload.compressed = job.compressed;
+        upload.level = 0;
+        upload.row = 0;
+
+        const auto& levels = upload.compressed.levels();
+        if (levels.empty()) {
+            auto width = job.image.getWidth();
+            auto height = job.image.getHeight();
+            upload.pbo = gl::Pbo::create(GL_PIXEL_UNPACK_BUFFER,
+                                         size_t(width) * height * 4, nullptr,
+                                         GL_STREAM_DRAW);
+            upload.target = gl::Texture2d::create(
+              width, height, gl::Texture2d::Format().internalFormat(GL_RGBA8));
+        } else {
+            auto format = upload.compressed.glInternalFormat();
+            upload.pbo = gl::Pbo::create(GL_PIXEL_UNPACK_BUFFER,
+                                         upload.compressed.size(), nullptr,
+                                         GL_STREAM_DRAW);
+            upload.target = gl::Texture2d::create(
+              upload.compressed.width(), upload.compressed.height(),
+              gl::Texture2d::Format().internalFormat(format).minFilter(
+                GL_LINEAR_MIPMAP_LINEAR));
+
+            // Allocate the whole chain, the slices are filled in later.
+            gl::ScopedTextureBind scopedTexture(upload.target);
+            for (size_t l = 0; l < levels.size(); l++)
+                glCompressedTexImage2D(GL_TEXTURE_2D, GLint(l), format,
+                                       levels[l].width, levels[l].height, 0,
+                                       GLsizei(levels[l].size), nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL,
+                            GLint(levels.size() - 1));
+        }
+        return true;
+    }
+}
+
+void
+TextureLoader::continueUpload()
+{
+    // Rows of texels, or rows of 4x4 blocks for compressed textures. Rows go
+    // bottom up like gl::Texture2d's default, which is what OBJ texture
+    // coordinates expect; compressed images are stored that way already.
+    const auto& levels = upload.compressed.levels();
+    bool compressed = !levels.empty();
+    int32_t width, height, numRows;
+    size_t rowBytes, base;
+    if (compressed) {
+        const auto& level = levels[upload.level];
+        width = level.width;
+        height = level.height;
+        numRows = (height + 3) / 4;
+        rowBytes = size_t((width + 3) / 4) *
+                   CompressedImage::blockBytes(upload.compressed.format());
+        base = level.offset;
+    } else {
+        width = upload.image.getWidth();
+        height = upload.image.getHeight();
+        numRows = height;
+        rowBytes = size_t(width) * 4;
+        base = 0;
+    }
+    int32_t rows = int32_t(std::max<size_t>(1, uploadStepBytes / rowBytes));
+    rows = std::min(rows, numRows - upload.row);
+
+    size_t offset = base + upload.row * rowBytes;
+    size_t size = rows * rowBytes;
+    auto pixels = static_cast<uint8_t*>(upload.pbo->mapBufferRange(
+      offset, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT));
+    if (pixels) {
+        if (compressed) {
+            memcpy(pixels, levels[upload.level].data + upload.row * rowBytes,
+                   size);
+        } else {
+            for (int32_t r = 0; r < rows; r++) {
+                auto source = upload.image.getData() +
+                              size_t(height - 1 - upload.row - r) *
+                                upload.image.getRowBytes();
+                memcpy(pixels + r * rowBytes, source, rowBytes);
+            }
+        }
+        upload.pbo->unmap();
+
+        gl::ScopedTextureBind scopedTexture(upload.target);
+        gl::ScopedBuffer scopedPbo(upload.pbo);
+        auto data = reinterpret_cast<const GLvoid*>(offset);
+        if (compressed) {
+            auto y = upload.row * 4;
+            glCompressedTexSubImage2D(
+              GL_TEXTURE_2D, GLint(upload.level), 0, y, width,
+              std::min(rows * 4, height - y),
+              upload.compressed.glInternalFormat(), GLsizei(size), data);
+        } else {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, upload.row, width, rows,
+                            GL_RGBA, GL_UNSIGNED_BYTE, data);
+        }
+    } else {
+        CI_LOG_W("TextureLoader: cannot map pixel buffer for: "
+                 << upload.texture->file());
+    }
+    upload.row += rows;
+
+    if (pixels && upload.row < numRows)
+        return;
+    if (pixels && compressed && upload.level + 1 < levels.size()) {
+        upload.level++;
+        upload.row = 0;
+        return;
+    }
+
+    if (pixels) {
+        upload.texture->texture_ = upload.target;
+        upload.texture->bytes_ =
+          compressed ? upload.compressed.size() : size_t(width) * height * 4;
+    }
+    upload = Upload();
+    upload.level = 0;
+    upload.row = 0;
+    pending_--;
+}
+
+TextureCache::TextureCache()
+  : budget_(size_t(512) << 20)
+  , clock(0)
+{
+}
+
+TextureRef
+TextureCache::get(const fs::path& file, bool compress,
+                  const fs::path& cacheDirectory)
+{
+    auto key = std::make_pair(file, compress);
+    auto known = entries.find(key);
+    if (known != entries.end()) {
+        known->second.lastUse = ++clock;
+        return known->second.texture;
+    }
+
+    // Files with the same content are found once they are loaded, see
+    // find().
+    Entry entry;
+    entry.texture = textureLoader.load(file, compress, cacheDirectory);
+    entry.lastUse = ++clock;
+    entries[key] = entry;
+
+    trim();
+    return entry.texture;
+}
+
+void
+TextureCache::setBudget(size_t bytes)
+{
+    budget_ = bytes;
+    trim();
+}
+
+size_t
+TextureCache::residentBytes() const
+{
+    size_t bytes = 0;
+    for (const auto& entry : entries)
+        bytes += entry.second.texture->residentBytes();
+    return bytes;
+}
+
+std::vector<TextureRef>
+TextureCache::textures() const
+{
+    std::vector<TextureRef> result;
+    for (const auto& entry : entries)
+        result.push_back(entry.second.texture);
+    return result;
+}
+
+void
+TextureCache::trim()
+{
+    auto bytes = residentBytes();
+    while (bytes > budget_) {
+        // Only the cache holds unused textures. Textures that are still
+        // loading take no memory yet, and evicting them would waste the load.
+        auto lru = entries.end();
+        for (auto entry = entries.begin(); entry != entries.end(); ++entry) {
+            if (entry->second.texture.use_count() == 1 &&
+                entry->second.texture->resident() &&
+                (lru == entries.end() ||
+                 entry->second.lastUse < lru->second.lastUse))
+                lru = entry;
+        }
+        if (lru == entries.end())
+            break;
+        bytes -= lru->second.texture->residentBytes();
+        entries.erase(lru);
+    }
+}
+
+void
+TextureCache::clear()
+{
+    for (auto entry = entries.begin(); entry != entries.end();) {
+        auto next = std::next(entry);
+        if (entry->second.texture.use_count() == 1)
+            entries.erase(entry);
+        entry = next;
+    }
+}
+
+void
+TextureCache::release()
+{
+    entries.clear();
+}
+
+TextureRef
+TextureCache::find(uint64_t hash, bool compressed) const
+{
+    for (const auto& entry : entries) {
+        const auto& texture = entry.second.texture;
+        if (texture->resident() && !texture->source_ &&
+            texture->hash_ == hash && texture->compressed_ == compressed)
+            return texture;
+    }
+    return nullptr;
+}
+}
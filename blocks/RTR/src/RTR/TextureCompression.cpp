@@ -0,0 +1,489 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#include "RTR/TextureCompression.hpp"
+#include "RTR/MeshCache.hpp"
+#include "cinder/ImageIo.h"
+#include "cinder/Log.h"
+#include "cinder/Surface.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstring>
+
+using namespace ci;
+using namespace std;
+
+namespace rtr {
+
+// From EXT_texture_compression_s3tc. Spelled out so that the encoder builds
+// without GL headers.
+static const unsigned int compressedRgbS3tcDxt1 = 0x83F0;
+static const unsigned int compressedRgbaS3tcDxt5 = 0x83F3;
+
+// File layout: header of 32 bytes (magic, version, format, source hash,
+// width, height), followed by all levels of the mip chain, largest first.
+// Bump the version whenever the encoder changes.
+static const char magic[8] = { 'R', 'T', 'R', 'T', 'E', 'X', 0, 0 };
+static const uint32_t version = 1;
+static const size_t headerSize = 32;
+
+CompressedImage::CompressedImage()
+  : format_(BlockFormat::BC1)
+{
+}
+
+size_t
+CompressedImage::size() const
+{
+    return levels_.empty() ? 0 : levels_.back().offset + levels_.back().size;
+}
+
+unsigned int
+CompressedImage::glInternalFormat() const
+{
+    return format_ == BlockFormat::BC1 ? compressedRgbS3tcDxt1
+                                       : compressedRgbaS3tcDxt5;
+}
+
+size_t
+CompressedImage::blockBytes(BlockFormat format)
+{
+    return format == BlockFormat::BC1 ? 8 : 16;
+}
+
+void
+CompressedImage::setLevels(BlockFormat format, int32_t width, int32_t height,
+                           const uint8_t* data)
+{
+    format_ = format;
+    levels_.clear();
+    size_t offset = 0;
+    for (;;) {
+        CompressedLevel level;
+        level.width = width;
+        level.height = height;
+        level.offset = offset;
+        level.size = size_t((width + 3) / 4) * ((height + 3) / 4) *
+                     blockBytes(format);
+        level.data = data ? data + offset : nullptr;
+        levels_.push_back(level);
+        offset += level.size;
+        if (width == 1 && height == 1)
+            break;
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+}
+
+namespace {
+
+// Halves the image with a box filter. Odd edges repeat the last texel.
+void
+downsample(const uint8_t* source, int32_t width, int32_t height,
+           uint8_t* target)
+{
+    int32_t targetWidth = std::max(1, width / 2);
+    int32_t targetHeight = std::max(1, height / 2);
+    for (int32_t y = 0; y < targetHeight; y++) {
+        auto y0 = std::min(2 * y, height - 1);
+        auto y1 = std::min(2 * y + 1, height - 1);
+        auto row0 = source + size_t(y0) * width * 4;
+        auto row1 = source + size_t(y1) * width * 4;
+        for (int32_t x = 0; x < targetWidth; x++) {
+            auto x0 = size_t(std::min(2 * x, width - 1)) * 4;
+            auto x1 = size_t(std::min(2 * x + 1, width - 1)) * 4;
+            for (int c = 0; c < 4; c++)
+                *target++ = uint8_t(
+                  (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] +
+                   2) /
+                  4);
+        }
+    }
+}
+
+uint16_t
+pack565(const float color[3])
+{
+    auto quantize = [](float value, int bits) {
+        int max = (1 << bits) - 1;
+        return std::min(max, std::max(0, int(value * max / 255.0f + 0.5f)));
+    };
+    return uint16_t((quantize(color[0], 5) << 11) |
+                    (quantize(color[1], 6) << 5) | quantize(color[2], 5));
+}
+
+void
+unpack565(uint16_t packed, int color[3])
+{
+    int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+    color[0] = (r << 3) | (r >> 2);
+    color[1] = (g << 2) | (g >> 4);
+    color[2] = (b << 3) | (b >> 2);
+}
+
+// Picks the nearest palette entry for every texel and returns the total
+// squared error.
+int
+colorIndices(const uint8_t texels[16][4], uint16_t c0, uint16_t c1,
+             uint32_t& indices)
+{
+    int palette[4][3];
+    unpack565(c0, palette[0]);
+    unpack565(c1, palette[1]);
+    for (int c = 0; c < 3; c++) {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+
+    int error = 0;
+    indices = 0;
+    for (int i = 0; i < 16; i++) {
+        int best = 0, bestDistance = INT_MAX;
+        for (int p = 0; p < 4; p++) {
+            int distance = 0;
+            for (int c = 0; c < 3; c++) {
+                int d = texels[i][c] - palette[p][c];
+                distance += d * d;
+            }
+            if (distance < bestDistance) {
+                best = p;
+                bestDistance = distance;
+            }
+        }
+        indices |= uint32_t(best) << (2 * i);
+        error += bestDistance;
+    }
+    return error;
+}
+
+// Orders the end points for the four color mode and encodes the block.
+int
+encodeColorEndpoints(const uint8_t texels[16][4], const float end0[3],
+                     const float end1[3], uint8_t* out)
+{
+    uint16_t c0 = pack565(end0);
+    uint16_t c1 = pack565(end1);
+    if (c0 < c1)
+        std::swap(c0, c1);
+
+    // Equal end points give a single color and all indices 0.
+    uint32_t indices;
+    int error = colorIndices(texels, c0, c1, indices);
+
+    out[0] = uint8_t(c0);
+    out[1] = uint8_t(c0 >> 8);
+    out[2] = uint8_t(c1);
+    out[3] = uint8_t(c1 >> 8);
+    for (int i = 0; i < 4; i++)
+        out[4 + i] = uint8_t(indices >> (8 * i));
+    return error;
+}
+
+// Fits the end points to the principal axis of the block colors, then
+// refines them once with a least squares fit to the chosen indices.
+void
+encodeColorBlock(const uint8_t texels[16][4], uint8_t* out)
+{
+    float mean[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; i++)
+        for (int c = 0; c < 3; c++)
+            mean[c] += texels[i][c] / 16.0f;
+
+    float covariance[6] = { 0, 0, 0, 0, 0, 0 };
+    for (int i = 0; i < 16; i++) {
+        float d[3] = { texels[i][0] - mean[0], texels[i][1] - mean[1],
+                       texels[i][2] - mean[2] };
+        covariance[0] += d[0] * d[0];
+        covariance[1] += d[0] * d[1];
+        covariance[2] += d[0] * d[2];
+        covariance[3] += d[1] * d[1];
+        covariance[4] += d[1] * d[2];
+        covariance[5] += d[2] * d[2];
+    }
+
+    float axis[3] = { 1, 1, 1 };
+    for (int iteration = 0; iteration < 8; iteration++) {
+        float next[3] = {
+            covariance[0] * axis[0] + covariance[1] * axis[1] +
+              covariance[2] * axis[2],
+            covariance[1] * axis[0] + covariance[3] * axis[1] +
+              covariance[4] * axis[2],
+            covariance[2] * axis[0] + covariance[4] * axis[1] +
+              covariance[5] * axis[2]
+        };
+        float length = std::max(std::abs(next[0]),
+                                std::max(std::abs(next[1]), std::abs(next[2])));
+        if (length == 0)
+            break;
+        for (int c = 0; c < 3; c++)
+            axis[c] = next[c] / length;
+    }
+
+    float minT = FLT_MAX, maxT = -FLT_MAX;
+    for (int i = 0; i < 16; i++) {
+        float t = 0;
+        for (int c = 0; c < 3; c++)
+            t += (texels[i][c] - mean[c]) * axis[c];
+        minT = std::min(minT, t);
+        maxT = std::max(maxT, t);
+    }
+    float axisLength2 =
+      axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+    if (axisLength2 > 0) {
+        minT /= axisLength2;
+        maxT /= axisLength2;
+    } else {
+        minT = maxT = 0;
+    }
+
+    float end0[3], end1[3];
+    for (int c = 0; c < 3; c++) {
+        end0[c] = mean[c] + axis[c] * maxT;
+        end1[c] = mean[c] + axis[c] * minT;
+    }
+    int error = encodeColorEndpoints(texels, end0, end1, out);
+    if (error == 0)
+        return;
+
+    // Least squares end points for the chosen indices.
+    uint16_t c0 = uint16_t(out[0] | (out[1] << 8));
+    uint16_t c1 = uint16_t(out[2] | (out[3] << 8));
+    if (c0 == c1)
+        return;
+    uint32_t indices = uint32_t(out[4]) | (uint32_t(out[5]) << 8) |
+                       (uint32_t(out[6]) << 16) | (uint32_t(out[7]) << 24);
+    static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+    float aa = 0, ab = 0, bb = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; i++) {
+        float a = weights[(indices >> (2 * i)) & 3], b = 1 - a;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int c = 0; c < 3; c++) {
+            ax[c] += a * texels[i][c];
+            bx[c] += b * texels[i][c];
+        }
+    }
+    float determinant = aa * bb - ab * ab;
+    if (std::abs(determinant) < 1e-6f)
+        return;
+    float refined0[3], refined1[3];
+    for (int c = 0; c < 3; c++) {
+        refined0[c] = (ax[c] * bb - bx[c] * ab) / determinant;
+        refined1[c] = (bx[c] * aa - ax[c] * ab) / determinant;
+    }
+    uint8_t refined[8];
+    if (encodeColorEndpoints(texels, refined0, refined1, refined) < error)
+        memcpy(out, refined, 8);
+}
+
+// Eight value mode: both end points are the extremes of the block.
+void
+encodeAlphaBlock(const uint8_t texels[16][4], uint8_t* out)
+{
+    int a0 = 0, a1 = 255;
+    for (int i = 0; i < 16; i++) {
+        a0 = std::max(a0, int(texels[i][3]));
+        a1 = std::min(a1, int(texels[i][3]));
+    }
+
+    int palette[8] = { a0, a1 };
+    for (int p = 1; p < 7; p++)
+        palette[p + 1] = ((7 - p) * a0 + p * a1) / 7;
+
+    uint64_t indices = 0;
+    if (a0 != a1) {
+        for (int i = 0; i < 16; i++) {
+            int best = 0, bestDistance = INT_MAX;
+            for (int p = 0; p < 8; p++) {
+                int distance = std::abs(texels[i][3] - palette[p]);
+                if (distance < bestDistance) {
+                    best = p;
+                    bestDistance = distance;
+                }
+            }
+            indices |= uint64_t(best) << (3 * i);
+        }
+    }
+
+    out[0] = uint8_t(a0);
+    out[1] = uint8_t(a1);
+    for (int i = 0; i < 6; i++)
+        out[2 + i] = uint8_t(indices >> (8 * i));
+}
+
+void
+compressLevel(const uint8_t* pixels, int32_t width, int32_t height,
+              BlockFormat format, uint8_t* out)
+{
+    for (int32_t by = 0; by < height; by += 4) {
+        for (int32_t bx = 0; bx < width; bx += 4) {
+            // Blocks on the right and top edges repeat the last texels.
+            uint8_t texels[16][4];
+            for (int y = 0; y < 4; y++) {
+                auto row = pixels +
+                           size_t(std::min(by + y, height - 1)) * width * 4;
+                for (int x = 0; x < 4; x++)
+                    memcpy(texels[4 * y + x],
+                           row + size_t(std::min(bx + x, width - 1)) * 4, 4);
+            }
+            if (format == BlockFormat::BC3) {
+                encodeAlphaBlock(texels, out);
+                out += 8;
+            }
+            encodeColorBlock(texels, out);
+            out += 8;
+        }
+    }
+}
+}
+
+void
+compressImage(const uint8_t* rgba, int32_t width, int32_t height,
+              ptrdiff_t rowStride, CompressedImage& result)
+{
+    // Level 0, packed tightly.
+    std::vector<uint8_t> pixels(size_t(width) * height * 4);
+    bool opaque = true;
+    for (int32_t y = 0; y < height; y++) {
+        auto row = rgba + y * rowStride;
+        memcpy(&pixels[size_t(y) * width * 4], row, size_t(width) * 4);
+        for (int32_t x = 0; x < width && opaque; x++)
+            opaque = row[4 * x + 3] == 255;
+    }
+
+    auto format = opaque ? BlockFormat::BC1 : BlockFormat::BC3;
+    result.setLevels(format, width, height, nullptr);
+    result.storage = std::make_shared<std::vector<uint8_t>>(result.size());
+    result.file.reset();
+    auto data = result.storage->data();
+    for (auto& level : result.levels_)
+        level.data = data + level.offset;
+
+    std::vector<uint8_t> next;
+    for (size_t l = 0; l < result.levels_.size(); l++) {
+        const auto& level = result.levels_[l];
+        compressLevel(pixels.data(), level.width, level.height, format,
+                      data + level.offset);
+        if (l + 1 < result.levels_.size()) {
+            next.resize(size_t(result.levels_[l + 1].width) *
+                        result.levels_[l + 1].height * 4);
+            downsample(pixels.data(), level.width, level.height, next.data());
+            pixels.swap(next);
+        }
+    }
+}
+
+bool
+writeCompressedTexture(const fs::path& file, uint64_t sourceHash,
+                       const CompressedImage& image)
+{
+    uint8_t header[headerSize] = {};
+    uint32_t format = uint32_t(image.format());
+    int32_t width = image.width(), height = image.height();
+    memcpy(header, magic, 8);
+    memcpy(header + 8, &version, 4);
+    memcpy(header + 12, &format, 4);
+    memcpy(header + 16, &sourceHash, 8);
+    memcpy(header + 24, &width, 4);
+    memcpy(header + 28, &height, 4);
+
+    auto write = [&](std::ostream& stream) {
+        stream.write(reinterpret_cast<const char*>(header), headerSize);
+        if (image.size())
+            stream.write(
+              reinterpret_cast<const char*>(image.levels()[0].data),
+              image.size());
+    };
+    return writeCacheFile(file, write);
+}
+
+bool
+readCompressedTexture(const fs::path& file, uint64_t sourceHash,
+                      CompressedImage& image)
+{
+    if (!fs::exists(file))
+        return false;
+    auto mapped = std::make_shared<MappedFile>();
+    if (!mapped->open(file) || mapped->size() < headerSize)
+        return false;
+
+    auto header = mapped->data();
+    uint32_t fileVersion, format;
+    uint64_t fileSourceHash;
+    int32_t width, height;
+    memcpy(&fileVersion, header + 8, 4);
+    memcpy(&format, header + 12, 4);
+    memcpy(&fileSourceHash, header + 16, 8);
+    memcpy(&width, header + 24, 4);
+    memcpy(&height, header + 28, 4);
+    if (memcmp(header, magic, 8) != 0 || fileVersion != version ||
+        fileSourceHash != sourceHash || width <= 0 || height <= 0 ||
+        (format != uint32_t(BlockFormat::BC1) &&
+         format != uint32_t(BlockFormat::BC3)))
+        return false;
+
+    CompressedImage result;
+    result.setLevels(BlockFormat(format), width, height,
+                     reinterpret_cast<const uint8_t*>(header + headerSize));
+    if (mapped->size() != headerSize + result.size())
+        return false;
+    result.file = mapped;
+    image = result;
+    return true;
+}
+
+fs::path
+compressedTexturePath(const fs::path& source, const fs::path& cacheDirectory)
+{
+    return cacheFilePath(source, ".rtrtex", cacheDirectory);
+}
+
+// Returns true if the cache is up to date afterwards.
+static bool
+loadOrCompress(const fs::path& source, uint64_t sourceHash,
+               const fs::path& cacheDirectory, CompressedImage& image)
+{
+    auto cachePath = compressedTexturePath(source, cacheDirectory);
+    if (readCompressedTexture(cachePath, sourceHash, image))
+        return true;
+
+    // Decode to RGBA and flip, so that the first row is the bottom row.
+    Surface8u surface(loadImage(source), SurfaceConstraintsDefault(), true);
+    compressImage(surface.getData() +
+                    size_t(surface.getHeight() - 1) * surface.getRowBytes(),
+                  surface.getWidth(), surface.getHeight(),
+                  -ptrdiff_t(surface.getRowBytes()), image);
+    return writeCompressedTexture(cachePath, sourceHash, image);
+}
+
+void
+loadCompressedTexture(const fs::path& source, uint64_t sourceHash,
+                      const fs::path& cacheDirectory, CompressedImage& image)
+{
+    if (!loadOrCompress(source, sourceHash, cacheDirectory, image))
+        CI_LOG_W("TextureCompression: cannot write cache for: " << source);
+}
+
+bool
+bakeTexture(const fs::path& source, const fs::path& cacheDirectory)
+{
+    try {
+        uint64_t sourceHash;
+        if (!hashFile(source, sourceHash)) {
+            CI_LOG_E("TextureCompression: cannot read: " << source);
+            return false;
+        }
+        CompressedImage image;
+        return loadOrCompress(source, sourceHash, cacheDirectory, image);
+    } catch (std::exception& e) {
+        CI_LOG_E("TextureCompression: cannot bake: " << source << ": "
+                                                     << e.what());
+        return false;
+    }
+}
+}
@@ -0,0 +1,379 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#include "RTR/TriangleBvh.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <thread>
+
+using namespace ci;
+using namespace std;
+
+namespace rtr {
+
+namespace {
+
+const int bins = 16;
+// Leaves never hold more triangles than this, even if the heuristic would
+// prefer it, which bounds the cost of the worst leaf.
+const uint32_t maxLeafTriangles = 8;
+// Subtrees with at least this many triangles are built on threads of their
+// own.
+const uint32_t parallelTriangles = 1 << 14;
+// Beyond this depth nodes are split at the median, so that no path is longer
+// than about this plus log2 of the triangles, which the traversal stack
+// holds.
+const int maxHeuristicDepth = 30;
+const int maxStackDepth = 64;
+
+struct Box
+{
+    vec3 min = vec3(FLT_MAX);
+    vec3 max = vec3(-FLT_MAX);
+
+    void include(const vec3& point)
+    {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void include(const Box& box)
+    {
+        min = glm::min(min, box.min);
+        max = glm::max(max, box.max);
+    }
+
+    float area() const
+    {
+        if (min.x > max.x)
+            return 0.0f;
+        auto size = max - min;
+        return size.x * size.y + size.y * size.z + size.z * size.x;
+    }
+};
+
+// Distance at which the ray enters the box, or FLT_MAX if it misses it
+// or enters it after maxDistance.
+inline float
+enterBox(const vec3& min, const vec3& max, const vec3& origin,
+         const vec3& inverseDirection, float maxDistance)
+{
+    auto t1 = (min - origin) * inverseDirection;
+    auto t2 = (max - origin) * inverseDirection;
+    auto lower = glm::min(t1, t2);
+    auto upper = glm::max(t1, t2);
+    auto enter = std::max(std::max(lower.x, lower.y), std::max(lower.z, 0.0f));
+    auto exit =
+      std::min(std::min(upper.x, upper.y), std::min(upper.z, maxDistance));
+    return enter <= exit ? enter : FLT_MAX;
+}
+}
+
+class BvhBuilder
+{
+  public:
+    BvhBuilder(const vector<Box>& boxes, const vector<vec3>& centroids,
+               vector<uint32_t>& order)
+      : boxes(boxes)
+      , centroids(centroids)
+      , order(order)
+    {
+    }
+
+    // Builds the subtree of triangles order[begin, end) at the depth into
+    // nodes[node], appending its descendants to nodes. The bounds of the
+    // triangles and of their centroids are given. Splits off threads for up
+    // to 2^spawnDepth subtrees.
+    void build(vector<TriangleBvh::Node>& nodes, uint32_t node, uint32_t begin,
+               uint32_t end, const Box& bounds, const Box& centroidBounds,
+               int depth, int spawnDepth)
+    {
+        nodes[node].min = bounds.min;
+        nodes[node].max = bounds.max;
+        nodes[node].first = begin;
+        nodes[node].count = end - begin;
+
+        auto count = end - begin;
+        if (count <= 2)
+            return;
+
+        // Bin the centroids along all axes in one pass and take the split
+        // with the lowest cost. Traversing a node costs about as much as
+        // testing a triangle.
+        auto extent = centroidBounds.max - centroidBounds.min;
+        vec3 scale;
+        for (int axis = 0; axis < 3; axis++)
+            scale[axis] = extent[axis] > 0.0f ? bins / extent[axis] : 0.0f;
+        Bin binned[3][bins];
+        if (depth < maxHeuristicDepth) {
+            for (auto i = begin; i < end; i++) {
+                auto t = order[i];
+                for (int axis = 0; axis < 3; axis++) {
+                    auto& bin = binned[axis][binOf(centroids[t][axis],
+                                                   centroidBounds.min[axis],
+                                                   scale[axis])];
+                    bin.bounds.include(boxes[t]);
+                    bin.centroids.include(centroids[t]);
+                    bin.count++;
+                }
+            }
+        }
+
+        float bestCost = FLT_MAX;
+        int bestAxis = -1, bestBin = 0;
+        for (int axis = 0; axis < 3 && depth < maxHeuristicDepth; axis++) {
+            if (scale[axis] == 0.0f)
+                continue;
+            const auto& axisBins = binned[axis];
+            // Areas and counts of everything right of each split.
+            float rightAreas[bins];
+            uint32_t rightCounts[bins];
+            Box right;
+            uint32_t rightCount = 0;
+            for (int b = bins - 1; b > 0; b--) {
+                right.include(axisBins[b].bounds);
+                rightCount += axisBins[b].count;
+                rightAreas[b] = right.area();
+                rightCounts[b] = rightCount;
+            }
+            Box left;
+            uint32_t leftCount = 0;
+            for (int b = 0; b < bins - 1; b++) {
+                left.include(axisBins[b].bounds);
+                leftCount += axisBins[b].count;
+                if (leftCount == 0 || rightCounts[b + 1] == 0)
+                    continue;
+                auto cost = left.area() * leftCount +
+                            rightAreas[b + 1] * rightCounts[b + 1];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+
+        uint32_t middle;
+        Box leftBounds, leftCentroids, rightBounds, rightCentroids;
+        if (bestAxis >= 0) {
+            auto area = bounds.area();
+            auto splitCost = 1.0f + (area > 0.0f ? bestCost / area : 0.0f);
+            if (count <= maxLeafTriangles && splitCost >= float(count))
+                return;
+            auto axis = bestAxis;
+            auto minimum = centroidBounds.min[axis];
+            middle = uint32_t(
+              std::partition(order.begin() + begin, order.begin() + end,
+                             [&](uint32_t t) {
+                                 return binOf(centroids[t][axis], minimum,
+                                              scale[axis]) <= bestBin;
+                             }) -
+              order.begin());
+            for (int b = 0; b < bins; b++) {
+                const auto& bin = binned[axis][b];
+                (b <= bestBin ? leftBounds : rightBounds).include(bin.bounds);
+                (b <= bestBin ? leftCentroids : rightCentroids)
+                  .include(bin.centroids);
+            }
+        } else {
+            // Too deep, or all centroids coincide. Split at the median along
+            // the longest axis.
+            if (count <= maxLeafTriangles)
+                return;
+            int axis = 0;
+            if (extent.y > extent[axis])
+                axis = 1;
+            if (extent.z > extent[axis])
+                axis = 2;
+            middle = begin + count / 2;
+            std::nth_element(order.begin() + begin, order.begin() + middle,
+                             order.begin() + end,
+                             [&](uint32_t a, uint32_t b) {
+                                 return centroids[a][axis] <
+                                        centroids[b][axis];
+                             });
+            for (auto i = begin; i < end; i++) {
+                auto t = order[i];
+                (i < middle ? leftBounds : rightBounds).include(boxes[t]);
+                (i < middle ? leftCentroids : rightCentroids)
+                  .include(centroids[t]);
+            }
+        }
+
+        auto children = uint32_t(nodes.size());
+        nodes.resize(nodes.size() + 2);
+        nodes[node].first = children;
+        nodes[node].count = 0;
+
+        if (spawnDepth > 0 && count >= parallelTriangles) {
+            // Build the right subtree into nodes of its own and splice them
+            // in afterwards.
+            vector<TriangleBvh::Node> right(1);
+            thread worker([&] {
+                build(right, 0, middle, end, rightBounds, rightCentroids,
+                      depth + 1, spawnDepth - 1);
+            });
+            build(nodes, children, begin, middle, leftBounds, leftCentroids,
+                  depth + 1, spawnDepth - 1);
+            worker.join();
+            splice(nodes, children + 1, right);
+        } else {
+            build(nodes, children, begin, middle, leftBounds, leftCentroids,
+                  depth + 1, spawnDepth);
+            build(nodes, children + 1, middle, end, rightBounds,
+                  rightCentroids, depth + 1, spawnDepth);
+        }
+    }
+
+  private:
+    struct Bin
+    {
+        Box bounds;
+        Box centroids;
+        uint32_t count = 0;
+    };
+
+    static int binOf(float centroid, float minimum, float scale)
+    {
+        return std::min(int((centroid - minimum) * scale), bins - 1);
+    }
+
+    // Puts the root of a subtree into nodes[slot] and appends the rest.
+    static void splice(vector<TriangleBvh::Node>& nodes, uint32_t slot,
+                       const vector<TriangleBvh::Node>& subtree)
+    {
+        auto offset = uint32_t(nodes.size()) - 1;
+        auto relocate = [&](TriangleBvh::Node node) {
+            if (node.count == 0)
+                node.first += offset;
+            return node;
+        };
+        nodes[slot] = relocate(subtree[0]);
+        for (size_t i = 1; i < subtree.size(); i++)
+            nodes.push_back(relocate(subtree[i]));
+    }
+
+    const vector<Box>& boxes;
+    const vector<vec3>& centroids;
+    vector<uint32_t>& order;
+};
+
+TriangleBvhRef
+TriangleBvh::create(const uint32_t* indices, size_t numIndices,
+                    const float* positions, size_t stride,
+                    uint32_t firstTriangle)
+{
+    auto bvh = std::make_shared<TriangleBvh>();
+    auto numTriangles = uint32_t(numIndices / 3);
+    if (numTriangles == 0)
+        return bvh;
+
+    auto position = [&](uint32_t index) {
+        auto p = positions + size_t(index) * stride;
+        return vec3(p[0], p[1], p[2]);
+    };
+    vector<Box> boxes(numTriangles);
+    vector<vec3> centroids(numTriangles);
+    vector<uint32_t> order(numTriangles);
+    Box bounds, centroidBounds;
+    for (uint32_t t = 0; t < numTriangles; t++) {
+        for (int k = 0; k < 3; k++)
+            boxes[t].include(position(indices[3 * t + k]));
+        centroids[t] = (boxes[t].min + boxes[t].max) / 2.0f;
+        order[t] = t;
+        bounds.include(boxes[t]);
+        centroidBounds.include(centroids[t]);
+    }
+
+    int spawnDepth = 0;
+    while ((1u << spawnDepth) < std::thread::hardware_concurrency())
+        spawnDepth++;
+    bvh->nodes.reserve(numTriangles);
+    bvh->nodes.resize(1);
+    BvhBuilder(boxes, centroids, order)
+      .build(bvh->nodes, 0, 0, numTriangles, bounds, centroidBounds, 0,
+             spawnDepth);
+
+    // Copy the triangles in the order the leaves reference them.
+    bvh->triangles.resize(numTriangles);
+    bvh->ids.resize(numTriangles);
+    for (uint32_t i = 0; i < numTriangles; i++) {
+        auto t = order[i];
+        auto v0 = position(indices[3 * t]);
+        bvh->triangles[i] = { v0, position(indices[3 * t + 1]) - v0,
+                              position(indices[3 * t + 2]) - v0 };
+        bvh->ids[i] = firstTriangle + t;
+    }
+    return bvh;
+}
+
+bool
+TriangleBvh::intersect(const ci::Ray& ray, float maxDistance, Hit& hit) const
+{
+    if (nodes.empty() || triangles.empty())
+        return false;
+
+    auto origin = ray.getOrigin();
+    auto direction = ray.getDirection();
+    auto inverseDirection = 1.0f / direction;
+    auto best = maxDistance;
+    bool found = false;
+
+    uint32_t stack[maxStackDepth];
+    int top = 0;
+    if (enterBox(nodes[0].min, nodes[0].max, origin, inverseDirection, best) !=
+        FLT_MAX)
+        stack[top++] = 0;
+    while (top > 0) {
+        const auto& node = nodes[stack[--top]];
+        if (node.count > 0) {
+            // Moeller and Trumbore.
+            for (auto i = node.first; i < node.first + node.count; i++) {
+                const auto& triangle = triangles[i];
+                auto p = cross(direction, triangle.e2);
+                auto determinant = dot(triangle.e1, p);
+                if (std::abs(determinant) < 1e-20f)
+                    continue;
+                auto inverse = 1.0f / determinant;
+                auto s = origin - triangle.v0;
+                auto u = dot(s, p) * inverse;
+                if (u < 0.0f || u > 1.0f)
+                    continue;
+                auto q = cross(s, triangle.e1);
+                auto v = dot(direction, q) * inverse;
+                if (v < 0.0f || u + v > 1.0f)
+                    continue;
+                auto t = dot(triangle.e2, q) * inverse;
+                if (t > 0.0f && t < best) {
+                    best = t;
+                    hit = { t, ids[i], vec2(u, v) };
+                    found = true;
+                }
+            }
+            continue;
+        }
+
+        // Visit the nearer child first, so that its hits cut off the other.
+        const auto& left = nodes[node.first];
+        const auto& right = nodes[node.first + 1];
+        auto enterLeft =
+          enterBox(left.min, left.max, origin, inverseDirection, best);
+        auto enterRight =
+          enterBox(right.min, right.max, origin, inverseDirection, best);
+        if (enterLeft <= enterRight) {
+            if (enterRight != FLT_MAX)
+                stack[top++] = node.first + 1;
+            if (enterLeft != FLT_MAX)
+                stack[top++] = node.first;
+        } else {
+            if (enterLeft != FLT_MAX)
+                stack[top++] = node.first;
+            stack[top++] = node.first + 1;
+        }
+    }
+    return found;
+}
+}
@@ -0,0 +1,457 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+
+#include "RTR/VertexFormat.hpp"
+#include "cinder/Log.h"
+#include "cinder/TriMesh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace ci;
+using namespace std;
+
+namespace rtr {
+
+const char* const vertexDecodeGlsl =
+  "float decodeHalf(int h) {\n"
+  "    float s = (h & 0x8000) != 0 ? -1.0 : 1.0;\n"
+  "    int e = (h >> 10) & 0x1f;\n"
+  "    float m = float(h & 0x3ff);\n"
+  "    if (e == 0)\n"
+  "        return s * m * exp2(-24.0);\n"
+  "    return s * (1.0 + m / 1024.0) * exp2(float(e - 15));\n"
+  "}\n"
+  "vec2 decodeHalf2(int p) {\n"
+  "    return vec2(decodeHalf(p), decodeHalf(p >> 16));\n"
+  "}\n"
+  "vec4 decodeHalf4(ivec2 p) {\n"
+  "    return vec4(decodeHalf2(p.x), decodeHalf2(p.y));\n"
+  "}\n"
+  "vec3 decodeOctahedral(int p) {\n"
+  "    vec2 e = max(vec2((p << 16) >> 16, p >> 16) / 32767.0, -1.0);\n"
+  "    vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));\n"
+  "    if (v.z < 0.0)\n"
+  "        v.xy = (1.0 - abs(v.yx)) *\n"
+  "               vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);\n"
+  "    return normalize(v);\n"
+  "}\n";
+
+static VertexLayout layout_ = VertexLayout::INTERLEAVED;
+
+void
+setVertexLayout(VertexLayout layout)
+{
+    layout_ = layout;
+}
+
+VertexLayout
+vertexLayout()
+{
+    return layout_;
+}
+
+VertexFormat
+vertexFormat(const gl::GlslProgRef& program)
+{
+    VertexFormat format;
+    for (const auto& attribute : program->getActiveAttributes()) {
+        auto attrib = attribute.getSemantic();
+        if (attrib >= geom::NUM_ATTRIBS)
+            continue;
+
+        bool direction = attrib == geom::NORMAL || attrib == geom::TANGENT ||
+                         attrib == geom::BITANGENT;
+        switch (attribute.getType()) {
+            case GL_INT:
+                format[attrib] =
+                  direction ? AttribEncoding::OCTAHEDRAL : AttribEncoding::HALF;
+                break;
+            case GL_INT_VEC2:
+                format[attrib] = AttribEncoding::HALF;
+                break;
+            case GL_INT_VEC3:
+            case GL_INT_VEC4:
+                CI_LOG_W("VertexFormat: no encoding for: "
+                         << attribute.getName() << ", using floats");
+                // Fall through.
+            default:
+                format[attrib] = AttribEncoding::FLOAT;
+        }
+    }
+    return format;
+}
+
+namespace {
+
+uint16_t
+toHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = int32_t((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (exponent >= 31)
+        return uint16_t(sign | 0x7c00);
+    if (exponent <= 0) {
+        if (exponent < -10)
+            return uint16_t(sign);
+        mantissa |= 0x800000;
+        auto shift = 14 - exponent;
+        auto half = (mantissa >> shift) + ((mantissa >> (shift - 1)) & 1);
+        return uint16_t(sign | half);
+    }
+    // A carry out of the mantissa correctly bumps the exponent.
+    auto half = sign | (uint32_t(exponent) << 10) | (mantissa >> 13);
+    return uint16_t(half + ((mantissa >> 12) & 1));
+}
+
+uint32_t
+toSnorm16(float value)
+{
+    auto clamped = std::max(-1.0f, std::min(1.0f, value));
+    return uint32_t(int32_t(std::floor(clamped * 32767.0f + 0.5f))) & 0xffff;
+}
+
+// Projects the unit vector onto the octahedron |x| + |y| + |z| = 1 and folds
+// the lower half over the upper one.
+uint32_t
+toOctahedral(const float* v)
+{
+    auto l1 = std::abs(v[0]) + std::abs(v[1]) + std::abs(v[2]);
+    if (l1 == 0.0f)
+        return 0;
+    auto x = v[0] / l1;
+    auto y = v[1] / l1;
+    if (v[2] < 0.0f) {
+        auto fx = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        auto fy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
+    }
+    return toSnorm16(x) | (toSnorm16(y) << 16);
+}
+
+// Bytes an attribute takes in the vertex buffer.
+size_t
+encodedSize(AttribEncoding encoding, uint8_t dims)
+{
+    switch (encoding) {
+        case AttribEncoding::HALF:
+            return sizeof(uint32_t) * ((dims + 1) / 2);
+        case AttribEncoding::OCTAHEDRAL:
+            return sizeof(uint32_t);
+        default:
+            return sizeof(float) * dims;
+    }
+}
+}
+
+gl::VboMeshRef
+createVboMesh(uint32_t numVertices, const std::vector<VertexInput>& inputs,
+              uint32_t numIndices, const uint32_t* indices,
+              const VertexFormat& format, VertexLayout layout)
+{
+    struct Packed
+    {
+        const VertexInput* input;
+        AttribEncoding encoding;
+        size_t size;
+        size_t offset;
+    };
+
+    std::vector<Packed> packed;
+    size_t vertexSize = 0;
+    for (const auto& input : inputs) {
+        auto wanted = format.find(input.attrib);
+        if (wanted == format.end())
+            continue;
+        auto encoding = wanted->second;
+        if (encoding == AttribEncoding::OCTAHEDRAL && input.dims != 3)
+            encoding = AttribEncoding::HALF;
+        auto size = encodedSize(encoding, input.dims);
+        packed.push_back({ &input, encoding, size, vertexSize });
+        vertexSize += size;
+    }
+
+    // Interleaved attributes are offset within the vertex, planar ones by
+    // the blocks of the attributes before them.
+    bool interleaved = layout == VertexLayout::INTERLEAVED;
+    if (!interleaved) {
+        for (auto& attribute : packed)
+            attribute.offset *= numVertices;
+    }
+
+    std::vector<uint8_t> buffer(vertexSize * numVertices);
+    geom::BufferLayout bufferLayout;
+    for (const auto& attribute : packed) {
+        const auto& input = *attribute.input;
+        auto dims = input.dims;
+        auto stride = interleaved ? vertexSize : attribute.size;
+        auto out = buffer.data() + attribute.offset;
+        auto in = input.data;
+        switch (attribute.encoding) {
+            case AttribEncoding::FLOAT:
+                for (uint32_t i = 0; i < numVertices; i++) {
+                    memcpy(out, in, sizeof(float) * dims);
+                    out += stride;
+                    in += input.stride;
+                }
+                bufferLayout.append(input.attrib, dims, stride,
+                                    attribute.offset);
+                break;
+            case AttribEncoding::HALF: {
+                const uint16_t one = 0x3c00;
+                auto halves = (dims + 1) & ~1;
+                for (uint32_t i = 0; i < numVertices; i++) {
+                    uint16_t values[4];
+                    for (int c = 0; c < halves; c++)
+                        values[c] = c < dims ? toHalf(in[c]) : one;
+                    memcpy(out, values, sizeof(uint16_t) * halves);
+                    out += stride;
+                    in += input.stride;
+                }
+                bufferLayout.append(input.attrib, geom::INTEGER,
+                                    uint8_t(halves / 2), stride,
+                                    attribute.offset);
+                break;
+            }
+            case AttribEncoding::OCTAHEDRAL:
+                for (uint32_t i = 0; i < numVertices; i++) {
+                    auto value = toOctahedral(in);
+                    memcpy(out, &value, sizeof(value));
+                    out += stride;
+                    in += input.stride;
+                }
+                bufferLayout.append(input.attrib, geom::INTEGER, 1, stride,
+                                    attribute.offset);
+                break;
+        }
+    }
+
+    auto vbo = gl::Vbo::create(GL_ARRAY_BUFFER, buffer.size(), buffer.data(),
+                               GL_STATIC_DRAW);
+
+    // Index ranges count indices, not bytes, so they do not care which type
+    // the indices have.
+    gl::VboRef indexVbo;
+    GLenum indexType = GL_UNSIGNED_INT;
+    if (numIndices && numVertices <= maxShortIndexVertices) {
+        std::vector<uint16_t> shortIndices(numIndices);
+        for (uint32_t i = 0; i < numIndices; i++)
+            shortIndices[i] = uint16_t(indices[i]);
+        indexVbo = gl::Vbo::create(GL_ELEMENT_ARRAY_BUFFER,
+                                   sizeof(uint16_t) * numIndices,
+                                   shortIndices.data(), GL_STATIC_DRAW);
+        indexType = GL_UNSIGNED_SHORT;
+    } else if (numIndices) {
+        indexVbo = gl::Vbo::create(GL_ELEMENT_ARRAY_BUFFER,
+                                   sizeof(uint32_t) * numIndices, indices,
+                                   GL_STATIC_DRAW);
+    }
+
+    return gl::VboMesh::create(numVertices, GL_TRIANGLES,
+                               { { bufferLayout, vbo } }, numIndices,
+                               indexType, indexVbo);
+}
+
+ci::Sphere
+MeshBuilder::bounds() const
+{
+    return Sphere(vec3(0.0f), 0.0f);
+}
+
+namespace {
+
+// Sphere around the center of the bounding box of the positions, stride in
+// floats.
+Sphere
+boundingSphere(const float* positions, size_t stride, size_t count)
+{
+    if (!positions || count == 0)
+        return Sphere(vec3(0.0f), 0.0f);
+
+    auto position = [&](size_t i) {
+        return vec3(positions[i * stride], positions[i * stride + 1],
+                    positions[i * stride + 2]);
+    };
+    vec3 minPos = position(0), maxPos = minPos;
+    for (size_t i = 1; i < count; i++) {
+        minPos = glm::min(minPos, position(i));
+        maxPos = glm::max(maxPos, position(i));
+    }
+    auto center = (minPos + maxPos) / 2.0f;
+    float radius = 0.0f;
+    for (size_t i = 0; i < count; i++)
+        radius = std::max(radius, distance(center, position(i)));
+    return Sphere(center, radius);
+}
+
+class SourceMeshBuilder : public MeshBuilder
+{
+  public:
+    SourceMeshBuilder(const geom::Source& source)
+      : source(source.clone())
+    {
+    }
+
+    gl::VboMeshRef build(const VertexFormat& format) const override
+    {
+        geom::AttribSet attribs;
+        bool quantized = false;
+        for (const auto& attribute : format) {
+            attribs.insert(attribute.first);
+            quantized |= attribute.second != AttribEncoding::FLOAT;
+        }
+        if (!quantized) {
+            gl::VboMesh::Layout layout;
+            layout.usage(GL_STATIC_DRAW)
+              .interleave(vertexLayout() == VertexLayout::INTERLEAVED);
+            for (auto attrib : attribs) {
+                auto dims = source->getAttribDims(attrib);
+                if (dims)
+                    layout.attrib(attrib, dims);
+            }
+            return gl::VboMesh::create(*source, { { layout, gl::VboRef() } });
+        }
+
+        // gl::VboMesh only knows float attributes. Go through a TriMesh,
+        // which keeps positions, normals, texture coordinates and tangents.
+        TriMesh mesh(*source);
+        std::vector<VertexInput> inputs;
+        auto add = [&](geom::Attrib attrib, const float* data) {
+            auto dims = mesh.getAttribDims(attrib);
+            if (dims && data)
+                inputs.push_back({ attrib, dims, data, dims });
+        };
+        add(geom::POSITION, mesh.getBufferPositions().data());
+        add(geom::NORMAL,
+            reinterpret_cast<const float*>(mesh.getNormals().data()));
+        add(geom::TEX_COORD_0, mesh.getBufferTexCoords0().data());
+        add(geom::TANGENT,
+            reinterpret_cast<const float*>(mesh.getTangents().data()));
+        add(geom::BITANGENT,
+            reinterpret_cast<const float*>(mesh.getBitangents().data()));
+
+        return createVboMesh(uint32_t(mesh.getNumVertices()), inputs,
+                             uint32_t(mesh.getNumIndices()),
+                             mesh.getIndices().data(), format,
+                             vertexLayout());
+    }
+
+    Sphere bounds() const override
+    {
+        if (!boundsKnown) {
+            TriMesh mesh(*source, TriMesh::Format().positions(3));
+            bounds_ = boundingSphere(mesh.getBufferPositions().data(), 3,
+                                     mesh.getNumVertices());
+            boundsKnown = true;
+        }
+        return bounds_;
+    }
+
+  private:
+    std::unique_ptr<geom::Source> source;
+    mutable bool boundsKnown = false;
+    mutable Sphere bounds_;
+};
+
+class StreamsMeshBuilder : public MeshBuilder
+{
+  public:
+    StreamsMeshBuilder(uint32_t numVertices,
+                       const std::vector<VertexInput>& inputs,
+                       uint32_t numIndices, const uint32_t* indices,
+                       const std::shared_ptr<const void>& owner)
+      : numVertices(numVertices)
+      , inputs(inputs)
+      , numIndices(numIndices)
+      , indices(indices)
+      , owner(owner)
+    {
+    }
+
+    gl::VboMeshRef build(const VertexFormat& format) const override
+    {
+        return createVboMesh(numVertices, inputs, numIndices, indices, format,
+                             vertexLayout());
+    }
+
+    Sphere bounds() const override
+    {
+        if (!boundsKnown) {
+            bounds_ = Sphere(vec3(0.0f), 0.0f);
+            for (const auto& input : inputs)
+                if (input.attrib == geom::POSITION && input.dims >= 3)
+                    bounds_ =
+                      boundingSphere(input.data, input.stride, numVertices);
+            boundsKnown = true;
+        }
+        return bounds_;
+    }
+
+  private:
+    uint32_t numVertices;
+    std::vector<VertexInput> inputs;
+    uint32_t numIndices;
+    const uint32_t* indices;
+    std::shared_ptr<const void> owner;
+    mutable bool boundsKnown = false;
+    mutable Sphere bounds_;
+};
+
+class SharedMeshBuilder : public MeshBuilder
+{
+  public:
+    SharedMeshBuilder(const MeshBuilderRef& builder)
+      : builder(builder)
+    {
+    }
+
+    gl::VboMeshRef build(const VertexFormat& format) const override
+    {
+        auto& entry = meshes[{ format, vertexLayout() }];
+        auto mesh = entry.lock();
+        if (!mesh) {
+            mesh = builder->build(format);
+            entry = mesh;
+        }
+        return mesh;
+    }
+
+    Sphere bounds() const override { return builder->bounds(); }
+
+  private:
+    MeshBuilderRef builder;
+    mutable std::map<std::pair<VertexFormat, VertexLayout>,
+                     std::weak_ptr<gl::VboMesh>>
+      meshes;
+};
+}
+
+MeshBuilderRef
+MeshBuilder::create(const geom::Source& source)
+{
+    return std::make_shared<SourceMeshBuilder>(source);
+}
+
+MeshBuilderRef
+MeshBuilder::create(uint32_t numVertices,
+                    const std::vector<VertexInput>& inputs,
+                    uint32_t numIndices, const uint32_t* indices,
+                    const std::shared_ptr<const void>& owner)
+{
+    return std::make_shared<StreamsMeshBuilder>(numVertices, inputs,
+                                                numIndices, indices, owner);
+}
+
+MeshBuilderRef
+MeshBuilder::shared(const MeshBuilderRef& builder)
+{
+    return std::make_shared<SharedMeshBuilder>(builder);
+}
+}
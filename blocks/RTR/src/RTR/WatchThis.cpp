@@ -72,8 +72,16 @@ WatchThis::checkForChanges()
 
         auto sourcesAndBatch = watchedBatches.find(sources);
         if (sourcesAndBatch != watchedBatches.end()) {
+            auto format = vertexFormat(reloaded);
             for (auto& batch : sourcesAndBatch->second) {
                 batch->replaceGlslProg(reloaded);
+                auto builder = batchBuilders.find(batch);
+                if (builder != batchBuilders.end() &&
+                    builder->second.format != format) {
+                    batch->replaceVboMesh(
+                      builder->second.builder->build(format));
+                    builder->second.format = format;
+                }
             }
         }
         auto sourcesAndMaterial = watchedMaterials.find(sources);
@@ -171,17 +179,15 @@ gl::BatchRef
 WatchThis::createWatchedBatch(const geom::Source& geomSource,
                               const ShaderSources& shaderSources)
 {
-    // Use all available atttributes to build the mesh so that shaders can
-    // be replaced later without missing any of them. This uses more memory
-    // than necessary but is more flexible. And memory is cheap anyway.
-    geom::AttribSet allAttributes;
-    for (int i = 0; i != geom::Attrib::NUM_ATTRIBS; i++)
-        allAttributes.insert(geom::Attrib(i));
-
+    // Build the mesh with just the attributes the program consumes. A copy
+    // of the source is kept to rebuild it if a reloaded program needs more.
     auto program = createWatchedProgram(shaderSources);
-    auto batch = gl::Batch::create(
-      gl::VboMesh::create(geomSource, allAttributes), program);
+    BatchBuilder builder = { MeshBuilder::create(geomSource),
+                             vertexFormat(program) };
+    auto batch =
+      gl::Batch::create(builder.builder->build(builder.format), program);
     watchedBatches[shaderSources].insert(batch);
+    batchBuilders[batch] = builder;
     return batch;
 }
 }
\ No newline at end of file
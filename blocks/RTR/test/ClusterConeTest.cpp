@@ -0,0 +1,214 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+//  Checks the normal cones of clusterBounds() with the test the scene graph
+//  culls clusters with: a cluster that is culled for an eye must not have a
+//  single triangle facing that eye. Clusters are built like the OBJ loader
+//  builds them, from the vertex cache order, on a UV sphere and on a bumpy
+//  height field, whose clusters are not convex. Eyes are random, near the
+//  surface and far away. Also checks that buildClusters() keeps within its
+//  limits and that the cone culls a fair share of the pairs. Build and run
+//  from blocks/RTR:
+/*
+    c++ -std=c++11 -O2 -Wall -Iinclude -I<glm> test/ClusterConeTest.cpp \
+      src/RTR/MeshOptimizer.cpp -pthread -o clusterconetest && \
+      ./clusterconetest
+*/
+
+#include "RTR/MeshOptimizer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+using namespace rtr;
+
+struct Vec3
+{
+    float x, y, z;
+};
+
+static Vec3
+sub(const float* a, const float* b)
+{
+    return { a[0] - b[0], a[1] - b[1], a[2] - b[2] };
+}
+
+static Vec3
+cross(const Vec3& a, const Vec3& b)
+{
+    return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+             a.x * b.y - a.y * b.x };
+}
+
+static float
+dot(const Vec3& a, const Vec3& b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static float
+length(const Vec3& a)
+{
+    return std::sqrt(dot(a, a));
+}
+
+struct Mesh
+{
+    const char* name;
+    std::vector<float> positions;
+    std::vector<uint32_t> indices;
+};
+
+// Indices of a grid of (columns + 1) x (rows + 1) vertices, two triangles
+// per cell.
+static void
+gridIndices(int columns, int rows, std::vector<uint32_t>& indices)
+{
+    for (int j = 0; j < rows; j++) {
+        for (int i = 0; i < columns; i++) {
+            uint32_t a = j * (columns + 1) + i, b = a + 1,
+                     c = a + columns + 1, d = c + 1;
+            uint32_t quad[6] = { a, c, b, b, c, d };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+}
+
+static void
+buildSphere(int slices, int stacks, Mesh& mesh)
+{
+    const float pi = 3.14159265f;
+    mesh.name = "sphere";
+    for (int j = 0; j <= stacks; j++) {
+        for (int i = 0; i <= slices; i++) {
+            auto theta = 2.0f * pi * i / slices, phi = pi * j / stacks;
+            mesh.positions.push_back(std::sin(phi) * std::cos(theta));
+            mesh.positions.push_back(std::cos(phi));
+            mesh.positions.push_back(-std::sin(phi) * std::sin(theta));
+        }
+    }
+    gridIndices(slices, stacks, mesh.indices);
+}
+
+static void
+buildHeightField(int size, Mesh& mesh)
+{
+    mesh.name = "height field";
+    for (int z = 0; z <= size; z++) {
+        for (int x = 0; x <= size; x++) {
+            auto u = 2.0f * x / size - 1.0f, v = 2.0f * z / size - 1.0f;
+            mesh.positions.push_back(u);
+            mesh.positions.push_back(0.1f * std::sin(9.0f * u) *
+                                     std::cos(7.0f * v));
+            mesh.positions.push_back(v);
+        }
+    }
+    gridIndices(size, size, mesh.indices);
+}
+
+// Checks the clusters of the mesh against random eyes. Returns the number of
+// failures and adds up the pairs.
+static int
+checkMesh(Mesh& mesh, int eyesPerCluster, std::mt19937& random,
+          size_t& pairs, size_t& culled, size_t& cullable)
+{
+    int failures = 0;
+    auto numVertices = mesh.positions.size() / 3;
+    auto& indices = mesh.indices;
+    optimizeVertexCache(indices.data(), indices.size(), numVertices);
+    auto firsts = buildClusters(indices.data(), indices.size(), numVertices);
+
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    size_t oversized = 0, wrong = 0;
+    for (size_t c = 0; c < firsts.size(); c++) {
+        auto end = c + 1 < firsts.size() ? firsts[c + 1] : indices.size();
+        auto first = indices.data() + firsts[c];
+        auto count = end - firsts[c];
+
+        std::vector<uint32_t> vertices(first, first + count);
+        std::sort(vertices.begin(), vertices.end());
+        vertices.erase(std::unique(vertices.begin(), vertices.end()),
+                       vertices.end());
+        if (vertices.size() > clusterVertices ||
+            count / 3 > clusterTriangles)
+            oversized++;
+
+        auto bounds = clusterBounds(first, count, mesh.positions.data(), 3);
+        Vec3 axis = { bounds.coneAxis[0], bounds.coneAxis[1],
+                      bounds.coneAxis[2] };
+        for (int e = 0; e < eyesPerCluster; e++) {
+            // Half of the eyes close to the cluster, where the cone has to
+            // hold for every direction, half far away.
+            auto scale = e % 2 ? 4.0f * bounds.radius : 20.0f;
+            float eye[3] = { bounds.center[0] + scale * uniform(random),
+                             bounds.center[1] + scale * uniform(random),
+                             bounds.center[2] + scale * uniform(random) };
+
+            // As in ClusterCuller::visible() in SceneGraph.cpp.
+            auto toCenter = sub(bounds.center, eye);
+            bool cull = dot(toCenter, axis) >
+                        bounds.coneCutoff * length(toCenter) + bounds.radius;
+
+            // A triangle faces the eye if the eye is in front of its plane.
+            size_t facing = 0;
+            for (size_t i = 0; i < count; i += 3) {
+                auto p0 = &mesh.positions[3 * first[i]];
+                auto normal =
+                  cross(sub(&mesh.positions[3 * first[i + 1]], p0),
+                        sub(&mesh.positions[3 * first[i + 2]], p0));
+                auto toEye = sub(eye, p0);
+                if (dot(normal, toEye) >
+                    1e-5f * length(normal) * length(toEye))
+                    facing++;
+            }
+
+            pairs++;
+            culled += cull;
+            cullable += facing == 0;
+            if (cull && facing)
+                wrong++;
+        }
+    }
+
+    std::printf("%s: %u triangles, %u clusters\n", mesh.name,
+                unsigned(indices.size() / 3), unsigned(firsts.size()));
+    if (oversized) {
+        std::printf("FAIL: %u clusters over the limits\n", unsigned(oversized));
+        failures++;
+    }
+    if (wrong) {
+        std::printf("FAIL: %u culled clusters face the eye\n", unsigned(wrong));
+        failures++;
+    }
+    return failures;
+}
+
+int
+main()
+{
+    std::mt19937 random(16);
+    size_t pairs = 0, culled = 0, cullable = 0;
+    int failures = 0;
+
+    Mesh sphere;
+    buildSphere(140, 142, sphere);
+    failures += checkMesh(sphere, 42, random, pairs, culled, cullable);
+    Mesh field;
+    buildHeightField(64, field);
+    failures += checkMesh(field, 42, random, pairs, culled, cullable);
+
+    std::printf("%u cluster and eye pairs, %u facing away, %u culled\n",
+                unsigned(pairs), unsigned(cullable), unsigned(culled));
+    // The cone is conservative, but should catch most clusters that face
+    // away from the eye.
+    if (culled < cullable / 2) {
+        std::printf("FAIL: the cone culls too little\n");
+        failures++;
+    }
+
+    std::printf(failures ? "FAILED\n" : "passed\n");
+    return failures ? 1 : 0;
+}
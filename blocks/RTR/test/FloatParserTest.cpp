@@ -0,0 +1,234 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+//  Checks that the float parser of the OBJ loader rounds like strtof() on
+//  shortest round-trip representations, fixed-point coordinates and edge
+//  cases, and measures its throughput against strtof() and the parser it
+//  replaced. Build and run from blocks/RTR:
+/*
+    c++ -std=c++11 -O2 -Wall -Iinclude test/FloatParserTest.cpp -pthread \
+      -o floattest && ./floattest
+*/
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "RTR/tiny_obj_loader.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// The parser before the fast path, for comparison. It accumulates the
+// fraction with pow() and narrows a double to float.
+static bool
+baselineParseDouble(const char* s, const char* s_end, double* result)
+{
+    if (s >= s_end)
+        return false;
+
+    double mantissa = 0.0;
+    int exponent = 0;
+    char sign = '+';
+    char exp_sign = '+';
+    const char* curr = s;
+    int read = 0;
+    bool end_not_reached = false;
+
+    if (*curr == '+' || *curr == '-') {
+        sign = *curr;
+        curr++;
+    } else if (!isdigit(*curr)) {
+        return false;
+    }
+
+    while ((end_not_reached = (curr != s_end)) && isdigit(*curr)) {
+        mantissa *= 10;
+        mantissa += static_cast<int>(*curr - 0x30);
+        curr++;
+        read++;
+    }
+    if (read == 0)
+        return false;
+    if (!end_not_reached)
+        goto assemble;
+
+    if (*curr == '.') {
+        curr++;
+        read = 1;
+        while ((end_not_reached = (curr != s_end)) && isdigit(*curr)) {
+            mantissa += static_cast<int>(*curr - 0x30) * pow(10.0, -read);
+            read++;
+            curr++;
+        }
+    } else if (*curr != 'e' && *curr != 'E') {
+        goto assemble;
+    }
+    if (!end_not_reached)
+        goto assemble;
+
+    if (*curr == 'e' || *curr == 'E') {
+        curr++;
+        if ((end_not_reached = (curr != s_end)) &&
+            (*curr == '+' || *curr == '-')) {
+            exp_sign = *curr;
+            curr++;
+        } else if (!isdigit(*curr)) {
+            return false;
+        }
+        read = 0;
+        while ((end_not_reached = (curr != s_end)) && isdigit(*curr)) {
+            exponent *= 10;
+            exponent += static_cast<int>(*curr - 0x30);
+            curr++;
+            read++;
+        }
+        exponent *= (exp_sign == '+' ? 1 : -1);
+        if (read == 0)
+            return false;
+    }
+
+assemble:
+    *result =
+      (sign == '+' ? 1 : -1) * ldexp(mantissa * pow(5.0, exponent), exponent);
+    return true;
+}
+
+static uint32_t
+bitsOf(float f)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+static int failures = 0;
+
+// Parses text with the loader and fails unless it gives the same bits as
+// strtof().
+static void
+check(const char* text)
+{
+    float parsed = 0.0f;
+    if (!tinyobj::tryParseFloat(text, text + std::strlen(text), &parsed)) {
+        if (failures++ < 10)
+            std::printf("FAIL: %s does not parse\n", text);
+        return;
+    }
+    float expected = std::strtof(text, nullptr);
+    if (bitsOf(parsed) != bitsOf(expected) && failures++ < 10)
+        std::printf("FAIL: %s parses to %.9g instead of %.9g\n", text, parsed,
+                    expected);
+}
+
+// The shortest decimal that reads back as f.
+static void
+shortest(float f, char* text)
+{
+    for (int precision = 1; precision < 9; precision++) {
+        std::sprintf(text, "%.*g", precision, f);
+        if (std::strtof(text, nullptr) == f)
+            return;
+    }
+    std::sprintf(text, "%.9g", f);
+}
+
+// Calls parse on each number of text, separated by single spaces, and
+// returns the throughput in MB/s.
+template <typename Parse>
+static double
+throughput(const std::string& text, Parse parse, float& sum)
+{
+    auto start = Clock::now();
+    const char* curr = text.data();
+    const char* end = curr + text.size();
+    while (curr < end) {
+        auto next =
+          static_cast<const char*>(std::memchr(curr, ' ', end - curr));
+        if (!next)
+            next = end;
+        sum += parse(curr, next);
+        curr = next + 1;
+    }
+    auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return text.size() / seconds / 1e6;
+}
+
+int
+main()
+{
+    std::mt19937 random(7);
+    char text[64];
+
+    // Shortest representations of random floats of all magnitudes.
+    const int numShortest = 1000000;
+    std::uniform_int_distribution<uint32_t> anyBits;
+    for (int i = 0; i < numShortest; i++) {
+        auto bits = anyBits(random);
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        if (!std::isfinite(f))
+            continue;
+        shortest(f, text);
+        check(text);
+    }
+
+    // Coordinates the way exporters write them.
+    std::uniform_real_distribution<float> coordinate(-1000.0f, 1000.0f);
+    for (int i = 0; i < numShortest; i++) {
+        auto f = coordinate(random);
+        std::sprintf(text, "%.6f", f);
+        check(text);
+        std::sprintf(text, "%.4f", f / 1000.0f);
+        check(text);
+    }
+
+    // Halfway cases, long mantissas, the limits of float and numbers that
+    // do not need the fast path.
+    const char* edges[] = { "0", "-0", "+1", "1.", "1e0", "1E+2", "-1e-2",
+                            "0.000000", "16777216", "16777217", "16777219",
+                            "0.1000000000000000055511151231257827",
+                            "1.00000005960464477539062500000000001",
+                            "1.000000059604644775390625",
+                            "3.4028235e38", "3.4028236e38", "1e39",
+                            "1.17549435e-38", "1.4e-45", "7e-46", "1e-50",
+                            "123456789012345678901234567890",
+                            "0.00000000000000000000000000123",
+                            "9007199254740993", "2.2250738585072014e-308" };
+    for (auto edge : edges)
+        check(edge);
+
+    std::printf("%d parses differ from strtof()\n", failures);
+
+    // Throughput on typical OBJ coordinates.
+    std::string numbers;
+    while (numbers.size() < (64 << 20)) {
+        std::sprintf(text, "%.6f ", coordinate(random));
+        numbers += text;
+    }
+    float sum = 0.0f;
+    auto fast = throughput(numbers, [](const char* s, const char* end) {
+        float f = 0.0f;
+        tinyobj::tryParseFloat(s, end, &f);
+        return f;
+    }, sum);
+    auto baseline = throughput(numbers, [](const char* s, const char* end) {
+        double d = 0.0;
+        baselineParseDouble(s, end, &d);
+        return float(d);
+    }, sum);
+    auto library = throughput(numbers, [](const char* s, const char*) {
+        return std::strtof(s, nullptr);
+    }, sum);
+    std::printf("tryParseFloat %.0f MB/s, previous parser %.0f MB/s, "
+                "strtof %.0f MB/s (%g)\n",
+                fast, baseline, library, sum);
+
+    std::printf(failures ? "FAILED\n" : "passed\n");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,158 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+//  Compares loading OBJ files from a memory mapping, in place, with loading
+//  them line by line from a std::istream. Checks that both give the same
+//  shapes. Without arguments it loads a synthetic grid of about 150 MB and the
+//  duck asset. Build and run from blocks/RTR:
+/*
+    c++ -std=c++11 -O2 -Wall -Iinclude test/ObjLoadBench.cpp -pthread \
+      -o objbench && ./objbench [file.obj ...]
+*/
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "RTR/tiny_obj_loader.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// Writes a grid of size x size quads with positions, texture coordinates and
+// normals.
+static void
+writeGrid(const std::string& file, int size)
+{
+    std::ofstream out(file.c_str());
+    char line[128];
+    for (int y = 0; y <= size; y++) {
+        for (int x = 0; x <= size; x++) {
+            float u = float(x) / size, v = float(y) / size;
+            float height = 0.01f * ((x * 7 + y * 13) % 17);
+            std::sprintf(line, "v %.6f %.6f %.6f\nvt %.6f %.6f\n"
+                               "vn 0.000000 1.000000 0.000000\n",
+                         u * 100.0f, height, v * 100.0f, u, v);
+            out << line;
+        }
+    }
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            int a = y * (size + 1) + x + 1, b = a + 1, c = a + size + 1,
+                d = c + 1;
+            std::sprintf(line, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d\n", a, a,
+                         a, c, c, c, d, d, d, b, b, b);
+            out << line;
+        }
+    }
+}
+
+static bool
+sameShapes(const std::vector<tinyobj::shape_t>& a,
+           const std::vector<tinyobj::shape_t>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        const auto& x = a[i].mesh;
+        const auto& y = b[i].mesh;
+        if (a[i].name != b[i].name || x.positions != y.positions ||
+            x.normals != y.normals || x.texcoords != y.texcoords ||
+            x.indices != y.indices || x.num_vertices != y.num_vertices ||
+            x.material_ids != y.material_ids)
+            return false;
+    }
+    return true;
+}
+
+// The fastest of a few loads, in milliseconds.
+template <typename Load>
+static double
+bestOf(Load load)
+{
+    double best = 1e30;
+    for (int run = 0; run < 3; run++) {
+        auto start = Clock::now();
+        load();
+        best = std::min(
+          best,
+          std::chrono::duration<double, std::milli>(Clock::now() - start)
+            .count());
+    }
+    return best;
+}
+
+static bool
+compare(const std::string& file)
+{
+    auto base = file.substr(0, file.find_last_of("/\\") + 1);
+    std::ifstream size(file.c_str(), std::ios::binary | std::ios::ate);
+    double megabytes = double(size.tellg()) / 1e6;
+
+    std::vector<tinyobj::shape_t> mapped, streamed, parallel;
+    std::vector<tinyobj::material_t> materials;
+    std::string err;
+    bool ok = true;
+
+    auto mappedTime = bestOf([&] {
+        mapped.clear();
+        materials.clear();
+        ok &= tinyobj::LoadObj(mapped, materials, err, file.c_str(),
+                               base.c_str());
+    });
+    auto parallelTime = bestOf([&] {
+        parallel.clear();
+        materials.clear();
+        ok &= tinyobj::LoadObj(parallel, materials, err, file.c_str(),
+                               base.c_str(), true, 0);
+    });
+    auto streamedTime = bestOf([&] {
+        streamed.clear();
+        materials.clear();
+        std::ifstream in(file.c_str());
+        tinyobj::MaterialFileReader reader(base);
+        ok &= tinyobj::LoadObj(streamed, materials, err, in, reader);
+    });
+    if (!ok) {
+        std::printf("FAIL: %s does not load: %s\n", file.c_str(), err.c_str());
+        return false;
+    }
+
+    std::printf("%s, %.1f MB\n", file.c_str(), megabytes);
+    std::printf("  istream         %8.1f ms %7.1f MB/s\n", streamedTime,
+                megabytes / streamedTime * 1e3);
+    std::printf("  mapped          %8.1f ms %7.1f MB/s\n", mappedTime,
+                megabytes / mappedTime * 1e3);
+    std::printf("  mapped, threads %8.1f ms %7.1f MB/s\n", parallelTime,
+                megabytes / parallelTime * 1e3);
+
+    if (!sameShapes(mapped, streamed) || !sameShapes(mapped, parallel)) {
+        std::printf("FAIL: the shapes of %s differ\n", file.c_str());
+        return false;
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    std::vector<std::string> files(argv + 1, argv + argc);
+    std::string grid;
+    if (files.empty()) {
+        grid = "objbench-grid.obj";
+        writeGrid(grid, 1000);
+        files.push_back(grid);
+        files.push_back("../../assets/duck/duck.obj");
+    }
+
+    int failures = 0;
+    for (const auto& file : files)
+        failures += !compare(file);
+    if (!grid.empty())
+        std::remove(grid.c_str());
+
+    std::printf(failures ? "FAILED\n" : "passed\n");
+    return failures ? 1 : 0;
+}
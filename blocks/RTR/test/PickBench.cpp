@@ -0,0 +1,217 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+//  Measures picking through Node::pick() on a scene of terrain tiles with
+//  millions of triangles: the first pick when hierarchies are built on
+//  demand, the time buildTriangleBvhs() takes in the background, and picks
+//  once the hierarchies are built. Checks the hits against testing every
+//  triangle. Needs no GL context. size is the number of quads per side of
+//  a tile. Build and run from blocks/RTR:
+/*
+    c++ -std=c++11 -O2 -Wall -Iinclude -I<cinder>/include \
+      test/PickBench.cpp src/RTR/[A-Z]*.cpp src/RTR/tiny_obj_loader.cc \
+      -L<cinder>/lib -lcinder -pthread -o pickbench && ./pickbench [size]
+*/
+
+#include "RTR/SceneGraph.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace ci;
+using namespace rtr;
+
+using Clock = std::chrono::steady_clock;
+
+static double
+milliseconds(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+static const int tilesPerSide = 4;
+static const float tileSize = 10.0f;
+
+// A height field over [0, tileSize]^2 that differs from tile to tile.
+struct Tile
+{
+    vec3 offset;
+    std::vector<float> positions;
+    std::vector<uint32_t> indices;
+};
+
+static void
+buildTile(int size, int index, Tile& tile)
+{
+    for (int z = 0; z <= size; z++) {
+        for (int x = 0; x <= size; x++) {
+            float u = tileSize * x / size, v = tileSize * z / size;
+            float height = 0.5f * std::sin(0.7f * u + index) *
+                             std::cos(0.9f * v - index) +
+                           0.05f * std::sin(7.0f * u) * std::sin(5.0f * v);
+            tile.positions.push_back(u);
+            tile.positions.push_back(height);
+            tile.positions.push_back(v);
+        }
+    }
+    for (int z = 0; z < size; z++) {
+        for (int x = 0; x < size; x++) {
+            uint32_t a = z * (size + 1) + x, b = a + 1, c = a + size + 1,
+                     d = c + 1;
+            uint32_t quad[6] = { a, c, b, b, c, d };
+            tile.indices.insert(tile.indices.end(), quad, quad + 6);
+        }
+    }
+}
+
+// A node per tile, with a shape whose hierarchy is built by its source.
+static NodeRef
+buildScene(const std::vector<Tile>& tiles, std::vector<ShapeRef>& shapes)
+{
+    auto material = Material::create(gl::GlslProgRef());
+    auto radius = std::sqrt(0.5f * tileSize * tileSize + 1.0f);
+    auto root = Node::create();
+    for (const auto& tile : tiles) {
+        auto shape = Shape::create(std::vector<gl::VboMeshRef>(), material);
+        shape->setBounds(
+          Sphere(vec3(0.5f * tileSize, 0.0f, 0.5f * tileSize), radius));
+        auto data = &tile;
+        shape->setTriangleBvhSource([data] {
+            return TriangleBvh::create(data->indices.data(),
+                                       data->indices.size(),
+                                       data->positions.data(), 3);
+        });
+        shapes.push_back(shape);
+        root->addChild(Node::create({ Model::create({ shape }) },
+                                    glm::translate(tile.offset)));
+    }
+    return root;
+}
+
+// The closest hit among all triangles of all tiles, in the space of the
+// ray, and the tile it is on.
+static bool
+intersectAll(const Ray& ray, const std::vector<Tile>& tiles, float& distance,
+             size_t& hitTile)
+{
+    bool found = false;
+    distance = 1e30f;
+    auto d = ray.getDirection();
+    for (size_t i = 0; i < tiles.size(); i++) {
+        const auto& tile = tiles[i];
+        auto o = ray.getOrigin() - tile.offset;
+        for (size_t t = 0; t < tile.indices.size() / 3; t++) {
+            auto corner = [&](int k) {
+                auto p = &tile.positions[3 * tile.indices[3 * t + k]];
+                return vec3(p[0], p[1], p[2]);
+            };
+            auto v0 = corner(0), e1 = corner(1) - v0, e2 = corner(2) - v0;
+            auto p = glm::cross(d, e2);
+            auto det = glm::dot(e1, p);
+            if (std::abs(det) < 1e-20f)
+                continue;
+            auto inverse = 1.0f / det;
+            auto s = o - v0;
+            auto u = glm::dot(s, p) * inverse;
+            auto q = glm::cross(s, e1);
+            auto v = glm::dot(d, q) * inverse;
+            auto t0 = glm::dot(e2, q) * inverse;
+            if (u < 0.0f || v < 0.0f || u + v > 1.0f || t0 <= 0.0f ||
+                t0 >= distance)
+                continue;
+            distance = t0;
+            hitTile = i;
+            found = true;
+        }
+    }
+    return found;
+}
+
+int
+main(int argc, char** argv)
+{
+    int size = argc > 1 ? std::atoi(argv[1]) : 256;
+    std::vector<Tile> tiles(tilesPerSide * tilesPerSide);
+    size_t numTriangles = 0;
+    for (int i = 0; i < int(tiles.size()); i++) {
+        tiles[i].offset = vec3((i % tilesPerSide) * tileSize, 0.0f,
+                               (i / tilesPerSide) * tileSize);
+        buildTile(size, i, tiles[i]);
+        numTriangles += tiles[i].indices.size() / 3;
+    }
+    std::printf("%u tiles, %.1fM triangles\n", unsigned(tiles.size()),
+                numTriangles / 1e6);
+
+    // Rays from above, slightly tilted, over the whole scene.
+    std::mt19937 random(7);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    auto extent = tilesPerSide * tileSize;
+    auto randomRay = [&] {
+        vec3 origin(uniform(random) * extent, 20.0f, uniform(random) * extent);
+        vec3 direction(uniform(random) - 0.5f, -2.0f, uniform(random) - 0.5f);
+        return Ray(origin, direction);
+    };
+    auto centerRay = Ray(vec3(0.5f * extent, 20.0f, 0.5f * extent),
+                         vec3(0.1f, -1.0f, 0.05f));
+
+    // Building on demand stalls the first pick on each shape it tests.
+    {
+        std::vector<ShapeRef> shapes;
+        auto scene = buildScene(tiles, shapes);
+        PickResult result;
+        auto start = Clock::now();
+        scene->pick(centerRay, result);
+        std::printf("first pick, building on demand: %.1f ms\n",
+                    milliseconds(start));
+    }
+
+    std::vector<ShapeRef> shapes;
+    auto scene = buildScene(tiles, shapes);
+    auto start = Clock::now();
+    buildTriangleBvhs(shapes);
+    auto started = milliseconds(start);
+    for (const auto& shape : shapes)
+        shape->triangleBvh();
+    std::printf("buildTriangleBvhs() returns in %.2f ms, all hierarchies "
+                "are built after %.1f ms\n",
+                started, milliseconds(start));
+
+    PickResult result;
+    start = Clock::now();
+    scene->pick(centerRay, result);
+    std::printf("first pick, built in the background: %.3f ms\n",
+                milliseconds(start));
+
+    const int picks = 10000;
+    int hits = 0;
+    start = Clock::now();
+    for (int i = 0; i < picks; i++)
+        hits += scene->pick(randomRay(), result);
+    std::printf("%d picks, %d hits, %.2f us per pick\n", picks, hits,
+                milliseconds(start) * 1000.0 / picks);
+
+    int mismatches = 0;
+    const int checks = 100;
+    for (int i = 0; i < checks; i++) {
+        auto ray = randomRay();
+        float distance;
+        size_t tile = 0;
+        bool hitA = scene->pick(ray, result);
+        bool hitB = intersectAll(ray, tiles, distance, tile);
+        if (hitA != hitB ||
+            (hitA && (result.shape != shapes[tile] ||
+                      std::abs(result.distance - distance) >
+                        1e-4f * distance)))
+            mismatches++;
+    }
+    std::printf("%d rays, %d differ from testing every triangle\n", checks,
+                mismatches);
+
+    std::printf(mismatches ? "FAILED\n" : "passed\n");
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,194 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+//  Checks simplifyMesh() on a bumpy height field with a texture seam down
+//  its middle, simplified level by level like the OBJ loader builds levels
+//  of detail: each level has at most half the triangles of the one before
+//  until only the border is left, the border and the seam stay in place,
+//  and no triangle folds over. A height field has no overhangs, so no
+//  triangle of any level may face down, and together they must cover the
+//  ground exactly once. Build and run from blocks/RTR:
+/*
+    c++ -std=c++11 -O2 -Wall -Iinclude -I<glm> test/SimplifyTest.cpp \
+      src/RTR/MeshOptimizer.cpp -pthread -o simplifytest && ./simplifytest
+*/
+
+#include "RTR/MeshOptimizer.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <set>
+#include <utility>
+#include <vector>
+
+using namespace rtr;
+
+// Position, then texture coordinates.
+static const size_t stride = 5;
+
+// Quads per side of the height field.
+static const int size = 64;
+
+static float
+height(float x, float z)
+{
+    return 1.5f * std::sin(0.15f * x) * std::cos(0.11f * z) +
+           0.3f * std::sin(0.7f * x + 0.4f * z);
+}
+
+// Vertices of the grid, with the column in the middle twice, once for each
+// side of the seam.
+struct HeightField
+{
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+};
+
+static void
+buildHeightField(HeightField& field)
+{
+    const int columns = size + 2;
+    const int seamColumn = size / 2;
+    for (int z = 0; z <= size; z++) {
+        for (int c = 0; c < columns; c++) {
+            auto x = float(c <= seamColumn ? c : c - 1);
+            auto u = c <= seamColumn ? x / size : x / size + 0.5f;
+            float vertex[stride] = { x, height(x, float(z)), float(z), u,
+                                     float(z) / size };
+            field.vertices.insert(field.vertices.end(), vertex,
+                                  vertex + stride);
+        }
+    }
+    auto vertex = [&](int x, int z) {
+        return uint32_t(z * columns + (x <= seamColumn ? x : x + 1));
+    };
+    for (int z = 0; z < size; z++) {
+        for (int x = 0; x < size; x++) {
+            // The quads right of the seam use its second copy.
+            auto left = x == seamColumn ? uint32_t(z * columns + x + 1)
+                                        : vertex(x, z);
+            auto leftUp = x == seamColumn ? uint32_t((z + 1) * columns + x + 1)
+                                          : vertex(x, z + 1);
+            auto right = vertex(x + 1, z), rightUp = vertex(x + 1, z + 1);
+            uint32_t quad[6] = { left, leftUp, right, leftUp, rightUp, right };
+            field.indices.insert(field.indices.end(), quad, quad + 6);
+        }
+    }
+}
+
+// Edges used by a single triangle, as (from, to) in the winding order.
+static std::set<std::pair<uint32_t, uint32_t>>
+borderEdges(const std::vector<uint32_t>& indices)
+{
+    std::set<std::pair<uint32_t, uint32_t>> edges;
+    for (size_t t = 0; t < indices.size(); t += 3)
+        for (int k = 0; k < 3; k++)
+            edges.insert({ indices[t + k], indices[t + (k + 1) % 3] });
+    std::set<std::pair<uint32_t, uint32_t>> border;
+    for (const auto& edge : edges)
+        if (!edges.count({ edge.second, edge.first }))
+            border.insert(edge);
+    return border;
+}
+
+// Checks the triangles of a level against the height field. Returns the
+// number of failures.
+static int
+checkLevel(const HeightField& field, const std::vector<uint32_t>& indices,
+           const std::set<std::pair<uint32_t, uint32_t>>& border)
+{
+    int failures = 0;
+
+    if (borderEdges(indices) != border) {
+        std::printf("FAIL: the border or the seam has changed\n");
+        failures++;
+    }
+
+    // Triangles that face down are folded over. The others cover the ground
+    // exactly once only if none of them overlap. Triangles whose corners are
+    // in a line seen from above, as along the border, stand upright and
+    // cover nothing; they are counted, but fold nothing over.
+    size_t folded = 0, standing = 0;
+    double area = 0.0;
+    for (size_t t = 0; t < indices.size(); t += 3) {
+        auto a = &field.vertices[indices[t] * stride];
+        auto b = &field.vertices[indices[t + 1] * stride];
+        auto c = &field.vertices[indices[t + 2] * stride];
+        // The y component of the normal of a counter-clockwise triangle,
+        // seen from above, is twice its area on the ground.
+        auto up =
+          (c[0] - a[0]) * (b[2] - a[2]) - (b[0] - a[0]) * (c[2] - a[2]);
+        if (up < -1e-6f)
+            folded++;
+        else if (up <= 1e-6f)
+            standing++;
+        area += 0.5 * up;
+    }
+    if (standing)
+        std::printf("  %u triangles stand upright\n", unsigned(standing));
+    if (folded) {
+        std::printf("FAIL: %u folded triangles\n", unsigned(folded));
+        failures++;
+    }
+    if (std::fabs(area - double(size) * size) > 1e-3 * size * size) {
+        std::printf("FAIL: the triangles cover %g of %d\n", area,
+                    size * size);
+        failures++;
+    }
+    return failures;
+}
+
+int
+main()
+{
+    HeightField field;
+    buildHeightField(field);
+    auto numVertices = field.vertices.size() / stride;
+    auto border = borderEdges(field.indices);
+    std::printf("%u triangles, %u border and seam edges\n",
+                unsigned(field.indices.size() / 3), unsigned(border.size()));
+
+    int failures = checkLevel(field, field.indices, border);
+    auto finer = field.indices;
+    float total = 0.0f;
+    int levels = 0;
+    for (;;) {
+        auto target = finer.size() / 3 / 2 * 3;
+        float error = 0.0f;
+        auto coarser =
+          simplifyMesh(finer.data(), finer.size(), field.vertices.data(),
+                       stride, numVertices, target, &error);
+        total += error;
+        levels++;
+        std::printf("level %d: %u -> %u triangles, target %u, error %g\n",
+                    levels, unsigned(finer.size() / 3),
+                    unsigned(coarser.size() / 3), unsigned(target / 3), error);
+        // Each border and seam edge keeps a triangle, so only a mesh that
+        // is mostly border may miss the target.
+        auto bound = coarser.size() / 3 <= border.size();
+        if (coarser.size() > target && !bound) {
+            std::printf("FAIL: more triangles than the target\n");
+            failures++;
+        }
+        if (coarser.size() < target / 2) {
+            std::printf("FAIL: far fewer triangles than the target\n");
+            failures++;
+        }
+        if (!(error >= 0.0f) || !std::isfinite(error)) {
+            std::printf("FAIL: error bound %g\n", error);
+            failures++;
+        }
+        failures += checkLevel(field, coarser, border);
+        if (bound)
+            break;
+        finer = coarser;
+    }
+    std::printf("%d levels, total error bound %g\n", levels, total);
+    if (levels < 4) {
+        std::printf("FAIL: stopped before the border\n");
+        failures++;
+    }
+
+    std::printf(failures ? "FAILED\n" : "passed\n");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,150 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+//  Checks the hits of a TriangleBvh against testing every triangle, and
+//  measures how long it takes to build and to pick with. Build and run from
+//  blocks/RTR:
+/*
+    c++ -std=c++11 -O2 -Wall -Iinclude -I<cinder>/include \
+      test/TriangleBvhTest.cpp src/RTR/TriangleBvh.cpp -L<cinder>/lib \
+      -lcinder -pthread -o bvhtest && ./bvhtest [quads per side]
+*/
+
+#include "RTR/TriangleBvh.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace ci;
+using namespace rtr;
+
+using Clock = std::chrono::steady_clock;
+
+static double
+microseconds(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(Clock::now() - start)
+      .count();
+}
+
+// A sphere with bumps, so that the triangles are not all alike, with four
+// floats per vertex.
+static void
+bumpySphere(int size, std::vector<float>& positions,
+            std::vector<uint32_t>& indices)
+{
+    const float pi = 3.14159265f;
+    for (int i = 0; i <= size; i++) {
+        for (int j = 0; j <= size; j++) {
+            auto theta = pi * i / size;
+            auto phi = 2.0f * pi * j / size;
+            auto r = 1.0f + 0.05f * std::sin(13 * theta) * std::cos(7 * phi);
+            positions.push_back(r * std::sin(theta) * std::cos(phi));
+            positions.push_back(r * std::cos(theta));
+            positions.push_back(r * std::sin(theta) * std::sin(phi));
+            positions.push_back(0.0f);
+        }
+    }
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++) {
+            uint32_t a = i * (size + 1) + j, b = a + 1, c = a + size + 1,
+                     d = c + 1;
+            uint32_t quad[6] = { a, c, b, b, c, d };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+}
+
+// The closest hit among all triangles.
+static bool
+intersectAll(const Ray& ray, const std::vector<float>& positions,
+             const std::vector<uint32_t>& indices, TriangleBvh::Hit& hit)
+{
+    bool found = false;
+    hit.distance = 1e30f;
+    auto o = ray.getOrigin(), d = ray.getDirection();
+    for (size_t t = 0; t < indices.size() / 3; t++) {
+        auto corner = [&](int k) {
+            auto p = &positions[4 * indices[3 * t + k]];
+            return vec3(p[0], p[1], p[2]);
+        };
+        auto v0 = corner(0), e1 = corner(1) - v0, e2 = corner(2) - v0;
+        auto p = glm::cross(d, e2);
+        auto det = glm::dot(e1, p);
+        if (std::abs(det) < 1e-20f)
+            continue;
+        // The same arithmetic as the hierarchy, so that distances are equal.
+        auto inverse = 1.0f / det;
+        auto s = o - v0;
+        auto u = glm::dot(s, p) * inverse;
+        auto q = glm::cross(s, e1);
+        auto v = glm::dot(d, q) * inverse;
+        auto distance = glm::dot(e2, q) * inverse;
+        if (u < 0.0f || v < 0.0f || u + v > 1.0f || distance <= 0.0f ||
+            distance >= hit.distance)
+            continue;
+        hit = { distance, uint32_t(t), vec2(u, v) };
+        found = true;
+    }
+    return found;
+}
+
+int
+main(int argc, char** argv)
+{
+    int size = argc > 1 ? std::atoi(argv[1]) : 500;
+    std::vector<float> positions;
+    std::vector<uint32_t> indices;
+    bumpySphere(size, positions, indices);
+
+    auto start = Clock::now();
+    auto bvh = TriangleBvh::create(indices.data(), indices.size(),
+                                   positions.data(), 4);
+    std::printf("%u triangles, %u nodes, built in %.1f ms\n",
+                unsigned(bvh->numTriangles()), unsigned(bvh->numNodes()),
+                microseconds(start) / 1000.0);
+
+    // Rays from around the sphere and from its center through it.
+    std::mt19937 random(5);
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    auto randomRay = [&](int i) {
+        vec3 origin(uniform(random) * 3.0f, uniform(random) * 3.0f,
+                    uniform(random) * 3.0f);
+        vec3 target(uniform(random) * 0.9f, uniform(random) * 0.9f,
+                    uniform(random) * 0.9f);
+        if (i % 5 == 0)
+            origin = vec3(0.0f);
+        return Ray(origin, target - origin);
+    };
+
+    int mismatches = 0;
+    const int checks = 300;
+    for (int i = 0; i < checks; i++) {
+        auto ray = randomRay(i);
+        TriangleBvh::Hit a, b;
+        bool hitA = bvh->intersect(ray, 1e30f, a);
+        bool hitB = intersectAll(ray, positions, indices, b);
+        if (hitA != hitB ||
+            (hitA && (a.triangle != b.triangle || a.distance != b.distance)))
+            mismatches++;
+    }
+    std::printf("%d rays, %d differ from testing every triangle\n", checks,
+                mismatches);
+
+    const int picks = 100000;
+    int hits = 0;
+    start = Clock::now();
+    for (int i = 0; i < picks; i++) {
+        TriangleBvh::Hit hit;
+        hits += bvh->intersect(randomRay(i), 1e30f, hit);
+    }
+    std::printf("%d picks, %d hits, %.2f us per pick\n", picks, hits,
+                microseconds(start) / picks);
+
+    std::printf(mismatches ? "FAILED\n" : "passed\n");
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+//  Measures the cost of deduplicating the (v, vt, vn) triples of OBJ faces
+//  with the open-addressing vertex_cache of the loader against the std::map
+//  it replaced, and checks that both number the vertices alike. Build and
+//  run from blocks/RTR:
+/*
+    c++ -std=c++11 -O2 -Wall -Iinclude test/VertexCacheBench.cpp -pthread \
+      -o cachebench && ./cachebench [faces in millions]
+*/
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "RTR/tiny_obj_loader.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+using namespace tinyobj;
+
+using Clock = std::chrono::steady_clock;
+
+// The order of the std::map the loader used before.
+struct Less
+{
+    bool operator()(const vertex_index& a, const vertex_index& b) const
+    {
+        if (a.v_idx != b.v_idx)
+            return a.v_idx < b.v_idx;
+        if (a.vn_idx != b.vn_idx)
+            return a.vn_idx < b.vn_idx;
+        return a.vt_idx < b.vt_idx;
+    }
+};
+
+// The corners of the triangles of a grid as they appear in an OBJ file. The
+// texture coordinates of each row are separate, so that triples differ in
+// more than one index.
+static std::vector<vertex_index>
+gridCorners(size_t numFaces)
+{
+    int size = 1;
+    while (2 * size_t(size) * size < numFaces)
+        size++;
+    std::vector<vertex_index> corners;
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            int a = y * (size + 1) + x, b = a + 1, c = a + size + 1, d = c + 1;
+            int quad[6] = { a, c, d, a, d, b };
+            for (int v : quad)
+                corners.push_back(vertex_index(v, v + y, v % 7));
+        }
+    }
+    corners.resize(3 * numFaces);
+    return corners;
+}
+
+// Numbers the corners of groups of groupFaces faces and returns the time per
+// million faces in milliseconds.
+template <typename Cache>
+static double
+dedup(const std::vector<vertex_index>& corners, size_t groupFaces,
+      std::vector<unsigned int>& indices)
+{
+    indices.clear();
+    auto start = Clock::now();
+    Cache cache;
+    for (size_t group = 0; group < corners.size(); group += 3 * groupFaces) {
+        cache.clear();
+        unsigned int numVertices = 0;
+        auto end = std::min(corners.size(), group + 3 * groupFaces);
+        for (size_t i = group; i < end; i++) {
+            bool inserted;
+            auto& index = cache.insert(corners[i], inserted);
+            if (inserted)
+                index = numVertices++;
+            indices.push_back(index);
+        }
+    }
+    auto ms =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    return ms / (corners.size() / 3 / 1e6);
+}
+
+// The std::map behind the interface of vertex_cache.
+class MapCache
+{
+  public:
+    unsigned int& insert(const vertex_index& key, bool& inserted)
+    {
+        auto result = map.insert(std::make_pair(key, 0u));
+        inserted = result.second;
+        return result.first->second;
+    }
+
+    void clear() { map.clear(); }
+
+  private:
+    std::map<vertex_index, unsigned int, Less> map;
+};
+
+int
+main(int argc, char** argv)
+{
+    double millions = argc > 1 ? std::atof(argv[1]) : 4.0;
+    auto corners = gridCorners(size_t(millions * 1e6));
+
+    int failures = 0;
+    size_t groupSizes[] = { corners.size() / 3, 10000, 100 };
+    for (auto groupFaces : groupSizes) {
+        std::vector<unsigned int> hashed, mapped;
+        auto hashTime = dedup<vertex_cache>(corners, groupFaces, hashed);
+        auto mapTime = dedup<MapCache>(corners, groupFaces, mapped);
+        std::printf("%.1fM faces in groups of %u: vertex_cache %.1f ms, "
+                    "std::map %.1f ms per million faces\n",
+                    corners.size() / 3 / 1e6, unsigned(groupFaces), hashTime,
+                    mapTime);
+        if (hashed != mapped) {
+            std::printf("FAIL: the vertices are numbered differently\n");
+            failures++;
+        }
+    }
+
+    std::printf(failures ? "FAILED\n" : "passed\n");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,166 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+//  Compares fetching vertices from planar and interleaved buffers on the CPU,
+//  as a headless stand-in for the vertex fetch of the GPU. The buffers are
+//  arranged like createVboMesh() arranges them for the float attributes of
+//  an OBJ shape with tangents. Vertices are fetched in the order of the
+//  indices, once as the loader leaves them and once with the triangles
+//  shuffled. Reports the time and the cache lines touched per vertex. Build
+//  and run from blocks/RTR:
+/*
+    c++ -std=c++11 -O2 -Wall test/VertexLayoutBench.cpp -o layoutbench \
+      && ./layoutbench [vertices in millions]
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// Position, normal, texture coordinates, tangent and bitangent.
+static const int numAttributes = 5;
+static const size_t dims[numAttributes] = { 3, 3, 2, 3, 3 };
+static const size_t stride = 14;
+static const size_t cacheLine = 64;
+
+// Where each attribute of vertex v starts, in 4 byte words from the start
+// of the buffer.
+struct Layout
+{
+    size_t offsets[numAttributes];
+    size_t strides[numAttributes];
+
+    size_t at(int attribute, uint32_t v) const
+    {
+        return offsets[attribute] + strides[attribute] * v;
+    }
+};
+
+static Layout
+planar(size_t numVertices)
+{
+    Layout layout;
+    size_t offset = 0;
+    for (int a = 0; a < numAttributes; a++) {
+        layout.offsets[a] = offset;
+        layout.strides[a] = dims[a];
+        offset += dims[a] * numVertices;
+    }
+    return layout;
+}
+
+static Layout
+interleaved()
+{
+    Layout layout;
+    size_t offset = 0;
+    for (int a = 0; a < numAttributes; a++) {
+        layout.offsets[a] = offset;
+        layout.strides[a] = stride;
+        offset += dims[a];
+    }
+    return layout;
+}
+
+// Sums all attributes of the vertices in index order and returns the time
+// per vertex in nanoseconds. The values are summed as integers, so that the
+// time is spent fetching rather than adding.
+static double
+fetch(const std::vector<uint32_t>& buffer, const Layout& layout,
+      const std::vector<uint32_t>& indices, uint32_t& sum)
+{
+    auto start = Clock::now();
+    for (int run = 0; run < 3; run++) {
+        for (auto v : indices) {
+            for (int a = 0; a < numAttributes; a++) {
+                auto p = &buffer[layout.at(a, v)];
+                for (size_t d = 0; d < dims[a]; d++)
+                    sum += p[d];
+            }
+        }
+    }
+    auto ns =
+      std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    return ns / (3.0 * indices.size());
+}
+
+// The cache lines a single vertex spans, on average.
+static double
+linesPerVertex(const Layout& layout, size_t numVertices)
+{
+    size_t lines = 0;
+    for (uint32_t v = 0; v < numVertices; v++) {
+        std::vector<size_t> touched;
+        for (int a = 0; a < numAttributes; a++) {
+            auto first = layout.at(a, v) * 4 / cacheLine;
+            auto last = ((layout.at(a, v) + dims[a]) * 4 - 1) / cacheLine;
+            for (auto line = first; line <= last; line++)
+                touched.push_back(line);
+        }
+        std::sort(touched.begin(), touched.end());
+        lines += std::unique(touched.begin(), touched.end()) - touched.begin();
+    }
+    return double(lines) / numVertices;
+}
+
+int
+main(int argc, char** argv)
+{
+    double millions = argc > 1 ? std::atof(argv[1]) : 2.0;
+    int size = 1;
+    while (double(size + 1) * (size + 1) < millions * 1e6)
+        size++;
+    size_t numVertices = size_t(size + 1) * (size + 1);
+
+    // A grid in row order, which is how the loader orders the vertices of
+    // such a mesh after optimizing it.
+    std::vector<uint32_t> indices;
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            uint32_t a = y * (size + 1) + x, b = a + 1, c = a + size + 1,
+                     d = c + 1;
+            uint32_t quad[6] = { a, c, d, a, d, b };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    std::vector<uint32_t> shuffled(indices.size());
+    {
+        std::vector<uint32_t> triangles(indices.size() / 3);
+        for (uint32_t t = 0; t < triangles.size(); t++)
+            triangles[t] = t;
+        std::shuffle(triangles.begin(), triangles.end(), std::mt19937(3));
+        for (size_t t = 0; t < triangles.size(); t++)
+            for (int k = 0; k < 3; k++)
+                shuffled[3 * t + k] = indices[3 * triangles[t] + k];
+    }
+
+    // The bits of the attribute values.
+    std::vector<uint32_t> buffer(numVertices * stride);
+    std::mt19937 random(5);
+    for (auto& value : buffer)
+        value = random();
+
+    uint32_t sum = 0;
+    auto planarLayout = planar(numVertices);
+    auto interleavedLayout = interleaved();
+    std::printf("%.1fM vertices, %u bytes each\n", numVertices / 1e6,
+                unsigned(stride * 4));
+    std::printf("  cache lines per vertex: planar %.2f, interleaved %.2f\n",
+                linesPerVertex(planarLayout, numVertices),
+                linesPerVertex(interleavedLayout, numVertices));
+    std::printf("  optimized order: planar %.2f ns, interleaved %.2f ns per "
+                "vertex\n",
+                fetch(buffer, planarLayout, indices, sum),
+                fetch(buffer, interleavedLayout, indices, sum));
+    std::printf("  shuffled order:  planar %.2f ns, interleaved %.2f ns per "
+                "vertex (%u)\n",
+                fetch(buffer, planarLayout, shuffled, sum),
+                fetch(buffer, interleavedLayout, shuffled, sum), sum);
+    return 0;
+}
@@ -0,0 +1,144 @@
+//
+//  Copyright 2016 Henrik Tramberend, Hartmut Schirmacher
+//
+//  Checks that welding a curved mesh exported as separate faces restores
+//  the shared mesh, and that tangents computed after welding match those of
+//  the shared mesh. Build and run from blocks/RTR:
+/*
+    c++ -std=c++11 -O2 -Wall -Iinclude -I<glm> test/WeldTest.cpp \
+      src/RTR/MeshOptimizer.cpp -pthread -o weldtest && ./weldtest
+*/
+
+#include "RTR/MeshOptimizer.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+using namespace rtr;
+
+// Position, normal, texture coordinates, then gaps for the tangent and the
+// bitangent, like the OBJ loader interleaves them.
+static const size_t stride = 14;
+
+// A UV sphere. Vertex (i, j) is on slice i and stack j.
+static void
+sphereVertex(int i, int j, int slices, int stacks, float* vertex)
+{
+    const float pi = 3.14159265f;
+    auto u = float(i) / slices;
+    auto v = float(j) / stacks;
+    auto theta = 2.0f * pi * u;
+    auto phi = pi * v;
+    float normal[3] = { std::sin(phi) * std::cos(theta), std::cos(phi),
+                        std::sin(phi) * std::sin(theta) };
+    for (int k = 0; k < 3; k++) {
+        vertex[k] = 2.0f * normal[k];
+        vertex[3 + k] = normal[k];
+    }
+    vertex[6] = u;
+    vertex[7] = v;
+    for (int k = 8; k < 14; k++)
+        vertex[k] = 0.0f;
+}
+
+// The corners of the two triangles of quad (i, j).
+static void
+quadCorners(int i, int j, int corners[6][2])
+{
+    const int offsets[6][2] = { { 0, 0 }, { 0, 1 }, { 1, 1 },
+                                { 0, 0 }, { 1, 1 }, { 1, 0 } };
+    for (int c = 0; c < 6; c++) {
+        corners[c][0] = i + offsets[c][0];
+        corners[c][1] = j + offsets[c][1];
+    }
+}
+
+static void
+computeInterleavedTangents(const std::vector<uint32_t>& indices,
+                           std::vector<float>& vertices)
+{
+    auto data = vertices.data();
+    computeTangents(indices.data(), indices.size(), vertices.size() / stride,
+                    data, data + 3, data + 6, data + 8, data + 11, stride);
+}
+
+int
+main()
+{
+    const int slices = 64, stacks = 32;
+    int failures = 0;
+
+    // The shared mesh, the reference.
+    std::vector<float> shared((slices + 1) * (stacks + 1) * stride);
+    for (int j = 0; j <= stacks; j++)
+        for (int i = 0; i <= slices; i++)
+            sphereVertex(i, j, slices, stacks,
+                         &shared[(j * (slices + 1) + i) * stride]);
+    std::vector<uint32_t> sharedIndices;
+    for (int j = 0; j < stacks; j++) {
+        for (int i = 0; i < slices; i++) {
+            int corners[6][2];
+            quadCorners(i, j, corners);
+            for (auto& corner : corners)
+                sharedIndices.push_back(
+                  uint32_t(corner[1] * (slices + 1) + corner[0]));
+        }
+    }
+    computeInterleavedTangents(sharedIndices, shared);
+
+    // Every quad with vertices of its own, as some exporters write them.
+    std::vector<float> separate;
+    std::vector<uint32_t> separateIndices;
+    for (int j = 0; j < stacks; j++) {
+        for (int i = 0; i < slices; i++) {
+            int corners[6][2];
+            quadCorners(i, j, corners);
+            for (auto& corner : corners) {
+                separateIndices.push_back(uint32_t(separate.size() / stride));
+                separate.resize(separate.size() + stride);
+                sphereVertex(corner[0], corner[1], slices, stacks,
+                             &separate[separate.size() - stride]);
+            }
+        }
+    }
+
+    // Tangents first, as the loader used to do, keeps the split vertices
+    // apart, because their tangents sum up different triangles.
+    {
+        auto vertices = separate;
+        auto indices = separateIndices;
+        computeInterleavedTangents(indices, vertices);
+        auto welded = weldVertices(vertices, stride, indices.data(),
+                                   indices.size());
+        std::printf("tangents before welding: %u vertices\n", welded);
+    }
+
+    auto welded = weldVertices(separate, stride, separateIndices.data(),
+                               separateIndices.size());
+    computeInterleavedTangents(separateIndices, separate);
+    std::printf("tangents after welding: %u vertices, shared mesh %u\n",
+                welded, uint32_t(shared.size() / stride));
+    if (welded != shared.size() / stride) {
+        std::printf("FAIL: vertex count\n");
+        failures++;
+    }
+
+    // Same triangles in the same order, so the welded vertices must have
+    // the tangents of the shared ones.
+    float maxError = 0.0f;
+    for (size_t i = 0; i < separateIndices.size(); i++) {
+        auto a = &separate[separateIndices[i] * stride];
+        auto b = &shared[sharedIndices[i] * stride];
+        for (size_t k = 0; k < stride; k++)
+            maxError = std::max(maxError, std::fabs(a[k] - b[k]));
+    }
+    std::printf("largest difference to the shared mesh: %g\n", maxError);
+    if (maxError > 1e-5f) {
+        std::printf("FAIL: attributes\n");
+        failures++;
+    }
+
+    std::printf(failures ? "FAILED\n" : "passed\n");
+    return failures ? 1 : 0;
+}
@@ -1,6 +1,11 @@
 #include "cinder/app/App.h"
 #include "cinder/app/RendererGl.h"
 #include "cinder/gl/gl.h"
+#include "cinder/Camera.h"
+#include "cinder/Log.h"
+#include "cinder/Timer.h"
+
+#include "RTR/RTR.h"
 
 using namespace ci;
 using namespace ci::app;
@@ -10,25 +15,76 @@ class MyopicApp : public App {
   public:
 	void setup() override;
 	void mouseDown( MouseEvent event ) override;
+	void keyDown( KeyEvent event ) override;
 	void update() override;
 	void draw() override;
+	void cleanup() override;
+
+  private:
+	CameraPersp		mCam;
+	rtr::NodeRef	mScene;
+	bool			mPicked = false;
+	vec3			mPickPosition;
 };
 
 void MyopicApp::setup()
 {
+	auto duck = rtr::loadObjFile( getAssetPath( "duck/duck.obj" ) );
+	mScene = rtr::Node::create( { duck } );
+
+	mCam.setPerspective( 60, getWindowAspectRatio(), 0.1f, 1000 );
+	mCam.lookAt( vec3( 0, 2, 5 ), vec3( 0 ) );
 }
 
 void MyopicApp::mouseDown( MouseEvent event )
 {
+	auto ray = mCam.generateRay( vec2( event.getPos() ), vec2( getWindowSize() ) );
+	rtr::PickResult result;
+	Timer timer( true );
+	mPicked = mScene->pick( ray, result );
+	timer.stop();
+	if( mPicked ) {
+		mPickPosition = result.position;
+		CI_LOG_I( "picked triangle " << result.triangle << " of instance " << result.instance << " at " << result.distance << " in " << timer.getSeconds() * 1e6 << " us" );
+	}
+	else {
+		CI_LOG_I( "picked nothing in " << timer.getSeconds() * 1e6 << " us" );
+	}
+}
+
+void MyopicApp::keyDown( KeyEvent event )
+{
+	if( event.getChar() == 'q' ) {
+		rtr::enableRenderQueue( ! rtr::renderQueueEnabled() );
+		CI_LOG_I( "render queue " << ( rtr::renderQueueEnabled() ? "on" : "off" ) );
+	}
 }
 
 void MyopicApp::update()
 {
+	rtr::textureLoader.update();
 }
 
 void MyopicApp::draw()
 {
-	gl::clear( Color( 0, 0, 0 ) ); 
+	gl::clear( Color( 0, 0, 0 ) );
+	gl::enableDepthRead();
+	gl::enableDepthWrite();
+	gl::setMatrices( mCam );
+	mScene->draw();
+
+	if( mPicked ) {
+		gl::ScopedGlslProg shader( gl::getStockShader( gl::ShaderDef().color() ) );
+		gl::ScopedColor color( 1, 0, 0 );
+		gl::drawSphere( mPickPosition, 0.1f );
+	}
+}
+
+void MyopicApp::cleanup()
+{
+	// Releases the GL objects of the textures while the context is current.
+	mScene.reset();
+	rtr::shutdownTextures();
 }
 
 CINDER_APP( MyopicApp, RendererGl )